@@ -0,0 +1,347 @@
+import argparse
+import os
+import shlex
+import signal
+import socket
+import struct
+import subprocess
+import threading
+import time
+from typing import Dict, List, Optional
+
+# =================================================================
+# Throughput benchmark for the broker.
+#
+# Starts each given server command on its own port and measures:
+#   - connections/sec: CONNECT -> CONNACK -> DISCONNECT cycles
+#   - messages/sec:    QoS 0 PUBLISH fan-out to a set of subscribers
+#   - destroy:         the exp_destroy.sh workload, many short-lived
+#                      publishers (connect, publish, disconnect) sending to
+#                      a set of subscribers
+#
+# Usage:
+#   python3 exp_bench.py ./server ./server-fork
+#   python3 exp_bench.py "./server - 4 threads" "./server - 4 prefork"
+#
+# The port is given to each server as its first argument, replacing a
+# leading "-" if there is one.
+#
+# To compare against the original fork-per-connection model, build the
+# baseline commit into another binary (e.g. with `git worktree`) and pass
+# both paths. Only the Python standard library is needed.
+# =================================================================
+
+TOPIC = "bench.topic"
+
+
+def encode_var_int(value: int) -> bytes:
+    out = bytearray()
+    while True:
+        byte = value % 128
+        value //= 128
+        if value > 0:
+            byte |= 128
+        out.append(byte)
+        if value == 0:
+            return bytes(out)
+
+
+def encode_string(value: str) -> bytes:
+    raw = value.encode()
+    return struct.pack("!H", len(raw)) + raw
+
+
+def packet(first_byte: int, body: bytes) -> bytes:
+    return bytes([first_byte]) + encode_var_int(len(body)) + body
+
+
+def connect_packet() -> bytes:
+    # protocol name, version 5, clean start, keep alive, no properties, empty client id
+    body = encode_string("MQTT") + bytes([5, 0x02]) + struct.pack("!H", 60) + b"\x00" + encode_string("")
+    return packet(0x10, body)
+
+
+def subscribe_packet(topic: str, packet_id: int = 1) -> bytes:
+    body = struct.pack("!H", packet_id) + b"\x00" + encode_string(topic) + b"\x00"
+    return packet(0x82, body)
+
+
+def publish_packet(topic: str, payload: bytes) -> bytes:
+    return packet(0x30, encode_string(topic) + b"\x00" + payload)
+
+
+DISCONNECT = b"\xe0\x00"
+
+
+def publish_payload_size(frame: bytes) -> int:
+    pos = 1
+    while frame[pos] & 128:
+        pos += 1
+    pos += 1
+    topic_len = struct.unpack("!H", frame[pos:pos + 2])[0]
+    pos += 2 + topic_len
+    # properties length, always a single 0 byte coming from this broker
+    pos += 1
+    return len(frame) - pos
+
+
+class PacketReader:
+    """Splits a TCP byte stream into MQTT control packets."""
+
+    def __init__(self, sock: socket.socket):
+        self.sock = sock
+        self.buffer = bytearray()
+
+    def next_packet(self) -> Optional[bytes]:
+        while True:
+            size = self._frame_size()
+            if size is not None and len(self.buffer) >= size:
+                frame = bytes(self.buffer[:size])
+                del self.buffer[:size]
+                return frame
+            chunk = self.sock.recv(65536)
+            if not chunk:
+                return None
+            self.buffer += chunk
+
+    def _frame_size(self) -> Optional[int]:
+        multiplier, length, pos = 1, 0, 1
+        while pos < len(self.buffer):
+            byte = self.buffer[pos]
+            length += (byte & 127) * multiplier
+            multiplier *= 128
+            pos += 1
+            if byte & 128 == 0:
+                return pos + length
+        return None
+
+
+def open_client(port: int) -> socket.socket:
+    sock = socket.create_connection(("127.0.0.1", port))
+    sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    sock.sendall(connect_packet())
+    reader = PacketReader(sock)
+    connack = reader.next_packet()
+    if connack is None or connack[0] >> 4 != 2:
+        raise RuntimeError("broker did not answer CONNECT with CONNACK")
+    return sock
+
+
+def bench_connections(port: int, duration: float, clients: int) -> float:
+    """Returns how many full connect/disconnect cycles were done per second."""
+    done = [0] * clients
+    stop_at = time.monotonic() + duration
+
+    def worker(idx: int) -> None:
+        while time.monotonic() < stop_at:
+            try:
+                sock = open_client(port)
+                sock.sendall(DISCONNECT)
+                sock.close()
+                done[idx] += 1
+            except OSError:
+                time.sleep(0.001)
+
+    threads = [threading.Thread(target=worker, args=(i,)) for i in range(clients)]
+    start = time.monotonic()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    return sum(done) / (time.monotonic() - start)
+
+
+def bench_messages(port: int, subscribers: int, messages: int, size: int) -> Dict[str, float]:
+    """Publishes `messages` PUBLISH packets and waits for every subscriber."""
+    received = [0] * subscribers
+    ready = threading.Barrier(subscribers + 1)
+    last_seen = [time.monotonic()]
+
+    def subscriber(idx: int) -> None:
+        sock = open_client(port)
+        sock.sendall(subscribe_packet(TOPIC))
+        reader = PacketReader(sock)
+        reader.next_packet()  # SUBACK
+        ready.wait()
+        sock.settimeout(3.0)
+        try:
+            while received[idx] < messages:
+                frame = reader.next_packet()
+                if frame is None:
+                    break
+                if frame[0] >> 4 == 3:
+                    # Count payload bytes rather than packets: the FIFO based
+                    # broker may merge several messages into one PUBLISH.
+                    received[idx] += publish_payload_size(frame) // size
+                    last_seen[0] = time.monotonic()
+        except socket.timeout:
+            pass
+        sock.sendall(DISCONNECT)
+        sock.close()
+
+    threads = [threading.Thread(target=subscriber, args=(i,)) for i in range(subscribers)]
+    for t in threads:
+        t.start()
+    ready.wait()
+    # the original broker needs time for its per-topic children to start reading
+    time.sleep(0.5)
+
+    payload = b"x" * size
+    frame = publish_packet(TOPIC, payload)
+    pub = open_client(port)
+    start = time.monotonic()
+    batch = 100
+    for sent in range(0, messages, batch):
+        pub.sendall(frame * min(batch, messages - sent))
+    published = time.monotonic()
+    for t in threads:
+        t.join()
+    pub.sendall(DISCONNECT)
+    pub.close()
+
+    delivered = sum(received)
+    elapsed = max(last_seen[0], published) - start
+    return {
+        "published/s": messages / max(published - start, 1e-9),
+        "delivered/s": delivered / max(elapsed, 1e-9),
+        "delivered": delivered,
+        "expected": subscribers * messages,
+    }
+
+
+def bench_destroy(port: int, subscribers: int, loops: int, publishers: int) -> Dict[str, float]:
+    """Mirrors exp_destroy.sh: `loops` rounds of `publishers` concurrent clients
+    that each connect, publish a single message and disconnect."""
+    messages = loops * publishers
+    received = [0] * subscribers
+    ready = threading.Barrier(subscribers + 1)
+    last_seen = [time.monotonic()]
+    message = b"hello from bash script"
+
+    def subscriber(idx: int) -> None:
+        sock = open_client(port)
+        sock.sendall(subscribe_packet(TOPIC))
+        reader = PacketReader(sock)
+        reader.next_packet()  # SUBACK
+        ready.wait()
+        sock.settimeout(3.0)
+        try:
+            while received[idx] < messages:
+                frame = reader.next_packet()
+                if frame is None:
+                    break
+                if frame[0] >> 4 == 3:
+                    received[idx] += publish_payload_size(frame) // len(message)
+                    last_seen[0] = time.monotonic()
+        except socket.timeout:
+            pass
+        sock.sendall(DISCONNECT)
+        sock.close()
+
+    def publisher() -> None:
+        try:
+            sock = open_client(port)
+            sock.sendall(publish_packet(TOPIC, message) + DISCONNECT)
+            sock.close()
+        except (OSError, RuntimeError):
+            pass
+
+    threads = [threading.Thread(target=subscriber, args=(i,)) for i in range(subscribers)]
+    for t in threads:
+        t.start()
+    ready.wait()
+    time.sleep(0.5)
+
+    start = time.monotonic()
+    for _ in range(loops):
+        round_threads = [threading.Thread(target=publisher) for _ in range(publishers)]
+        for t in round_threads:
+            t.start()
+        for t in round_threads:
+            t.join()
+    published = time.monotonic()
+    for t in threads:
+        t.join()
+
+    delivered = sum(received)
+    elapsed = max(last_seen[0], published) - start
+    return {
+        "publishers/s": messages / max(published - start, 1e-9),
+        "destroy delivered/s": delivered / max(elapsed, 1e-9),
+        "destroy delivered": delivered,
+        "destroy expected": subscribers * messages,
+    }
+
+
+def start_server(command: str, port: int) -> subprocess.Popen:
+    argv = shlex.split(command)
+    argv[0] = os.path.abspath(argv[0])
+    if len(argv) > 1 and argv[1] == "-":
+        argv[1] = str(port)
+    else:
+        argv.insert(1, str(port))
+    proc = subprocess.Popen(argv, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    deadline = time.monotonic() + 10
+    while time.monotonic() < deadline:
+        try:
+            socket.create_connection(("127.0.0.1", port), timeout=0.2).close()
+            return proc
+        except OSError:
+            time.sleep(0.1)
+    proc.kill()
+    raise RuntimeError(f"{command} did not start listening on port {port}")
+
+
+def stop_server(proc: subprocess.Popen) -> None:
+    proc.send_signal(signal.SIGINT)
+    try:
+        proc.wait(timeout=5)
+    except subprocess.TimeoutExpired:
+        proc.kill()
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description="Connection and message throughput benchmark for MQTT brokers.")
+    parser.add_argument(
+        "servers", nargs="+",
+        help="Server commands to benchmark, one after the other, e.g. \"./server - 4 prefork\"."
+    )
+    parser.add_argument("--port", type=int, default=17170, help="First port to use. Each server gets its own.")
+    parser.add_argument("--duration", type=float, default=5.0, help="Seconds spent on the connection benchmark.")
+    parser.add_argument("--clients", type=int, default=8, help="Concurrent connecting clients.")
+    parser.add_argument("--subscribers", type=int, default=10, help="Subscribers for the message benchmark.")
+    parser.add_argument("--messages", type=int, default=2000, help="Messages published in the message benchmark.")
+    parser.add_argument("--size", type=int, default=32, help="Payload size in bytes.")
+    parser.add_argument("--destroy-subscribers", type=int, default=50, help="Subscribers for the destroy workload.")
+    parser.add_argument("--destroy-loops", type=int, default=50, help="Publisher rounds of the destroy workload.")
+    parser.add_argument("--destroy-publishers", type=int, default=50, help="Publishers per round of the destroy workload.")
+    args = parser.parse_args()
+
+    results: List[Dict[str, object]] = []
+    for i, command in enumerate(args.servers):
+        port = args.port + i
+        print(f"--- Benchmarking {command} on port {port} ---")
+        proc = start_server(command, port)
+        try:
+            conns = bench_connections(port, args.duration, args.clients)
+            msgs = bench_messages(port, args.subscribers, args.messages, args.size)
+            destroy = bench_destroy(port, args.destroy_subscribers, args.destroy_loops, args.destroy_publishers)
+        finally:
+            stop_server(proc)
+        results.append({"server": command, "connections/s": conns, **msgs, **destroy})
+
+    print()
+    print(
+        f"{'server':<28} {'conn/s':>8} {'published/s':>12} {'delivered/s':>12} {'delivered':>16} "
+        f"{'publishers/s':>13} {'destroy dlv/s':>14} {'destroy dlv':>16}"
+    )
+    for r in results:
+        print(
+            f"{r['server']:<28} {r['connections/s']:>8.0f} {r['published/s']:>12.0f} "
+            f"{r['delivered/s']:>12.0f} {r['delivered']:>7}/{r['expected']:<8} "
+            f"{r['publishers/s']:>13.0f} {r['destroy delivered/s']:>14.0f} "
+            f"{r['destroy delivered']:>7}/{r['destroy expected']:<8}"
+        )
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,214 @@
+/* Microbenchmark for the fd-based packet reader.
+ *
+ * A thread writes QoS 0 PUBLISH packets to one end of a socket pair, and
+ * `read_control_packet` decodes them from the other end, first reading
+ * straight from the socket and then through the read-ahead buffer of io.c.
+ *
+ * Before that, it checks that the Remaining Length computed for outgoing
+ * packets matches the bytes that are actually written.
+ *
+ * Usage:
+ *   make exp_codec
+ *   ./exp_codec [packets] [topic length] [payload length]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "mqtt.h"
+#include "io.h"
+
+typedef struct Stream {
+    int fd;
+    uint8_t *frames;
+    size_t frames_len;
+    long repeat;
+} Stream;
+
+/* Helper function. */
+static size_t encode_publish(uint8_t *out, size_t topic_len, size_t payload_len) {
+    size_t remaining = 2 + topic_len + 1 + payload_len;
+    size_t pos = 0;
+
+    out[pos++] = PUBLISH << 4;
+    size_t x = remaining;
+    do {
+        uint8_t byte = x % 128;
+        x /= 128;
+        if (x > 0) { byte |= 128; }
+        out[pos++] = byte;
+    } while (x > 0);
+
+    out[pos++] = topic_len >> 8;
+    out[pos++] = topic_len & 0xFF;
+    memset(out + pos, 't', topic_len);
+    pos += topic_len;
+    out[pos++] = 0; /* no properties */
+    memset(out + pos, 'p', payload_len);
+    pos += payload_len;
+    return pos;
+}
+
+/* Helper function. */
+static void *write_stream(void *arg) {
+    Stream *stream = (Stream*)arg;
+    for (long i = 0; i < stream->repeat; i++) {
+        size_t sent = 0;
+        while (sent < stream->frames_len) {
+            ssize_t put = write(stream->fd, stream->frames + sent, stream->frames_len - sent);
+            if (put <= 0) {
+                perror("write");
+                exit(EXIT_FAILURE);
+            }
+            sent += put;
+        }
+    }
+    return NULL;
+}
+
+/* Helper function. */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Helper function. */
+static void run(const char *name, int read_ahead, long packets, size_t topic_len, size_t payload_len) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+
+    /* batches of 100 packets per write */
+    long batch = 100;
+    uint8_t *frame = (uint8_t*)malloc(16 + topic_len + payload_len);
+    size_t frame_len = encode_publish(frame, topic_len, payload_len);
+    Stream stream = { .fd = fds[0], .frames_len = frame_len * batch, .repeat = packets / batch };
+    stream.frames = (uint8_t*)malloc(stream.frames_len);
+    for (long i = 0; i < batch; i++) {
+        memcpy(stream.frames + i * frame_len, frame, frame_len);
+    }
+
+    if (read_ahead) {
+        io_read_ahead(fds[1]);
+    }
+
+    pthread_t writer;
+    IoStats before = io_stats();
+    double start = now();
+    pthread_create(&writer, NULL, write_stream, &stream);
+
+    long total = stream.repeat * batch;
+    for (long i = 0; i < total; i++) {
+        MqttControlPacket packet;
+        read_control_packet(fds[1], &packet);
+        destroy_control_packet(packet);
+    }
+
+    double elapsed = now() - start;
+    IoStats after = io_stats();
+    pthread_join(writer, NULL);
+
+    unsigned long reads = after.reads - before.reads;
+    printf(
+        "%-12s %10ld %12.0f %12lu %14.3f\n",
+        name, total, total / elapsed, reads, (double)reads / total
+    );
+
+    io_detach(fds[1]);
+    close(fds[0]);
+    close(fds[1]);
+    free(frame);
+    free(stream.frames);
+}
+
+/* Helper function. */
+static size_t var_int_size(uint32_t val) {
+    size_t size = 1;
+    while (val >= 128) {
+        val /= 128;
+        size++;
+    }
+    return size;
+}
+
+/* Helper function.
+ * Writes PUBLISH packets with properties into a channel instead of a socket,
+ * then compares their Remaining Length with what was written and decodes
+ * them back. */
+static void check_sizes(void) {
+    size_t payload_lens[] = { 0, 1, 100, 127, 128, 16383, 16384, 2097151, 2097152 };
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+
+    MqttProperty props[2];
+    props[0].id = 2; /* Message Expiry Interval */
+    props[0].content.four_byte = 60;
+    props[1].id = 38; /* User Property */
+    props[1].content.string_pair.str1 = (String){ .len = 3, .val = "key" };
+    props[1].content.string_pair.str2 = (String){ .len = 5, .val = "value" };
+
+    for (size_t i = 0; i < sizeof(payload_lens) / sizeof(payload_lens[0]); i++) {
+        char *payload = (char*)calloc(1, payload_lens[i] + 1);
+        String topic = { .len = 6, .val = "sizes/" };
+        MqttControlPacket publish = create_publish(topic, payload, payload_lens[i]);
+        publish.var_header.publish.props = props;
+        publish.var_header.publish.props_len = 2;
+
+        IoChannel channel = { 0 };
+        io_attach(fds[0], &channel);
+        write_control_packet(fds[0], &publish);
+        io_detach(fds[0]);
+
+        size_t written = channel.out.end - channel.out.start;
+        uint32_t remaining = publish.fixed_header.len;
+        MqttControlPacket decoded;
+        ssize_t decoded_len = decode_control_packet(channel.out.data + channel.out.start, written, &decoded);
+
+        if (written != 1 + var_int_size(remaining) + remaining || decoded_len != (ssize_t)written) {
+            fprintf(stderr,
+                "Remaining Length %u doesn't match the %zu bytes written for a %zu byte payload\n",
+                remaining, written, payload_lens[i]
+            );
+            exit(EXIT_FAILURE);
+        }
+        if (decoded.var_header.publish.props_len != 2 || (size_t)decoded.payload.other.len != payload_lens[i]) {
+            fprintf(stderr, "PUBLISH with a %zu byte payload didn't decode back\n", payload_lens[i]);
+            exit(EXIT_FAILURE);
+        }
+
+        destroy_control_packet(decoded);
+        io_buffer_free(&channel.out);
+        free(payload);
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+    printf("Remaining Length matches the bytes written for %zu payload sizes\n",
+           sizeof(payload_lens) / sizeof(payload_lens[0]));
+}
+
+int main(int argc, char **argv) {
+    long packets = argc >= 2 ? atol(argv[1]) : 200000;
+    size_t topic_len = argc >= 3 ? (size_t)atol(argv[2]) : 16;
+    size_t payload_len = argc >= 4 ? (size_t)atol(argv[3]) : 32;
+
+    check_sizes();
+
+    printf("PUBLISH with a %zu byte topic and a %zu byte payload\n", topic_len, payload_len);
+    printf("%-12s %10s %12s %12s %14s\n", "reader", "packets", "packets/s", "read calls", "reads/packet");
+    run("unbuffered", 0, packets, topic_len, payload_len);
+    run("read-ahead", 1, packets, topic_len, payload_len);
+    return 0;
+}
@@ -0,0 +1,253 @@
+/* Microbenchmark for PUBLISH fan-out.
+ *
+ * Queues one PUBLISH to N subscribers and then lets every queue go, as the
+ * loops do once the packet is sent, in three ways:
+ * - encode: each subscriber gets the packet encoded again, like the
+ *   shared-nothing mode did when writing it to each target;
+ * - copy: the packet is encoded once and copied into each queue, like the
+ *   threads mode did;
+ * - shared: the packet is encoded once into a frame, and each queue holds a
+ *   reference to it (`frame_hold`), the way the server queues it now.
+ * Reports the time and process CPU time per delivery, and the bytes
+ * allocated per PUBLISH.
+ *
+ * Then, for growing amounts of subscribers whose queues take a lock,
+ * measures how long it takes until the last of them has a
+ * PUBLISH queued, with one thread doing all of it (serial) and with the
+ * fan-out pool of `fanout.c` helping (pool), and reports the percentiles.
+ *
+ * Usage:
+ *   make exp_fanout
+ *   ./exp_fanout [deliveries per case] [fan-out threads]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "mqtt.h"
+#include "fanout.h"
+
+#define SPREAD_MAX 100000
+
+typedef enum Strategy {
+    ENCODE,
+    COPY,
+    SHARED,
+} Strategy;
+
+/* What a connection queued for each packet, before `queue.h` */
+typedef struct Queued {
+    struct Queued *next;
+    Frame *frame;
+} Queued;
+
+/* A subscriber's queue, under a lock */
+typedef struct Inbox {
+    pthread_mutex_t lock;
+    Queued *head;
+    Queued *tail;
+} Inbox;
+
+/* A PUBLISH being queued to `inboxes`, see `spread` */
+typedef struct Spread {
+    Inbox *inboxes;
+    Frame *frame;
+} Spread;
+
+/* Helper function. */
+static double now(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Helper function. */
+static Queued *queue(Frame *frame) {
+    Queued *item = (Queued*)malloc(sizeof(Queued));
+    if (!item) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(EXIT_FAILURE);
+    }
+    item->next = NULL;
+    item->frame = frame;
+    return item;
+}
+
+/* Helper function.
+ * Queues one PUBLISH to `subscribers` queues, then releases all of them.
+ * Returns the bytes allocated for it. */
+static size_t fan_out(Strategy strategy, Queued **queues, size_t subscribers,
+                      String topic, char *payload, size_t payload_len) {
+    size_t allocated = 0;
+    MqttControlPacket send = create_publish(topic, payload, payload_len);
+    Frame *frame = strategy == ENCODE ? NULL : frame_encode(&send);
+
+    for (size_t i = 0; i < subscribers; i++) {
+        Frame *own;
+        if (strategy == ENCODE) {
+            own = frame_encode(&send);
+        } else if (strategy == COPY) {
+            own = frame_from_bytes(frame->data, frame->len);
+        } else {
+            frame_hold(frame);
+            own = frame;
+        }
+        queues[i] = queue(own);
+        allocated += sizeof(Queued) + (strategy == SHARED ? 0 : sizeof(Frame) + own->len);
+    }
+    if (frame) {
+        allocated += sizeof(Frame) + frame->len;
+        frame_release(frame);
+    }
+
+    for (size_t i = 0; i < subscribers; i++) {
+        frame_release(queues[i]->frame);
+        free(queues[i]);
+    }
+    return allocated;
+}
+
+/* Helper function.
+ * A `FanoutTask`, `arg` is a Spread */
+static void spread(size_t begin, size_t end, void *arg) {
+    Spread *job = (Spread*)arg;
+    for (size_t i = begin; i < end; i++) {
+        Inbox *inbox = &job->inboxes[i];
+        Queued *item = queue(job->frame);
+        frame_hold(job->frame);
+        pthread_mutex_lock(&inbox->lock);
+        if (inbox->tail) {
+            inbox->tail->next = item;
+        } else {
+            inbox->head = item;
+        }
+        inbox->tail = item;
+        pthread_mutex_unlock(&inbox->lock);
+    }
+}
+
+/* Helper function.
+ * Empties every inbox, as their loops would once the packets are sent */
+static void drain(Inbox *inboxes, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        Queued *item = inboxes[i].head;
+        while (item) {
+            Queued *next = item->next;
+            frame_release(item->frame);
+            free(item);
+            item = next;
+        }
+        inboxes[i].head = inboxes[i].tail = NULL;
+    }
+}
+
+/* Helper function. */
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/* Helper function.
+ * Prints the percentiles of the time until the last subscriber has the
+ * PUBLISH, over `publishes` of them. */
+static void measure_spread(Inbox *inboxes, size_t subscribers, int pool, long publishes,
+                           String topic, char *payload) {
+    double *latencies = (double*)malloc(publishes * sizeof(double));
+    if (!latencies) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(EXIT_FAILURE);
+    }
+    for (long i = 0; i < publishes; i++) {
+        MqttControlPacket send = create_publish(topic, payload, 32);
+        double start = now(CLOCK_MONOTONIC);
+        Spread job = { .inboxes = inboxes, .frame = frame_encode(&send) };
+        if (pool) {
+            fanout_run(subscribers, spread, &job);
+        } else {
+            spread(0, subscribers, &job);
+        }
+        latencies[i] = now(CLOCK_MONOTONIC) - start;
+        frame_release(job.frame);
+        drain(inboxes, subscribers);
+    }
+
+    qsort(latencies, publishes, sizeof(double), compare_doubles);
+    printf("%11zu %8s %10.1f %10.1f %10.1f %10.1f\n",
+           subscribers, pool ? "pool" : "serial",
+           latencies[publishes / 2] * 1e6, latencies[publishes * 9 / 10] * 1e6,
+           latencies[publishes * 99 / 100] * 1e6, latencies[publishes - 1] * 1e6);
+    free(latencies);
+}
+
+int main(int argc, char **argv) {
+    long deliveries = argc >= 2 ? atol(argv[1]) : 4000000;
+    long threads = argc >= 3 ? atol(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    const char *names[] = { "encode", "copy", "shared" };
+    size_t subscriber_amounts[] = { 10, 1000, 10000 };
+    size_t payload_lens[] = { 32, 1024 };
+
+    char topic_name[] = "fleet/r1/d42/m7";
+    String topic = { .val = topic_name, .len = strlen(topic_name) };
+    char *payload = (char*)malloc(1024);
+    memset(payload, 'x', 1024);
+    Queued **queues = (Queued**)malloc(10000 * sizeof(Queued*));
+
+    printf("%11s %8s %8s %10s %10s %14s\n",
+           "subscribers", "payload", "strategy", "ns/deliv", "cpu ns", "bytes/publish");
+    for (size_t p = 0; p < sizeof(payload_lens) / sizeof(payload_lens[0]); p++) {
+        for (size_t n = 0; n < sizeof(subscriber_amounts) / sizeof(subscriber_amounts[0]); n++) {
+            size_t subscribers = subscriber_amounts[n];
+            long publishes = deliveries / subscribers;
+            if (publishes < 1) {
+                publishes = 1;
+            }
+
+            for (Strategy s = ENCODE; s <= SHARED; s++) {
+                size_t allocated = 0;
+                double start = now(CLOCK_MONOTONIC);
+                double cpu_start = now(CLOCK_PROCESS_CPUTIME_ID);
+                for (long i = 0; i < publishes; i++) {
+                    allocated = fan_out(s, queues, subscribers, topic, payload, payload_lens[p]);
+                }
+                double elapsed = now(CLOCK_MONOTONIC) - start;
+                double cpu = now(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+
+                double total = (double)publishes * subscribers;
+                printf("%11zu %8zu %8s %10.1f %10.1f %14zu\n",
+                       subscribers, payload_lens[p], names[s],
+                       elapsed / total * 1e9, cpu / total * 1e9, allocated);
+            }
+        }
+    }
+
+    fanout_init(threads > 0 ? threads : 0);
+    Inbox *inboxes = (Inbox*)calloc(SPREAD_MAX, sizeof(Inbox));
+    for (size_t i = 0; i < SPREAD_MAX; i++) {
+        pthread_mutex_init(&inboxes[i].lock, NULL);
+    }
+    size_t spread_amounts[] = { 1000, 10000, 50000, SPREAD_MAX };
+
+    printf("\nuntil the last subscriber, %ld fan-out threads besides the publisher\n",
+           threads > 0 ? threads : 0);
+    printf("%11s %8s %10s %10s %10s %10s\n",
+           "subscribers", "fan-out", "p50 us", "p90 us", "p99 us", "max us");
+    for (size_t n = 0; n < sizeof(spread_amounts) / sizeof(spread_amounts[0]); n++) {
+        long publishes = deliveries / 4 / spread_amounts[n];
+        if (publishes < 100) {
+            publishes = 100;
+        }
+        for (int pool = 0; pool <= 1; pool++) {
+            measure_spread(inboxes, spread_amounts[n], pool, publishes, topic, payload);
+        }
+    }
+
+    free(inboxes);
+    free(queues);
+    free(payload);
+    return 0;
+}
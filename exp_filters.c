@@ -0,0 +1,169 @@
+/* Microbenchmark for topic filter matching.
+ *
+ * Subscribes one connection per filter to a TopicIndex, with a mix of exact
+ * filters and filters using `+` and `#`, then publishes to random topics of
+ * the same tree. For comparison, a few topics are also matched by testing
+ * every filter one by one, like a scan of every subscription would, which
+ * also checks that the index finds the same subscribers. Last, a small set
+ * of topics is published to again and again, which the index answers from
+ * its cache of matches.
+ *
+ * Usage:
+ *   make exp_filters
+ *   ./exp_filters [filters] [publishes]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "topics.h"
+
+#define REGIONS 100
+#define DEVICES 10000
+#define METRICS 20
+#define STABLE_TOPICS 4000
+
+/* Helper function. */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Helper function.
+ * 60% exact filters, 25% with a `+` level and 15% ending with `#`. */
+static int make_filter(char *out, size_t size) {
+    int region = rand() % REGIONS, device = rand() % DEVICES, metric = rand() % METRICS;
+    int kind = rand() % 100;
+
+    if (kind < 60) {
+        return snprintf(out, size, "fleet/r%d/d%d/m%d", region, device, metric);
+    } else if (kind < 72) {
+        return snprintf(out, size, "fleet/+/d%d/m%d", device, metric);
+    } else if (kind < 85) {
+        return snprintf(out, size, "fleet/r%d/+/m%d", region, metric);
+    } else if (kind < 97) {
+        return snprintf(out, size, "fleet/r%d/d%d/#", region, device);
+    } else {
+        return snprintf(out, size, "fleet/r%d/#", region);
+    }
+}
+
+/* Helper function. */
+static int make_topic(char *out, size_t size) {
+    return snprintf(out, size, "fleet/r%d/d%d/m%d", rand() % REGIONS, rand() % DEVICES, rand() % METRICS);
+}
+
+int main(int argc, char **argv) {
+    long filter_amount = argc >= 2 ? atol(argv[1]) : 1000000;
+    long publishes = argc >= 3 ? atol(argv[2]) : 1000000;
+    srand(5910);
+
+    char **filters = (char**)malloc(filter_amount * sizeof(char*));
+    size_t *lens = (size_t*)malloc(filter_amount * sizeof(size_t));
+    long wildcards = 0;
+    for (long i = 0; i < filter_amount; i++) {
+        char buffer[64];
+        lens[i] = make_filter(buffer, sizeof(buffer));
+        filters[i] = strdup(buffer);
+        wildcards += topic_has_wildcards(buffer, lens[i]);
+    }
+
+    /* Interned before the filters, which take every id left */
+    Topic **stable = (Topic**)malloc(STABLE_TOPICS * sizeof(Topic*));
+    for (long i = 0; i < STABLE_TOPICS; i++) {
+        char topic[64];
+        size_t len = make_topic(topic, sizeof(topic));
+        stable[i] = topic_intern(topic, len);
+    }
+
+    TopicIndex index;
+    topic_index_init(&index);
+
+    double start = now();
+    for (long i = 0; i < filter_amount; i++) {
+        Subscriber sub = { .shard = 0, .fd = 0, .id = i };
+        topic_index_add(&index, filters[i], lens[i], sub);
+    }
+    double elapsed = now() - start;
+    printf("%ld filters (%ld with wildcards), %zu trie nodes\n",
+           filter_amount, wildcards, index.wildcards.node_count);
+    printf("subscribe:   %10.0f filters/s\n", filter_amount / elapsed);
+
+    SubscriberList scratch = { 0 };
+    unsigned long matches = 0;
+    start = now();
+    for (long i = 0; i < publishes; i++) {
+        char topic[64];
+        size_t len = make_topic(topic, sizeof(topic));
+        Topic *published = topic_lookup(topic, len);
+        const SubscriberList *subs = topic_index_match(&index, published, &scratch);
+        matches += subs ? subs->count : 0;
+        topic_done(published);
+    }
+    elapsed = now() - start;
+    printf("match:       %10.0f publishes/s, %.2f subscribers each, %.3f us per publish\n",
+           publishes / elapsed, (double)matches / publishes, elapsed / publishes * 1e6);
+
+    /* A few topics against every filter, without the index. Each filter has
+     * its own subscriber, so both ways must find as many. */
+    long scans = 20;
+    unsigned long scanned = 0;
+    start = now();
+    for (long i = 0; i < scans; i++) {
+        char topic[64];
+        size_t len = make_topic(topic, sizeof(topic));
+        unsigned long found = 0;
+        for (long f = 0; f < filter_amount; f++) {
+            found += topic_matches(filters[f], lens[f], topic, len);
+        }
+        scanned += found;
+
+        Topic *published = topic_lookup(topic, len);
+        const SubscriberList *subs = topic_index_match(&index, published, &scratch);
+        topic_done(published);
+        if ((subs ? subs->count : 0) != found) {
+            fprintf(stderr, "%s: the index found %zu subscribers, the scan %lu\n",
+                    topic, subs ? subs->count : 0, found);
+            return EXIT_FAILURE;
+        }
+    }
+    elapsed = now() - start;
+    printf("full scan:   %10.0f publishes/s, %.2f subscribers each, %.3f us per publish\n",
+           scans / elapsed, (double)scanned / scans, elapsed / scans * 1e6);
+
+    MatchStats before = topic_index_stats(&index);
+    matches = 0;
+    start = now();
+    for (long i = 0; i < publishes; i++) {
+        const SubscriberList *subs = topic_index_match(&index, stable[i % STABLE_TOPICS], &scratch);
+        matches += subs ? subs->count : 0;
+    }
+    elapsed = now() - start;
+    MatchStats after = topic_index_stats(&index);
+    printf("repeated:    %10.0f publishes/s, %.2f subscribers each, %.3f us per publish, "
+           "%lu cache hits, %lu misses\n",
+           publishes / elapsed, (double)matches / publishes, elapsed / publishes * 1e6,
+           after.cache_hits - before.cache_hits, after.cache_misses - before.cache_misses);
+
+    start = now();
+    for (long i = 0; i < filter_amount; i++) {
+        Subscriber sub = { .shard = 0, .fd = 0, .id = i };
+        topic_index_remove(&index, filters[i], lens[i], sub);
+    }
+    elapsed = now() - start;
+    printf("unsubscribe: %10.0f filters/s, %zu trie nodes left\n",
+           filter_amount / elapsed, index.wildcards.node_count);
+
+    for (long i = 0; i < filter_amount; i++) {
+        free(filters[i]);
+    }
+    free(filters);
+    free(lens);
+    free(stable);
+    subscribers_free(&scratch);
+    return 0;
+}
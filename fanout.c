@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "errors.h"
+#include "fanout.h"
+
+/* A fan-out in progress, in the stack of the thread that asked for it */
+typedef struct FanoutJob {
+    struct FanoutJob *next;
+    FanoutTask task;
+    void *arg;
+    size_t count;
+    /* first item no thread took yet */
+    size_t next_item;
+    /* chunks not done yet, the caller returns once there are none */
+    size_t chunks_left;
+} FanoutJob;
+
+/* set by `fanout_init`, before any fan-out */
+static size_t workers = 0;
+
+/* Everything below is only touched under `lock` */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t finished = PTHREAD_COND_INITIALIZER;
+/* jobs with chunks that no thread took yet, oldest first */
+static FanoutJob *jobs = NULL;
+
+/* Helper function. Not in `fanout.h`
+ * Takes the next chunk of `job`, which leaves `jobs` with its last one */
+static void take_chunk(FanoutJob *job, size_t *begin, size_t *end) {
+    *begin = job->next_item;
+    *end = job->count - *begin > FANOUT_CHUNK ? *begin + FANOUT_CHUNK : job->count;
+    job->next_item = *end;
+    if (job->next_item < job->count) {
+        return;
+    }
+
+    FanoutJob **link = &jobs;
+    while (*link != job) {
+        link = &(*link)->next;
+    }
+    *link = job->next;
+}
+
+/* Helper function. Not in `fanout.h` */
+static void *run_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (jobs == NULL) {
+            pthread_cond_wait(&work, &lock);
+        }
+        FanoutJob *job = jobs;
+        size_t begin, end;
+        take_chunk(job, &begin, &end);
+        pthread_mutex_unlock(&lock);
+
+        job->task(begin, end, job->arg);
+
+        pthread_mutex_lock(&lock);
+        /* `job` may be gone as soon as this is seen */
+        if (--job->chunks_left == 0) {
+            pthread_cond_broadcast(&finished);
+        }
+    }
+    return NULL;
+}
+
+void fanout_init(size_t worker_amount) {
+    for (size_t i = 0; i < worker_amount; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, run_worker, NULL) != 0) {
+            fprintf(stderr, "[ERROR: Could not start fan-out thread %zu]\n", i);
+            exit(ERROR_SERVER);
+        }
+        pthread_detach(thread);
+    }
+    workers += worker_amount;
+}
+
+void fanout_run(size_t count, FanoutTask task, void *arg) {
+    if (count < FANOUT_THRESHOLD || workers == 0) {
+        task(0, count, arg);
+        return;
+    }
+
+    FanoutJob job = {
+        .next = NULL,
+        .task = task,
+        .arg = arg,
+        .count = count,
+        .next_item = 0,
+        .chunks_left = (count + FANOUT_CHUNK - 1) / FANOUT_CHUNK,
+    };
+    pthread_mutex_lock(&lock);
+    FanoutJob **link = &jobs;
+    while (*link) {
+        link = &(*link)->next;
+    }
+    *link = &job;
+    pthread_cond_broadcast(&work);
+
+    /* The caller works on its own job too, instead of only waiting */
+    while (job.next_item < job.count) {
+        size_t begin, end;
+        take_chunk(&job, &begin, &end);
+        pthread_mutex_unlock(&lock);
+
+        task(begin, end, arg);
+
+        pthread_mutex_lock(&lock);
+        job.chunks_left--;
+    }
+    while (job.chunks_left > 0) {
+        pthread_cond_wait(&finished, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,25 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <stddef.h>
+
+/* Subscribers past which a PUBLISH is queued by the pool as well, and not
+ * only by the thread that received it */
+#define FANOUT_THRESHOLD 4096
+/* Subscribers in each piece of work the pool hands out */
+#define FANOUT_CHUNK 1024
+
+/* Queues a PUBLISH to items `begin` to `end` (not included) of a list */
+typedef void (*FanoutTask)(size_t begin, size_t end, void *arg);
+
+/* Pool of threads that help with large fan-outs, so the time until the last
+ * subscriber has the message doesn't grow with all of them on one core.
+ * A fan-out is split into chunks of FANOUT_CHUNK items, which idle workers
+ * and the caller itself take one at a time until none is left. */
+void fanout_init(size_t worker_amount);
+/* Runs `task` over items 0 to `count`, in chunks spread over the pool past
+ * FANOUT_THRESHOLD, and returns once every chunk is done. Chunks of the same
+ * call run at the same time, in no particular order. */
+void fanout_run(size_t count, FanoutTask task, void *arg);
+
+#endif
@@ -3,210 +3,740 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/fcntl.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <limits.h>
 
 #include "handlers.h"
 #include "errors.h"
 #include "management.h"
 #include "mqtt.h"
+#include "topics.h"
+#include "ring.h"
+#include "fanout.h"
 
 /* Base folder to store topics and messages */
 const char *BASE_FOLDER = "/tmp/temp.mac5910.1.11796510";
 
-void catch_int(int dummy) {
-    (void)dummy;
-    remove_dir(BASE_FOLDER);
-    exit(0);
+static int use_directory = 0;
+/* Subscribers of each topic and filter, for every reactor thread of the
+ * process. PUBLISH matches in it without taking any lock, so neither other
+ * publishers nor subscriptions changing at the same time hold it up. */
+static SharedIndex subscriptions;
+
+/* Subscriptions of a connection added to or removed from a copy of
+ * `subscriptions`, see `apply_subscriptions` */
+typedef struct SubscriptionChange {
+    Subscriber sub;
+    const String *topics;
+    size_t count;
+    int add;
+} SubscriptionChange;
+
+/* A PUBLISH being queued to the subscribers found for it, see `deliver` */
+typedef struct Delivery {
+    const SubscriberList *subs;
+    Frame *frame;
+} Delivery;
+/* Subscribers matched by the PUBLISH being routed in this thread */
+static __thread SubscriberList matched = { 0 };
+
+/* Subscriptions of every pre-fork worker, as a counting Bloom filter: each
+ * one adds one to the two counters picked by the hash of its topic. A
+ * PUBLISH to a topic with either of them at zero has no subscribers, and
+ * skips the scan of BASE_FOLDER. Mapped by the master before forking, so
+ * every worker shares it. The counters of a worker that dies are taken back
+ * by the master, see `handlers_release_worker`. */
+#define PRESENCE_COUNTERS (1 << 16)
+typedef struct Presence {
+    /* see `MatchStats` */
+    _Atomic unsigned long unmatched;
+    _Atomic uint32_t counters[PRESENCE_COUNTERS];
+} Presence;
+static Presence *presence = NULL;
+
+/* Helper function. Not in `handlers.h`
+ * Mailboxes are named after BASE_FOLDER, so the ones of a previous run can
+ * be told apart from anything else in shared memory. */
+static void mailbox_name(char *out, size_t size, const char *suffix) {
+    const char *base = strrchr(BASE_FOLDER, '/');
+    snprintf(out, size, "/%s.%s", base ? base + 1 : BASE_FOLDER, suffix);
 }
 
-void treat_subscribe(int connfd, long long int user_id, MqttControlPacket packet) {
+void handlers_init(int directory) {
+    use_directory = directory;
+    if (!use_directory) {
+        shared_index_init(&subscriptions);
+        return;
+    }
+    handlers_cleanup();
+
+    presence = (Presence*)mmap(NULL, sizeof(Presence), PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (presence == MAP_FAILED) {
+        perror("mmap :(\n");
+        exit(ERROR_SERVER);
+    }
+}
+
+MatchStats handlers_stats(void) {
+    if (use_directory) {
+        MatchStats stats = { .unmatched = atomic_load(&presence->unmatched) };
+        return stats;
+    }
+    return shared_index_stats(&subscriptions);
+}
+
+void handlers_cleanup(void) {
+    if (use_directory) {
+        char prefix[NAME_MAX + 1];
+        mailbox_name(prefix, sizeof(prefix), "");
+        ring_unlink_all(prefix);
+    }
+}
+
+/* Helper function. Not in `handlers.h`
+ * Topic names become file names, where `/` and `\0` can't appear, and where
+ * `.` and `..` are the directory itself and its parent, so these and a
+ * leading `.` are written as `%XX`, like `%` itself. Returns -1 if the name
+ * doesn't fit in `size`: cutting it would give two topics the same file. */
+static int escape_topic(char *out, size_t size, String topic) {
+    size_t pos = 0;
+    for (size_t i = 0; i < topic.len; i++) {
+        char c = topic.val[i];
+        if (c == '/' || c == '%' || c == '\0' || (c == '.' && i == 0)) {
+            if (pos + 3 >= size) {
+                return -1;
+            }
+            pos += snprintf(out + pos, size - pos, "%%%02X", (unsigned char)c);
+        } else {
+            if (pos + 1 >= size) {
+                return -1;
+            }
+            out[pos++] = c;
+        }
+    }
+    out[pos] = '\0';
+    return 0;
+}
+
+/* Helper function. Not in `handlers.h`
+ * Undoes `escape_topic`, `out` is at least as long as `name`. Returns the
+ * length of the topic. */
+static size_t unescape_topic(char *out, const char *name) {
+    size_t len = 0;
+    for (size_t i = 0; name[i]; i++) {
+        unsigned int c;
+        if (name[i] == '%' && sscanf(name + i + 1, "%2x", &c) == 1) {
+            out[len++] = (char)c;
+            i += 2;
+        } else {
+            out[len++] = name[i];
+        }
+    }
+    return len;
+}
+
+/* Helper function. Not in `handlers.h`
+ * Users of the pre-fork mode are named `<worker pid>.<user id>`, in their
+ * directory and their mailbox, so that the master finds what a worker that
+ * died left behind. */
+static void user_name(char *out, size_t size, pid_t worker, long long int user_id) {
+    snprintf(out, size, "%d.%lld", (int)worker, user_id);
+}
+
+/* Helper function. Not in `handlers.h`
+ * Directory of a user of this worker, or the file `file` in it */
+static void user_path(char *out, size_t size, long long int user_id, const char *file) {
+    char user[64];
+    user_name(user, sizeof(user), getpid(), user_id);
+    if (file) {
+        snprintf(out, size, "%s/%s/%s", BASE_FOLDER, user, file);
+    } else {
+        snprintf(out, size, "%s/%s", BASE_FOLDER, user);
+    }
+}
+
+/* Where the PUBLISH packets for a connection of the pre-fork mode arrive,
+ * from any worker: a ring in shared memory, already encoded, and a FIFO in
+ * the user's directory that publishers write a byte to when the ring was
+ * empty, to wake the loop of the connection up. */
+typedef struct Mailbox {
+    Connection *conn;
+    Ring *ring;
+    int bell;
+    char name[NAME_MAX + 1];
+} Mailbox;
+
+/* A mailbox this worker publishes to, kept mapped between PUBLISH packets.
+ * Found by the user id naming its directory. */
+typedef struct Outlet {
+    struct Outlet *next;
+    long long int id;
+    Ring *ring;
+    int bell;
+    /* set for the connections of this worker, which are given the packet
+     * right away instead of through their ring */
+    Mailbox *local;
+} Outlet;
+
+/* Mailboxes this worker has mapped, by user id, which is unique among
+ * workers. Workers of the pre-fork mode have a single thread. */
+static Outlet **outlets = NULL;
+static size_t outlet_buckets = 0;
+static size_t outlet_count = 0;
+
+/* Helper function. Not in `handlers.h`
+ * Escaped topics never have a `%` that isn't followed by two hex digits,
+ * so this can't be the name of a subscription. */
+static void bell_path(char *out, size_t size, const char *user) {
+    snprintf(out, size, "%s/%s/%%bell", BASE_FOLDER, user);
+}
+
+/* Helper function. Not in `handlers.h`
+ * Bucket of `user_id` in `outlets`, which grows with the mailboxes mapped. */
+static Outlet **outlet_bucket(long long int user_id) {
+    if (outlet_count >= outlet_buckets) {
+        size_t new_buckets = outlet_buckets ? outlet_buckets * 2 : 64;
+        Outlet **new_outlets = (Outlet**)calloc(new_buckets, sizeof(Outlet*));
+        if (!new_outlets) {
+            fprintf(stderr, "[Memory error, stopping]\n");
+            exit(ERROR_SERVER);
+        }
+        for (size_t i = 0; i < outlet_buckets; i++) {
+            while (outlets[i]) {
+                Outlet *outlet = outlets[i];
+                outlets[i] = outlet->next;
+                Outlet **bucket = &new_outlets[(unsigned long long)outlet->id % new_buckets];
+                outlet->next = *bucket;
+                *bucket = outlet;
+            }
+        }
+        free(outlets);
+        outlets = new_outlets;
+        outlet_buckets = new_buckets;
+    }
+    return &outlets[(unsigned long long)user_id % outlet_buckets];
+}
+
+/* Helper function. Not in `handlers.h` */
+static Outlet *add_outlet(long long int user_id, Ring *ring, int bell, Mailbox *local) {
+    Outlet **bucket = outlet_bucket(user_id);
+    Outlet *outlet = (Outlet*)malloc(sizeof(Outlet));
+    if (!outlet) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+    outlet->id = user_id;
+    outlet->ring = ring;
+    outlet->bell = bell;
+    outlet->local = local;
+    outlet->next = *bucket;
+    *bucket = outlet;
+    outlet_count++;
+    return outlet;
+}
+
+/* Helper function. Not in `handlers.h`
+ * Finds the mailbox of `user_id`, of the worker `worker`, mapping it the
+ * first time. Returns NULL if the user has none, e.g. if it's going away. */
+static Outlet *find_outlet(pid_t worker, long long int user_id) {
+    for (Outlet *outlet = *outlet_bucket(user_id); outlet; outlet = outlet->next) {
+        if (outlet->id == user_id) {
+            return outlet;
+        }
+    }
+
+    char user[64], name[NAME_MAX + 1];
+    user_name(user, sizeof(user), worker, user_id);
+    mailbox_name(name, sizeof(name), user);
+    Ring *ring = ring_open(name);
+    if (!ring) {
+        return NULL;
+    }
+    char path[MAX_BASE_BUFFER + 1];
+    bell_path(path, sizeof(path), user);
+    int bell = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (bell == -1) {
+        ring_unmap(ring);
+        return NULL;
+    }
+    return add_outlet(user_id, ring, bell, NULL);
+}
+
+/* Helper function. Not in `handlers.h` */
+static void remove_outlet(Outlet **link) {
+    Outlet *outlet = *link;
+    *link = outlet->next;
+    if (!outlet->local) {
+        ring_unmap(outlet->ring);
+        close(outlet->bell);
+    }
+    free(outlet);
+    outlet_count--;
+}
+
+/* Helper function. Not in `handlers.h`
+ * Unmaps the mailboxes of other workers whose connection is gone. */
+static void sweep_outlets(void) {
+    for (size_t i = 0; i < outlet_buckets; i++) {
+        Outlet **link = &outlets[i];
+        while (*link) {
+            if (!(*link)->local && atomic_load(&(*link)->ring->closed)) {
+                remove_outlet(link);
+            } else {
+                link = &(*link)->next;
+            }
+        }
+    }
+}
+
+/* Helper function. Not in `handlers.h`
+ * Called by the loop when a publisher rang the bell. Takes every frame in
+ * the ring, not only the one that rang. */
+static void read_mailbox(void *ctx, int fd) {
+    Mailbox *mailbox = (Mailbox*)ctx;
+
+    /* Empty the bell before the ring: a publisher ringing in between makes
+     * the loop come back, instead of being missed */
+    uint8_t rings[64];
+    while (read(fd, rings, sizeof(rings)) > 0) { }
+
+    Frame *frame;
+    while ((frame = ring_pop(mailbox->ring)) != NULL) {
+        connection_send_frame(mailbox->conn, frame);
+        frame_release(frame);
+    }
+}
+
+/* Helper function. Not in `handlers.h`
+ * Creates the connection's mailbox on its first SUBSCRIBE. Returns NULL if
+ * it can't. */
+static Mailbox *open_mailbox(Connection *conn) {
+    if (conn->mailbox) {
+        return conn->mailbox;
+    }
+
+    Mailbox *mailbox = (Mailbox*)calloc(1, sizeof(Mailbox));
+    if (!mailbox) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+    mailbox->conn = conn;
+    char user[64];
+    user_name(user, sizeof(user), getpid(), conn->id);
+    mailbox_name(mailbox->name, sizeof(mailbox->name), user);
+    if ((mailbox->ring = ring_create(mailbox->name, RING_CAPACITY)) == NULL) {
+        perror("[Failed to create mailbox]");
+        free(mailbox);
+        return NULL;
+    }
+
+    /* Opened for writing too, so the FIFO never reports end-of-file once
+     * a publisher closes it; otherwise it would always be readable */
+    char path[MAX_BASE_BUFFER + 1];
+    bell_path(path, sizeof(path), user);
+    ensure_fifo(path);
+    if ((mailbox->bell = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC)) == -1) {
+        fprintf(stderr, "[Failed to open pipe %s]\n", path);
+        ring_destroy(mailbox->ring, mailbox->name);
+        free(mailbox);
+        return NULL;
+    }
+
+    conn->mailbox = mailbox;
+    connection_watch(conn, mailbox->bell, read_mailbox, mailbox);
+    add_outlet(conn->id, mailbox->ring, mailbox->bell, mailbox);
+    return mailbox;
+}
+
+/* Helper function. Not in `handlers.h` */
+static void close_mailbox(Connection *conn) {
+    Mailbox *mailbox = conn->mailbox;
+    unsigned long dropped = atomic_load(&mailbox->ring->dropped);
+    if (dropped > 0) {
+        fprintf(stderr, "[User %lld read too slowly, %lu packets were dropped]\n", conn->id, dropped);
+    }
+    Outlet **link = outlet_bucket(conn->id);
+    while (*link && (*link)->local != mailbox) { link = &(*link)->next; }
+    if (*link) {
+        remove_outlet(link);
+    }
+
+    connection_unwatch(conn, mailbox->bell);
+    ring_destroy(mailbox->ring, mailbox->name);
+    free(mailbox);
+    conn->mailbox = NULL;
+}
+
+/* Helper function. Not in `handlers.h`
+ * Adds `delta` to the counters of `topic` in `presence` */
+static void presence_update(String topic, int delta) {
+    uint32_t hash = topic_hash(topic.val, topic.len);
+    atomic_fetch_add(&presence->counters[hash & (PRESENCE_COUNTERS - 1)], delta);
+    atomic_fetch_add(&presence->counters[(hash >> 16) & (PRESENCE_COUNTERS - 1)], delta);
+}
+
+/* Helper function. Not in `handlers.h`
+ * Returns 0 only if nobody is subscribed to `topic` */
+static int presence_has(String topic) {
+    uint32_t hash = topic_hash(topic.val, topic.len);
+    return atomic_load(&presence->counters[hash & (PRESENCE_COUNTERS - 1)]) > 0
+        && atomic_load(&presence->counters[(hash >> 16) & (PRESENCE_COUNTERS - 1)]) > 0;
+}
+
+/* Helper function. Not in `handlers.h`
+ * One empty file per subscribed topic, in the user's directory, which
+ * publishers of every worker look for. */
+static void directory_subscribe(Connection *conn, MqttControlPacket packet) {
     char file_name_buffer[MAX_BASE_BUFFER + 1];
-    char topic_name_buffer[MAX_BASE_BUFFER + 1];
-    uint16_t topic_name_size = 0;
+    char escaped_buffer[NAME_MAX + 1];
 
-    snprintf(file_name_buffer, MAX_BASE_BUFFER, "%s/%lld", BASE_FOLDER, user_id);
+    user_path(file_name_buffer, MAX_BASE_BUFFER, conn->id, NULL);
     ensure_dir(file_name_buffer);
+    /* before any topic, so publishers finding one always find the mailbox */
+    Mailbox *mailbox = open_mailbox(conn);
+
+    /* Refusals are set in the SUBACK as each filter is tried */
+    MqttControlPacket send = create_suback(packet);
+    uint8_t *codes = send.payload.other.content;
 
     for (ssize_t i = 0; i < packet.payload.subscribe.topic_amount; i++) {
-        /* Check if user is already subscribed to this topic */
-        snprintf(
-            file_name_buffer,
-            MAX_BASE_BUFFER,
-            "%s/%lld/%s",
-            BASE_FOLDER, user_id, packet.payload.subscribe.topics[i].str.val
-        );
-        if (ensure_fifo(file_name_buffer)) {
-            /* the pipe already existed, another process is reading it */
+        /* Only exact topics, a file only ever gets messages of its name */
+        String filter = packet.payload.subscribe.topics[i].str;
+        if (codes[i] != MQTT_RC_GRANTED_QOS_0) {
+            continue;
+        }
+        if (topic_share_prefix(filter.val, filter.len) > 0) {
+            codes[i] = MQTT_RC_SHARED_UNSUPPORTED;
+            continue;
+        }
+        if (topic_has_wildcards(filter.val, filter.len)) {
+            codes[i] = MQTT_RC_WILDCARDS_UNSUPPORTED;
+            continue;
+        }
+        if (!mailbox || escape_topic(escaped_buffer, sizeof(escaped_buffer), filter) == -1) {
+            codes[i] = MQTT_RC_UNSPECIFIED_ERROR;
+            continue;
+        }
+        if (!connection_add_topic(conn, filter)) {
+            /* already subscribed */
             continue;
         }
+        /* counted before the file exists, so publishers finding it always
+         * get past `presence` */
+        presence_update(filter, 1);
+
+        user_path(file_name_buffer, MAX_BASE_BUFFER, conn->id, escaped_buffer);
+        if (ensure_file(file_name_buffer) == -1) {
+            /* only this filter fails, the connection goes on */
+            connection_remove_topic(conn, filter);
+            presence_update(filter, -1);
+            codes[i] = MQTT_RC_UNSPECIFIED_ERROR;
+        }
+    }
 
-        /* before we lose `packet`, save the topic name for each fork */
-        snprintf(topic_name_buffer, MAX_BASE_BUFFER, "%s", packet.payload.subscribe.topics[i].str.val);
-        topic_name_size = packet.payload.subscribe.topics[i].str.len;
+    /* All that's left is sending the SUBACK */
+    write_control_packet(conn->fd, &send);
+    /* we allocated for the payload */
+    destroy_control_packet(send);
+}
 
-        int pid;
-        if ((pid = fork()) == 0) {
-            /* child process, read the buffer */
-            int pipe_fd = open(file_name_buffer, O_RDONLY | O_NONBLOCK);
-            if (pipe_fd == -1) {
-                fprintf(stderr, "[%d failed to open pipe %s]\n", pipe_fd, file_name_buffer);
-                exit(ERROR_SERVER);
-            }
+/* Helper function. Not in `handlers.h`
+ * An `IndexChange`, `arg` is a SubscriptionChange */
+static void apply_subscriptions(TopicIndex *index, void *arg) {
+    SubscriptionChange *change = (SubscriptionChange*)arg;
+    for (size_t i = 0; i < change->count; i++) {
+        String topic = change->topics[i];
+        if (change->add) {
+            topic_index_add(index, topic.val, topic.len, change->sub);
+        } else {
+            topic_index_remove(index, topic.val, topic.len, change->sub);
+        }
+    }
+}
 
-            for (;;) {
-                fflush(stdout);
-
-                fd_set read_fds;
-                FD_ZERO(&read_fds);
-                FD_SET(pipe_fd, &read_fds);
-
-                /* timeout checking if pipe still exists */
-                struct timeval timeout;
-                timeout.tv_sec = 0;
-                timeout.tv_usec = 50000; /* 0.05s */
-
-                int ret = select(pipe_fd + 1, &read_fds, NULL, NULL, &timeout);
-
-                if (ret > 0)
-                {
-                    /* Data available, send to client */
-                    char msg_buffer[MAX_MSG_SIZE + 1];
-                    ssize_t bytes_read = read(pipe_fd, msg_buffer, sizeof(msg_buffer));
-                    if (bytes_read < 0) {
-                        /* error, don't care */
-                        break;
-                    } else if (bytes_read == 0) {
-                        /* some writer closed the pipe, but we keep on living */
-                        continue;
-                    }
-                    msg_buffer[bytes_read] = '\0';
-                    
-                    /* finally send the publish packet */
-                    String topic = { .val = topic_name_buffer, .len = topic_name_size};
-                    MqttControlPacket send = create_publish(topic, msg_buffer, bytes_read);
-                    write_control_packet(connfd, &send);
-                    /* don't destroy `send` since it doesn't allocate anything new */
-                }
-                else if (ret == 0)
-                {
-                    /* Timeout occurred, check if pipe still exists */
-                    struct stat file_stat;
-                    if (stat(file_name_buffer, &file_stat) == -1) {
-                        /* pipe deleted */
-                        break;
-                    }
-                }
-                else
-                {
-                    /* error, don't care */
-                    exit(EXIT_SUCCESS);
-                }
-            }
+/* Helper function. Not in `handlers.h`
+ * An `IndexChange` */
+static void reclaim_matches(TopicIndex *index, void *arg) {
+    (void)arg;
+    topic_index_reclaim(index);
+}
 
-            close(pipe_fd);
-            close(connfd);
-            remove_fifo(file_name_buffer);
-            exit(0);
-        } else { /* parent process */ }
+/* Helper function. Not in `handlers.h`
+ * Changes both copies of `subscriptions` at once, for all of `topics` */
+static void change_subscriptions(Connection *conn, const String *topics, size_t count, int add) {
+    if (count == 0) {
+        return;
     }
+    SubscriptionChange change = {
+        .sub = { .shard = 0, .fd = conn->fd, .id = conn->id, .conn = conn },
+        .topics = topics,
+        .count = count,
+        .add = add,
+    };
+    shared_index_write(&subscriptions, apply_subscriptions, &change);
+}
+
+void treat_subscribe(Connection *conn, MqttControlPacket packet) {
+    if (use_directory) {
+        directory_subscribe(conn, packet);
+        return;
+    }
+
+    /* Only the new ones go to the index, in a single change */
+    String *added = (String*)malloc((packet.payload.subscribe.topic_amount + 1) * sizeof(String));
+    if (!added) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+    size_t added_count = 0;
+    for (ssize_t i = 0; i < packet.payload.subscribe.topic_amount; i++) {
+        String topic = packet.payload.subscribe.topics[i].str;
+        if (!topic_filter_valid(topic.val, topic.len)) {
+            /* refused in the SUBACK */
+            continue;
+        }
+        if (connection_add_topic(conn, topic)) {
+            added[added_count++] = topic;
+        }
+    }
+    change_subscriptions(conn, added, added_count, 1);
+    free(added);
 
-    /* All that's left is sending the SUBACK */
     MqttControlPacket send = create_suback(packet);
-    write_control_packet(connfd, &send);
+    write_control_packet(conn->fd, &send);
     /* we allocated for the payload */
     destroy_control_packet(send);
 }
 
-void treat_unsubscribe(int connfd, long long int user_id, MqttControlPacket packet) {
+/* Helper function. Not in `handlers.h` */
+static void directory_unsubscribe(Connection *conn, MqttControlPacket packet) {
     char file_name_buffer[MAX_BASE_BUFFER + 1];
+    char escaped_buffer[NAME_MAX + 1];
 
     for (ssize_t i = 0; i < packet.payload.unsubscribe.topic_amount; i++) {
-        snprintf(
-            file_name_buffer,
-            MAX_BASE_BUFFER,
-            "%s/%lld/%s",
-            BASE_FOLDER, user_id, packet.payload.unsubscribe.topics[i].val
-        );
-
-        /* Delete FIFO, making child processes exit */
-        if (remove_fifo(file_name_buffer)) {
-            printf("[User %lld unsubscribed from topic: %s]\n", user_id, packet.payload.unsubscribe.topics[i].val);
+        String topic = packet.payload.unsubscribe.topics[i];
+
+        /* Delete the file, the next PUBLISH doesn't find it anymore */
+        /* a name too long to escape was never subscribed */
+        if (escape_topic(escaped_buffer, sizeof(escaped_buffer), topic) == 0
+                && connection_remove_topic(conn, topic)) {
+            user_path(file_name_buffer, MAX_BASE_BUFFER, conn->id, escaped_buffer);
+            remove_file(file_name_buffer);
+            presence_update(topic, -1);
+            printf("[User %lld unsubscribed from topic: %s]\n", conn->id, topic.val);
         } else {
             // This isn't a critical error; the user might be unsubscribing from a non-existent topic.
             fprintf(stderr,
                 "[Warning: User %lld tried to unsubscribe from non-existent topic: %s]\n",
-                user_id,
-                packet.payload.unsubscribe.topics[i].val
+                conn->id,
+                topic.val
             );
         }
     }
 
     /* Send UNSUBACK */
     MqttControlPacket send = create_unsuback(packet);
-    write_control_packet(connfd, &send);
+    write_control_packet(conn->fd, &send);
+    destroy_control_packet(send);
+}
+
+void treat_unsubscribe(Connection *conn, MqttControlPacket packet) {
+    if (use_directory) {
+        directory_unsubscribe(conn, packet);
+        return;
+    }
+
+    String *removed = (String*)malloc((packet.payload.unsubscribe.topic_amount + 1) * sizeof(String));
+    if (!removed) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+    size_t removed_count = 0;
+    for (ssize_t i = 0; i < packet.payload.unsubscribe.topic_amount; i++) {
+        String topic = packet.payload.unsubscribe.topics[i];
+        if (connection_remove_topic(conn, topic)) {
+            removed[removed_count++] = topic;
+        } else {
+            fprintf(stderr,
+                "[Warning: User %lld tried to unsubscribe from non-existent topic: %s]\n",
+                conn->id, topic.val
+            );
+        }
+    }
+    change_subscriptions(conn, removed, removed_count, 0);
+    free(removed);
+
+    MqttControlPacket send = create_unsuback(packet);
+    write_control_packet(conn->fd, &send);
     destroy_control_packet(send);
 }
 
-void treat_publish(long long int user_id, MqttControlPacket packet) {
-    char *topic_name = packet.var_header.publish.topic_name.val;
-    char *msg = (char*)packet.payload.other.content;
-    ssize_t msg_len = packet.payload.other.len;
+/* Helper function. Not in `handlers.h`
+ * Copies the encoded PUBLISH into the mailbox of every subscriber, from the
+ * loop of the publisher. Nothing blocks: a full mailbox drops the packet. */
+static void directory_publish(MqttControlPacket packet) {
+    if (!presence_has(packet.var_header.publish.topic_name)) {
+        atomic_fetch_add_explicit(&presence->unmatched, 1, memory_order_relaxed);
+        return;
+    }
+
+    /* no subscription has a name too long to escape */
+    char topic_name[NAME_MAX + 1];
+    if (escape_topic(topic_name, sizeof(topic_name), packet.var_header.publish.topic_name) == -1) {
+        atomic_fetch_add_explicit(&presence->unmatched, 1, memory_order_relaxed);
+        return;
+    }
 
-    /* We'll do publishing in a child process since it can take some time. */
-    /* Thankfully, we don't have to copy the data from `packet`, since `fork` does the work for us. */
-    if (fork() == 0) {
-        printf("[PUBLISH: %lld starts publishing]\n", user_id);
+    DIR *base_dir = opendir(BASE_FOLDER);
+    if (base_dir == NULL) {
+        perror("[PUBLISH: Failed to open base directory]");
+        return;
+    }
 
-        DIR *base_dir = opendir(BASE_FOLDER);
-        if (base_dir == NULL) {
-            perror("[PUBLISH: Failed to open base directory]");
-            exit(EXIT_FAILURE);
+    MqttControlPacket send = create_publish(
+        packet.var_header.publish.topic_name, (char*)packet.payload.other.content, packet.payload.other.len
+    );
+    Frame *frame = frame_encode(&send);
+    /* don't destroy `send` since it doesn't allocate anything new */
+
+    /* Long messages are written once to their own shared memory object, and
+     * rings only carry its name. It's created on the first remote subscriber. */
+    static unsigned long spills = 0;
+    RingSpill *spill = NULL;
+    int spill_failed = 0;
+
+    size_t users = 0;
+    struct dirent *entry;
+    while ((entry = readdir(base_dir)) != NULL) {
+        // Skip '.' and '..'
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
         }
 
-        struct dirent *entry;
-        while ((entry = readdir(base_dir)) != NULL) {
-            // Skip '.' and '..'
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-                continue;
-            }
+        /* assume all other dirs are users */
+        users++;
+        char file_path[MAX_BASE_BUFFER + 1];
+        snprintf(
+            file_path,
+            sizeof(file_path),
+            "%s/%s/%s",
+            BASE_FOLDER, entry->d_name, topic_name
+        );
 
-            /* assume all other dirs are users */
-            char fifo_path[MAX_BASE_BUFFER + 1];
-            snprintf(
-                fifo_path,
-                sizeof(fifo_path),
-                "%s/%s/%s",
-                BASE_FOLDER, entry->d_name, topic_name
-            );
+        /* check if current user is subscribed to this topic */
+        if (!file_exists(file_path)) {
+            continue;
+        }
+        /* named `<worker pid>.<user id>` */
+        char *dot;
+        pid_t worker = (pid_t)strtol(entry->d_name, &dot, 10);
+        Outlet *outlet = *dot == '.' ? find_outlet(worker, strtoll(dot + 1, NULL, 10)) : NULL;
+        if (outlet == NULL) {
+            continue;
+        }
 
-            /* check if current user is subscribed to this topic */
-            struct stat st;
-            if (stat(fifo_path, &st) == 0 && S_ISFIFO(st.st_mode)) {
-                /* fifo exists, so user is subscriber */
-                int pipe_fd = open(fifo_path, O_WRONLY | O_NONBLOCK);
-
-                if (pipe_fd != -1) {
-                    /* This write is guaranteed to be atomic up to a certain size, defined by the operating system.
-                     * In a real implementation, we should block the pipe somehow to prevent other concurrent writes.
-                     * Unfortunately, `flock` does not work for pipes. */
-                    if (write(pipe_fd, msg, msg_len) > 0) {
-                        printf("[PUBLISH: %lld succesfully published to %s]\n", user_id, fifo_path);
-                    } else {
-                        printf("[PUBLISH: %lld opened but couldn't publish to %s\n]", user_id, fifo_path);
-                    }
-                    close(pipe_fd);
-                } else {
-                    fprintf(stderr, "[PUBLISH: %lld couldn't open %s, skipping]\n", user_id, fifo_path);
+        if (outlet->local) {
+            connection_send_frame(outlet->local->conn, frame);
+            continue;
+        }
+        int pushed;
+        if (frame->len <= RING_MAX_FRAME) {
+            pushed = ring_push(outlet->ring, frame->data, frame->len);
+        } else {
+            if (spill == NULL && !spill_failed) {
+                char suffix[64];
+                char name[NAME_MAX + 1];
+                snprintf(suffix, sizeof(suffix), "spill.%d.%lu", getpid(), spills++);
+                mailbox_name(name, sizeof(name), suffix);
+                spill = ring_spill(name, frame->data, frame->len);
+                if (spill == NULL) {
+                    perror("[PUBLISH: Could not store long message]");
+                    spill_failed = 1;
                 }
             }
+            pushed = spill ? ring_push_spill(outlet->ring, spill) : -1;
+        }
+        if (pushed == 1) {
+            /* A full pipe means the bell is already ringing */
+            uint8_t ring = 1;
+            if (write(outlet->bell, &ring, sizeof(ring)) == -1 && errno != EAGAIN) {
+                perror("[PUBLISH: Could not wake subscriber up]");
+            }
         }
+    }
+
+    closedir(base_dir);
+    if (spill) {
+        ring_spill_release(spill);
+    }
+    frame_release(frame);
 
-        printf("[PUBLISH: %lld finished publishing]\n", user_id);
+    /* Only users with a directory can have a live mailbox mapped */
+    if (outlet_count > users) {
+        sweep_outlets();
+    }
+}
+
+/* Helper function. Not in `handlers.h`
+ * A `FanoutTask`, `arg` is a Delivery */
+static void deliver(size_t begin, size_t end, void *arg) {
+    Delivery *delivery = (Delivery*)arg;
+    for (size_t i = begin; i < end; i++) {
+        connection_send_frame(delivery->subs->items[i].conn, delivery->frame);
+    }
+}
+
+void treat_publish(MqttControlPacket packet) {
+    if (use_directory) {
+        directory_publish(packet);
+        return;
+    }
+
+    String topic = packet.var_header.publish.topic_name;
+
+    /* Subscribers may belong to other reactor threads, whose loops write the
+     * packet. They aren't released until this thread is done reading. */
+    TopicIndex *index = shared_index_read(&subscriptions);
+    /* Most topics without subscribers stop here, before anything is
+     * allocated for them */
+    if (!topic_index_may_match(index, topic.val, topic.len)) {
+        shared_index_done(&subscriptions);
+        return;
+    }
+
+    /* Only subscriptions intern topics, a PUBLISH never takes the lock */
+    Topic *published = topic_lookup(topic.val, topic.len);
+    const SubscriberList *subs = topic_index_match(index, published, &matched);
+    topic_done(published);
+    if (subs == NULL) {
+        /* nothing is encoded for a topic without subscribers */
+        shared_index_done(&subscriptions);
+        return;
+    }
 
-        closedir(base_dir);
-        exit(EXIT_SUCCESS);
+    MqttControlPacket send = create_publish(
+        topic, (char*)packet.payload.other.content, packet.payload.other.len
+    );
+    /* Encoded once, every subscriber queues the same frame. It's freed when
+     * the last of them is done sending it. */
+    Frame *frame = frame_encode(&send);
+    /* don't destroy `send` since it doesn't allocate anything new */
+
+    /* Large subscriber sets are split among the fan-out pool */
+    Delivery delivery = { .subs = subs, .frame = frame };
+    fanout_run(subs->count, deliver, &delivery);
+    shared_index_done(&subscriptions);
+    frame_release(frame);
+
+    /* Matches pushed out of the cache are freed once nobody reads them */
+    if (topic_index_retired(index) > MATCH_CACHE_SLOTS) {
+        shared_index_write(&subscriptions, reclaim_matches, NULL);
     }
 }
 
@@ -215,15 +745,79 @@ void treat_pingreq(int connfd) {
     write_control_packet(connfd, &send);
 }
 
-void treat_disconnect(long long int user_id) {
-    printf("[User %lld sent DISCONNECT. Cleaning up resources.]\n", user_id);
+void treat_disconnect(Connection *conn) {
+    printf("[User %lld sent DISCONNECT. Cleaning up resources.]\n", conn->id);
+    release_user(conn);
 
-    char user_dir_path[MAX_BASE_BUFFER + 1];
-    snprintf(user_dir_path, sizeof(user_dir_path), "%s/%lld", BASE_FOLDER, user_id);
+    /* The server does not need to return a response. */
+}
+
+void release_user(Connection *conn) {
+    if (!use_directory) {
+        change_subscriptions(conn, conn->subscriptions, conn->subscription_count, 0);
+        connection_clear_topics(conn);
+        return;
+    }
+
+    if (conn->mailbox) {
+        close_mailbox(conn);
+    }
 
-    /* Remove the user's directory. This closes all user FIFOs, which should
-     * stop all forked children for `user_id`. */
+    char user_dir_path[MAX_BASE_BUFFER + 1];
+    user_path(user_dir_path, sizeof(user_dir_path), conn->id, NULL);
     remove_dir(user_dir_path);
+    for (size_t i = 0; i < conn->subscription_count; i++) {
+        presence_update(conn->subscriptions[i], -1);
+    }
+    connection_clear_topics(conn);
+}
 
-    /* The server does not need to return a response. */
+void handlers_release_worker(pid_t worker) {
+    char prefix[32];
+    int prefix_len = snprintf(prefix, sizeof(prefix), "%d.", (int)worker);
+
+    DIR *base_dir = opendir(BASE_FOLDER);
+    if (base_dir == NULL) {
+        perror("[Failed to open base directory]");
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(base_dir)) != NULL) {
+        if (strncmp(entry->d_name, prefix, prefix_len) != 0) {
+            continue;
+        }
+
+        /* Each subscription file takes its topic's counters back */
+        char user_dir_path[MAX_BASE_BUFFER + 1];
+        snprintf(user_dir_path, sizeof(user_dir_path), "%s/%s", BASE_FOLDER, entry->d_name);
+        DIR *user_dir = opendir(user_dir_path);
+        struct dirent *file;
+        while (user_dir && (file = readdir(user_dir)) != NULL) {
+            if (file->d_name[0] == '.' || strcmp(file->d_name, "%bell") == 0) {
+                continue;
+            }
+            char topic_name[NAME_MAX + 1];
+            String topic = { .val = topic_name, .len = unescape_topic(topic_name, file->d_name) };
+            presence_update(topic, -1);
+        }
+        if (user_dir) {
+            closedir(user_dir);
+        }
+
+        /* Closed like its reader would, so other workers unmap it */
+        char user[64], name[NAME_MAX + 1];
+        user_name(user, sizeof(user), worker, strtoll(entry->d_name + prefix_len, NULL, 10));
+        mailbox_name(name, sizeof(name), user);
+        Ring *ring = ring_open(name);
+        if (ring) {
+            ring_destroy(ring, name);
+        }
+        remove_dir(user_dir_path);
+    }
+    closedir(base_dir);
+
+    /* mailboxes of users whose directory was already gone */
+    char name[NAME_MAX + 1];
+    mailbox_name(name, sizeof(name), prefix);
+    ring_unlink_all(name);
 }
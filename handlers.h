@@ -1,7 +1,11 @@
 #ifndef HANDLERS_H
 #define HANDLERS_H
 
+#include <sys/types.h>
+
 #include "mqtt.h"
+#include "loop.h"
+#include "topics.h"
 
 // Define buffer sizes used by the handlers
 #define MAX_BASE_BUFFER 1024
@@ -9,12 +13,25 @@
 
 extern const char *BASE_FOLDER;
 
-void catch_int(int dummy);
+/* Chooses where subscriptions are kept. By default, in an in-memory index
+ * shared by the reactor threads of this process. With `use_directory`, in
+ * the directory in BASE_FOLDER, which every process sees, and PUBLISH
+ * packets go through mailboxes in shared memory (`ring.h`): that is what
+ * the pre-fork workers use. */
+void handlers_init(int use_directory);
+/* Removes the mailboxes left by workers, once they are all gone */
+void handlers_cleanup(void);
+/* Pre-fork mode: removes what the users of the dead `worker` left behind,
+ * their directories, mailboxes and presence counts. Called by the master. */
+void handlers_release_worker(pid_t worker);
+/* Counters of every reactor thread, or of every worker in the pre-fork mode */
+MatchStats handlers_stats(void);
 
-void treat_subscribe(int connfd, long long int user_id, MqttControlPacket packet);
-void treat_unsubscribe(int connfd, long long int user_id, MqttControlPacket packet);
-void treat_publish(long long int user_id, MqttControlPacket packet);
+void treat_subscribe(Connection *conn, MqttControlPacket packet);
+void treat_unsubscribe(Connection *conn, MqttControlPacket packet);
+void treat_publish(MqttControlPacket packet);
 void treat_pingreq(int connfd);
-void treat_disconnect(long long int user_id);
+void treat_disconnect(Connection *conn);
+void release_user(Connection *conn);
 
 #endif
@@ -1,8 +1,294 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <pthread.h>
+
 #include "io.h"
 
+/* Channels attached to this thread's connections, indexed by fd.
+ * Each reactor thread only ever touches its own sockets. */
+static __thread IoChannel **channels = NULL;
+static __thread size_t channels_cap = 0;
+static __thread IoFlushHook flush_hook = NULL;
+static __thread void *flush_ctx = NULL;
+/* Read-ahead buffers, indexed by fd */
+static __thread IoBuffer **readers = NULL;
+static __thread size_t readers_cap = 0;
+static __thread IoStats stats = { 0 };
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+/* Helper function. Not in `io.h`
+ * A forked child can't use its parent's io_uring, so it goes back to plain
+ * system calls on every socket. */
+static void forget_channels(void) {
+    channels = NULL;
+    channels_cap = 0;
+    flush_hook = NULL;
+    flush_ctx = NULL;
+}
+
+/* Helper function. Not in `io.h` */
+static IoBuffer *reader_of(int fd) {
+    if (fd < 0 || (size_t)fd >= readers_cap) {
+        return NULL;
+    }
+    return readers[fd];
+}
+
+/* Helper function. Not in `io.h` */
+static void register_atfork(void) {
+    pthread_atfork(NULL, NULL, forget_channels);
+}
+
+/* Helper function. Not in `io.h` */
+static IoChannel *channel_of(int fd) {
+    if (fd < 0 || (size_t)fd >= channels_cap) {
+        return NULL;
+    }
+    return channels[fd];
+}
+
+void io_buffer_append(IoBuffer *buf, const uint8_t *data, size_t len) {
+    if (buf->end + len > buf->cap) {
+        /* move pending bytes to the front before growing */
+        if (buf->start > 0) {
+            memmove(buf->data, buf->data + buf->start, buf->end - buf->start);
+            buf->end -= buf->start;
+            buf->start = 0;
+        }
+        if (buf->end + len > buf->cap) {
+            size_t new_cap = buf->cap ? buf->cap : 256;
+            while (new_cap < buf->end + len) { new_cap *= 2; }
+            buf->data = (uint8_t*)realloc(buf->data, new_cap);
+            if (!buf->data) {
+                fprintf(stderr, "[Memory error, stopping]\n");
+                exit(ERROR_SERVER);
+            }
+            buf->cap = new_cap;
+        }
+    }
+    memcpy(buf->data + buf->end, data, len);
+    buf->end += len;
+}
+
+void io_buffer_consume(IoBuffer *buf, size_t len) {
+    buf->start += len;
+    if (buf->start >= buf->end) {
+        buf->start = 0;
+        buf->end = 0;
+    }
+}
+
+void io_buffer_free(IoBuffer *buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->start = 0;
+    buf->end = 0;
+    buf->cap = 0;
+}
+
+void io_attach(int fd, IoChannel *channel) {
+    pthread_once(&atfork_once, register_atfork);
+
+    if ((size_t)fd >= channels_cap) {
+        size_t new_cap = channels_cap ? channels_cap : 64;
+        while (new_cap <= (size_t)fd) { new_cap *= 2; }
+        channels = (IoChannel**)realloc(channels, new_cap * sizeof(IoChannel*));
+        if (!channels) {
+            fprintf(stderr, "[Memory error, stopping]\n");
+            exit(ERROR_SERVER);
+        }
+        memset(channels + channels_cap, 0, (new_cap - channels_cap) * sizeof(IoChannel*));
+        channels_cap = new_cap;
+    }
+    channels[fd] = channel;
+}
+
+void io_detach(int fd) {
+    if (channel_of(fd) != NULL) {
+        channels[fd] = NULL;
+    }
+
+    IoBuffer *reader = reader_of(fd);
+    if (reader != NULL) {
+        io_buffer_free(reader);
+        free(reader);
+        readers[fd] = NULL;
+    }
+}
+
+void io_read_ahead(int fd) {
+    if (reader_of(fd) != NULL) {
+        return;
+    }
+
+    if ((size_t)fd >= readers_cap) {
+        size_t new_cap = readers_cap ? readers_cap : 64;
+        while (new_cap <= (size_t)fd) { new_cap *= 2; }
+        readers = (IoBuffer**)realloc(readers, new_cap * sizeof(IoBuffer*));
+        if (!readers) {
+            fprintf(stderr, "[Memory error, stopping]\n");
+            exit(ERROR_SERVER);
+        }
+        memset(readers + readers_cap, 0, (new_cap - readers_cap) * sizeof(IoBuffer*));
+        readers_cap = new_cap;
+    }
+
+    readers[fd] = (IoBuffer*)calloc(1, sizeof(IoBuffer));
+    if (!readers[fd]) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+}
+
+IoStats io_stats(void) {
+    return stats;
+}
+
+void io_set_flush_hook(IoFlushHook hook, void *ctx) {
+    flush_hook = hook;
+    flush_ctx = ctx;
+}
+
+void io_flush(int fd) {
+    IoChannel *channel = channel_of(fd);
+    if (channel == NULL || channel->out.end == channel->out.start || flush_hook == NULL) {
+        return;
+    }
+    flush_hook(flush_ctx, fd, &channel->out);
+}
+
+/* Helper function. Not in `io.h`
+ * Tops the read-ahead buffer up to at least `len` bytes. A single `read`
+ * usually brings many packets at once. */
+static int refill(int fd, IoBuffer *reader, size_t len) {
+    while (reader->end - reader->start < len) {
+        /* make room for a full read-ahead past what is missing */
+        size_t missing = len - (reader->end - reader->start);
+        size_t want = missing > IO_READ_AHEAD ? missing : IO_READ_AHEAD;
+        if (reader->cap - reader->end < want) {
+            if (reader->start > 0) {
+                memmove(reader->data, reader->data + reader->start, reader->end - reader->start);
+                reader->end -= reader->start;
+                reader->start = 0;
+            }
+            if (reader->cap - reader->end < want) {
+                reader->cap = reader->end + want;
+                reader->data = (uint8_t*)realloc(reader->data, reader->cap);
+                if (!reader->data) {
+                    fprintf(stderr, "[Memory error, stopping]\n");
+                    exit(ERROR_SERVER);
+                }
+            }
+        }
+
+        ssize_t got = read(fd, reader->data + reader->end, reader->cap - reader->end);
+        stats.reads++;
+        if (got <= 0) {
+            return -1;
+        }
+        stats.bytes_read += got;
+        reader->end += got;
+    }
+    return 0;
+}
+
+/* Helper function. Not in `io.h`
+ * Reads exactly `len` bytes. */
+static ssize_t io_read(int fd, void *dst, size_t len) {
+    IoBuffer *reader = reader_of(fd);
+    if (reader != NULL) {
+        if (refill(fd, reader, len) == -1) {
+            return -1;
+        }
+        memcpy(dst, reader->data + reader->start, len);
+        io_buffer_consume(reader, len);
+        return len;
+    }
+
+    size_t bytes_read = 0;
+    /* large payloads may arrive in more than one TCP segment */
+    while (bytes_read < len) {
+        ssize_t got = read(fd, (uint8_t*)dst + bytes_read, len - bytes_read);
+        stats.reads++;
+        if (got <= 0) {
+            return -1;
+        }
+        stats.bytes_read += got;
+        bytes_read += got;
+    }
+    return bytes_read;
+}
+
+/* Helper function. Not in `io.h`
+ * Writes all `len` bytes, staging them if the fd has an attached channel. */
+static ssize_t io_write(int fd, const void *src, size_t len) {
+    IoChannel *channel = channel_of(fd);
+    if (channel != NULL) {
+        io_buffer_append(&channel->out, (const uint8_t*)src, len);
+        return len;
+    }
+
+    size_t bytes_written = 0;
+    while (bytes_written < len) {
+        ssize_t put = write(fd, (const uint8_t*)src + bytes_written, len - bytes_written);
+        stats.writes++;
+        if (put <= 0) {
+            return -1;
+        }
+        stats.bytes_written += put;
+        bytes_written += put;
+    }
+    return bytes_written;
+}
+
+/* Helper function. Not in `io.h`
+ * Writes every buffer of `iov`, in as few system calls as the kernel allows.
+ * `iov` is advanced past what was written. */
+static ssize_t io_writev(int fd, struct iovec *iov, int count) {
+    size_t bytes_written = 0;
+
+    IoChannel *channel = channel_of(fd);
+    if (channel != NULL) {
+        for (int i = 0; i < count; i++) {
+            io_buffer_append(&channel->out, (const uint8_t*)iov[i].iov_base, iov[i].iov_len);
+            bytes_written += iov[i].iov_len;
+        }
+        return bytes_written;
+    }
+
+    while (count > 0) {
+        if (iov->iov_len == 0) {
+            iov++;
+            count--;
+            continue;
+        }
+
+        ssize_t put = writev(fd, iov, count);
+        stats.writes++;
+        if (put <= 0) {
+            return -1;
+        }
+        stats.bytes_written += put;
+        bytes_written += put;
+
+        /* a short write may stop in the middle of a buffer */
+        size_t left = put;
+        while (count > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t*)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    return bytes_written;
+}
+
 ssize_t read_many(int fd, uint8_t *byte, size_t len) {
-    ssize_t bytes_read = read(fd, byte, len);
-    if (bytes_read < 0 || (size_t)bytes_read < len) {
+    ssize_t bytes_read = io_read(fd, byte, len);
+    if (bytes_read < 0) {
         perror("[Socket reading failed]");
         exit(ERROR_READ_FAILED);
     }
@@ -10,16 +296,25 @@ ssize_t read_many(int fd, uint8_t *byte, size_t len) {
 }
 
 ssize_t write_many(int fd, uint8_t *byte, size_t len) {
-    ssize_t bytes_written = write(fd, byte, len);
-    if (bytes_written < 0 || (size_t)bytes_written < len) {
+    ssize_t bytes_written = io_write(fd, byte, len);
+    if (bytes_written < 0) {
         perror("[Socket writing failed]");
-        exit(ERROR_READ_FAILED);
+        exit(ERROR_WRITE_FAILED);
+    }
+    return bytes_written;
+}
+
+ssize_t writev_many(int fd, struct iovec *iov, int count) {
+    ssize_t bytes_written = io_writev(fd, iov, count);
+    if (bytes_written < 0) {
+        perror("[Socket writing failed]");
+        exit(ERROR_WRITE_FAILED);
     }
     return bytes_written;
 }
 
 ssize_t read_uint8(int fd, uint8_t *byte) {
-    ssize_t bytes_read = read(fd, byte, 1);
+    ssize_t bytes_read = io_read(fd, byte, 1);
     if (bytes_read <= 0) {
         perror("[Socket reading failed]");
         exit(ERROR_READ_FAILED);
@@ -28,7 +323,7 @@ ssize_t read_uint8(int fd, uint8_t *byte) {
 }
 
 ssize_t write_uint8(int fd, uint8_t *byte) {
-    ssize_t bytes_written = write(fd, byte, 1);
+    ssize_t bytes_written = io_write(fd, byte, 1);
     if (bytes_written <= 0) {
         perror("[Socket writing failed]");
         exit(ERROR_WRITE_FAILED);
@@ -37,7 +332,7 @@ ssize_t write_uint8(int fd, uint8_t *byte) {
 }
 
 ssize_t read_uint16(int fd, uint16_t *val) {
-    ssize_t bytes_read = read(fd, val, 2);
+    ssize_t bytes_read = io_read(fd, val, 2);
     *val = ntohs(*val);
     if (bytes_read <= 0) {
         perror("[Socket reading failed]");
@@ -48,7 +343,7 @@ ssize_t read_uint16(int fd, uint16_t *val) {
 
 ssize_t write_uint16(int fd, uint16_t *val) {
     uint16_t local = htons(*val);
-    ssize_t bytes_written = write(fd, &local, 2);
+    ssize_t bytes_written = io_write(fd, &local, 2);
     if (bytes_written <= 0) {
         perror("[Socket writing failed]");
         exit(ERROR_WRITE_FAILED);
@@ -57,7 +352,7 @@ ssize_t write_uint16(int fd, uint16_t *val) {
 }
 
 ssize_t read_uint32(int fd, uint32_t *val) {
-    ssize_t bytes_read = read(fd, val, 4);
+    ssize_t bytes_read = io_read(fd, val, 4);
     *val = ntohl(*val);
     if (bytes_read <= 0) {
         perror("[Socket reading failed]");
@@ -68,7 +363,7 @@ ssize_t read_uint32(int fd, uint32_t *val) {
 
 ssize_t write_uint32(int fd, uint32_t *val) {
     uint32_t local = htonl(*val);
-    ssize_t bytes_written = write(fd, &local, 4);
+    ssize_t bytes_written = io_write(fd, &local, 4);
     if (bytes_written <= 0) {
         perror("[Socket writing failed]");
         exit(ERROR_WRITE_FAILED);
@@ -5,13 +5,61 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #include <stdint.h>
 #include <arpa/inet.h>
 
 #include "errors.h"
 
+/* Growable byte buffer. Bytes in [start, end) are still pending. */
+typedef struct IoBuffer {
+    uint8_t *data;
+    size_t start;
+    size_t end;
+    size_t cap;
+} IoBuffer;
+
+/* Staged output of a connection whose socket isn't written directly by the
+ * functions below, e.g. when driven by io_uring. `out` is handed to the
+ * flush hook. */
+typedef struct IoChannel {
+    IoBuffer out;
+} IoChannel;
+
+typedef void (*IoFlushHook)(void *ctx, int fd, IoBuffer *out);
+
+/* System calls made by the functions below, per thread */
+typedef struct IoStats {
+    unsigned long reads;
+    unsigned long writes;
+    unsigned long bytes_read;
+    unsigned long bytes_written;
+} IoStats;
+
+/* Bytes asked from the kernel at once when reading ahead */
+#define IO_READ_AHEAD 65536
+
+void io_buffer_append(IoBuffer *buf, const uint8_t *data, size_t len);
+void io_buffer_consume(IoBuffer *buf, size_t len);
+void io_buffer_free(IoBuffer *buf);
+
+/* Channels and the flush hook are per thread */
+void io_attach(int fd, IoChannel *channel);
+void io_detach(int fd);
+void io_set_flush_hook(IoFlushHook hook, void *ctx);
+void io_flush(int fd);
+
+/* Serves the `read_*` functions of `fd` from a buffer refilled with large
+ * reads, instead of one system call per field. Nothing else may read from
+ * `fd` afterwards. Undone by `io_detach`. */
+void io_read_ahead(int fd);
+
+IoStats io_stats(void);
+
 ssize_t read_many(int fd, uint8_t *byte, size_t len);
 ssize_t write_many(int fd, uint8_t *byte, size_t len);
+/* Writes all buffers of `iov` at once. Changes `iov` when writes are short. */
+ssize_t writev_many(int fd, struct iovec *iov, int count);
 ssize_t read_uint8(int fd, uint8_t *byte);
 ssize_t write_uint8(int fd, uint8_t *byte);
 ssize_t read_uint16(int fd, uint16_t *val);
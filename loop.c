@@ -0,0 +1,972 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <stdatomic.h>
+
+#include "errors.h"
+#include "mqtt.h"
+#include "handlers.h"
+#include "loop.h"
+#include "shard.h"
+
+/* Counters shared by every reactor thread. Moved to shared memory when
+ * reactors live in different processes. */
+typedef struct LoopCounters {
+    /* identifies the last accepted connection */
+    atomic_llong last_connection_id;
+    _Atomic unsigned long long packets_written;
+    _Atomic unsigned long long writes;
+} LoopCounters;
+
+static LoopCounters local_counters;
+static LoopCounters *counters = &local_counters;
+/* Loop run by this thread, output queued for its connections needs no wakeup */
+static __thread EventLoop *current_loop = NULL;
+
+void loop_share_counters(void) {
+    LoopCounters *shared = (LoopCounters*)mmap(
+        NULL, sizeof(LoopCounters), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0
+    );
+    if (shared == MAP_FAILED) {
+        perror("mmap :(\n");
+        exit(ERROR_SERVER);
+    }
+    atomic_init(&shared->last_connection_id, atomic_load(&counters->last_connection_id));
+    atomic_init(&shared->packets_written, atomic_load(&counters->packets_written));
+    atomic_init(&shared->writes, atomic_load(&counters->writes));
+    counters = shared;
+}
+
+WriteStats loop_write_stats(void) {
+    WriteStats stats = {
+        .packets = atomic_load(&counters->packets_written),
+        .writes = atomic_load(&counters->writes),
+    };
+    return stats;
+}
+
+/* Helper function. Not in `loop.h`
+ * Called before the loop waits, so writes only count locally */
+static void flush_write_stats(EventLoop *loop) {
+    if (loop->written.writes == 0) {
+        return;
+    }
+    atomic_fetch_add_explicit(&counters->packets_written, loop->written.packets, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters->writes, loop->written.writes, memory_order_relaxed);
+    loop->written.packets = 0;
+    loop->written.writes = 0;
+}
+
+/* Helper function. Not in `loop.h` */
+static Connection *add_connection(EventLoop *loop, int fd) {
+    if ((size_t)fd >= loop->conns_cap) {
+        size_t new_cap = loop->conns_cap ? loop->conns_cap : 64;
+        while (new_cap <= (size_t)fd) { new_cap *= 2; }
+
+        loop->conns = (Connection**)realloc(loop->conns, new_cap * sizeof(Connection*));
+        if (!loop->conns) {
+            perror("[Couldn't reallocate memory for connections]\n");
+            exit(ERROR_SERVER);
+        }
+        memset(loop->conns + loop->conns_cap, 0, (new_cap - loop->conns_cap) * sizeof(Connection*));
+        loop->conns_cap = new_cap;
+    }
+
+    Connection *conn = (Connection*)calloc(1, sizeof(Connection));
+    if (!conn) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+    conn->fd = fd;
+    conn->id = atomic_fetch_add(&counters->last_connection_id, 1) + 1;
+    conn->connected = 0;
+    conn->loop = loop;
+    mqtt_decoder_init(&conn->decoder);
+    conn->out = frame_queue_new();
+    /* packets written by the handlers go to the connection's queue */
+    io_attach(fd, &conn->channel);
+
+    loop->conns[fd] = conn;
+    return conn;
+}
+
+/* Helper function. Not in `loop.h`
+ * The socket must be closed already. */
+static void free_connection(Connection *conn) {
+    unsigned long dropped = atomic_load(&conn->dropped);
+    if (dropped > 0) {
+        fprintf(stderr, "[User %lld read too slowly, %lu packets were dropped]\n", conn->id, dropped);
+    }
+    frame_queue_free(conn->out);
+    io_buffer_free(&conn->channel.out);
+    mqtt_decoder_free(&conn->decoder);
+    free(conn);
+}
+
+/* Helper function. Not in `loop.h`
+ * Common to both backends, which then set up their own wakeups. */
+static void init_common(EventLoop *loop, int listenfd) {
+    loop->epfd = -1;
+    loop->listenfd = listenfd;
+    loop->conns = NULL;
+    loop->conns_cap = 0;
+    loop->watches = NULL;
+    loop->watches_cap = 0;
+    loop->shard = NULL;
+    loop->pending = NULL;
+    atomic_init(&loop->remote, NULL);
+    loop->written.packets = 0;
+    loop->written.writes = 0;
+
+    if ((loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        perror("eventfd :(\n");
+        exit(ERROR_SERVER);
+    }
+}
+
+void connection_send(Connection *conn, const uint8_t *data, size_t len) {
+    Frame *frame = frame_from_bytes(data, len);
+    connection_send_frame(conn, frame);
+    frame_release(frame);
+}
+
+void connection_send_frame(Connection *conn, Frame *frame) {
+    size_t len = frame->len;
+    size_t queued = atomic_fetch_add_explicit(&conn->out_bytes, len, memory_order_relaxed);
+    if (queued > 0 && queued + len > MAX_QUEUED_BYTES) {
+        atomic_fetch_sub_explicit(&conn->out_bytes, len, memory_order_relaxed);
+        atomic_fetch_add_explicit(&conn->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    /* the loop may send and release it as soon as it's pushed */
+    frame_hold(frame);
+    if (!frame_queue_push(conn->out, frame)) {
+        atomic_fetch_sub_explicit(&conn->out_bytes, len, memory_order_relaxed);
+        atomic_fetch_add_explicit(&conn->dropped, 1, memory_order_relaxed);
+        frame_release(frame);
+        return;
+    }
+
+    /* Only the packet that finds the queue idle tells the loop about it. A
+     * loop done with the queue unsets `out_scheduled` and then looks at the
+     * queue again, so either it sees this packet, or this sees it unset. */
+    if (atomic_exchange(&conn->out_scheduled, 1)) {
+        return;
+    }
+
+    EventLoop *loop = conn->loop;
+    if (loop == current_loop) {
+        conn->next_pending = loop->pending;
+        loop->pending = conn;
+        return;
+    }
+
+    /* Only the first connection of the stack has to wake the loop up */
+    Connection *head = atomic_load_explicit(&loop->remote, memory_order_relaxed);
+    do {
+        conn->next_pending = head;
+    } while (!atomic_compare_exchange_weak_explicit(
+        &loop->remote, &head, conn, memory_order_release, memory_order_relaxed
+    ));
+
+    if (head == NULL) {
+        uint64_t one = 1;
+        if (write(loop->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+            perror("[Could not wake loop up]");
+        }
+    }
+}
+
+/* Helper function. Not in `loop.h`
+ * Flush hook for `io.c`: each packet written by the handlers is queued as a
+ * whole, and written once the loop is done with the current events. */
+static void queue_output(void *ctx, int fd, IoBuffer *out) {
+    EventLoop *loop = (EventLoop*)ctx;
+    size_t len = out->end - out->start;
+    connection_send(loop->conns[fd], out->data + out->start, len);
+    io_buffer_consume(out, len);
+}
+
+/* Helper function. Not in `loop.h`
+ * Moves the connections other threads queued output for to `pending` */
+static void take_remote_list(EventLoop *loop) {
+    Connection *conn = atomic_exchange_explicit(&loop->remote, NULL, memory_order_acquire);
+    while (conn) {
+        Connection *next = conn->next_pending;
+        conn->next_pending = loop->pending;
+        loop->pending = conn;
+        conn = next;
+    }
+}
+
+/* Helper function. Not in `loop.h`
+ * Takes the connections other threads queued output for. */
+static void take_remote(EventLoop *loop) {
+    /* Reset the eventfd before taking the stack: a push that happens in
+     * between finds it empty and wakes the loop up again */
+    uint64_t wakeups;
+    if (read(loop->wake_fd, &wakeups, sizeof(wakeups)) == -1 && errno != EAGAIN) {
+        perror("[Could not read loop wakeups]");
+    }
+    take_remote_list(loop);
+}
+
+/* Helper function. Not in `loop.h`
+ * Takes a closing connection out of the lists of connections with output.
+ * Its subscriptions are gone by now, so no other thread pushes it again. */
+static void forget_output(EventLoop *loop, Connection *conn) {
+    /* the stack can't be unlinked from, its connections go to `pending` */
+    take_remote_list(loop);
+
+    Connection **link = &loop->pending;
+    while (*link && *link != conn) { link = &(*link)->next_pending; }
+    if (*link) {
+        *link = conn->next_pending;
+    }
+}
+
+/* Helper function. Not in `loop.h` */
+static Watch *add_watch(EventLoop *loop, int fd, WatchHandler handler, void *ctx) {
+    if ((size_t)fd >= loop->watches_cap) {
+        size_t new_cap = loop->watches_cap ? loop->watches_cap : 64;
+        while (new_cap <= (size_t)fd) { new_cap *= 2; }
+
+        loop->watches = (Watch**)realloc(loop->watches, new_cap * sizeof(Watch*));
+        if (!loop->watches) {
+            fprintf(stderr, "[Memory error, stopping]\n");
+            exit(ERROR_SERVER);
+        }
+        memset(loop->watches + loop->watches_cap, 0, (new_cap - loop->watches_cap) * sizeof(Watch*));
+        loop->watches_cap = new_cap;
+    }
+
+    Watch *watch = (Watch*)calloc(1, sizeof(Watch));
+    if (!watch) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+    watch->fd = fd;
+    watch->handler = handler;
+    watch->ctx = ctx;
+    loop->watches[fd] = watch;
+    return watch;
+}
+
+int connection_add_topic(Connection *conn, String topic) {
+    for (size_t i = 0; i < conn->subscription_count; i++) {
+        String *known = &conn->subscriptions[i];
+        if (known->len == topic.len && memcmp(known->val, topic.val, topic.len) == 0) {
+            return 0;
+        }
+    }
+
+    if (conn->subscription_count == conn->subscription_cap) {
+        conn->subscription_cap = conn->subscription_cap ? conn->subscription_cap * 2 : 4;
+        conn->subscriptions = (String*)realloc(conn->subscriptions, conn->subscription_cap * sizeof(String));
+        if (!conn->subscriptions) {
+            fprintf(stderr, "[Memory error, stopping]\n");
+            exit(ERROR_SERVER);
+        }
+    }
+
+    String *copy = &conn->subscriptions[conn->subscription_count++];
+    copy->len = topic.len;
+    copy->val = strndup(topic.val, topic.len);
+    if (!copy->val) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+    return 1;
+}
+
+int connection_remove_topic(Connection *conn, String topic) {
+    for (size_t i = 0; i < conn->subscription_count; i++) {
+        String *known = &conn->subscriptions[i];
+        if (known->len == topic.len && memcmp(known->val, topic.val, topic.len) == 0) {
+            destroy_string(*known);
+            *known = conn->subscriptions[--conn->subscription_count];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void connection_clear_topics(Connection *conn) {
+    for (size_t i = 0; i < conn->subscription_count; i++) {
+        destroy_string(conn->subscriptions[i]);
+    }
+    free(conn->subscriptions);
+    conn->subscriptions = NULL;
+    conn->subscription_count = 0;
+    conn->subscription_cap = 0;
+}
+
+/* Helper function. Not in `loop.h`
+ * Treats a single packet. Returns 1 if the connection should be closed. */
+static int handle_packet(EventLoop *loop, Connection *conn, MqttControlPacket received) {
+    /* First packet should be CONNECT */
+    if (!conn->connected) {
+        if (received.fixed_header.type != CONNECT) {
+            fprintf(stderr, "[Got invalid connection, probably not MQTT]\n");
+            return 1;
+        }
+        conn->connected = 1;
+
+        /* Answer CONNECT with CONNACK */
+        MqttControlPacket connack = create_connack();
+        write_control_packet(conn->fd, &connack);
+        destroy_control_packet(connack);
+        return 0;
+    }
+
+    /* In shared-nothing mode, subscriptions live in the shards instead of
+     * in the index of `handlers.c` */
+    Shard *shard = loop->shard;
+
+    switch ((MqttControlType)received.fixed_header.type) {
+        case SUBSCRIBE:
+            if (shard) {
+                shard_subscribe(shard, conn, received);
+            } else {
+                treat_subscribe(conn, received);
+            }
+            break;
+        case UNSUBSCRIBE:
+            if (shard) {
+                shard_unsubscribe(shard, conn, received);
+            } else {
+                treat_unsubscribe(conn, received);
+            }
+            break;
+        case PUBLISH:
+            /* We only accept PUBLISH with QoS = 0 */
+            if (shard) {
+                shard_publish(shard, received);
+            } else {
+                treat_publish(received);
+            }
+            break;
+        case DISCONNECT:
+            if (shard) {
+                printf("[User %lld sent DISCONNECT. Cleaning up resources.]\n", conn->id);
+            } else {
+                treat_disconnect(conn);
+                conn->connected = 0;
+            }
+            return 1;
+        case PINGREQ:
+            treat_pingreq(conn->fd);
+            break;
+        default:
+            fprintf(stderr, "[Warning: packet type %d not implemented]\n", received.fixed_header.type);
+    }
+
+    return 0;
+}
+
+/* Helper function. Not in `loop.h`
+ * Decodes and treats every packet in the received bytes. The last one may be
+ * incomplete, the decoder keeps it until the next read. Returns 1 if the
+ * connection should be closed. */
+static int handle_input(EventLoop *loop, Connection *conn, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        MqttControlPacket received;
+        size_t consumed;
+        MqttDecodeStatus status = mqtt_decoder_feed(&conn->decoder, data, len, &consumed, &received);
+        data += consumed;
+        len -= consumed;
+
+        if (status == MQTT_DECODE_ERROR) {
+            fprintf(stderr, "[Got invalid packet from user %lld, probably not MQTT]\n", conn->id);
+            return 1;
+        }
+        if (status == MQTT_DECODE_NO_MEMORY) {
+            fprintf(stderr, "[Memory error, closing the connection of user %lld]\n", conn->id);
+            return 1;
+        }
+        if (status == MQTT_DECODE_NEED_MORE) {
+            return 0;
+        }
+
+        int stop = handle_packet(loop, conn, received);
+        destroy_control_packet(received);
+        if (stop) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Helper function. Not in `loop.h`
+ * Drops what the connection left behind in the broker. */
+static void release_connection(EventLoop *loop, Connection *conn) {
+    if (loop->shard) {
+        shard_release(loop->shard, conn);
+    } else if (conn->connected) {
+        /* A client may vanish without sending DISCONNECT, its subscriptions
+         * must go anyway */
+        release_user(conn);
+    }
+}
+
+#ifndef USE_IO_URING
+
+/* ===================== epoll backend ===================== */
+
+/* Helper function. Not in `loop.h` */
+static void watch_fd(EventLoop *loop, int fd, uint32_t events, int op) {
+    struct epoll_event ev = { .events = events, .data.fd = fd };
+    if (epoll_ctl(loop->epfd, op, fd, &ev) == -1) {
+        perror("epoll_ctl :(\n");
+        exit(ERROR_SERVER);
+    }
+}
+
+void loop_init(EventLoop *loop, int listenfd) {
+    init_common(loop, listenfd);
+
+    loop->read_buffer = (uint8_t*)malloc(READ_BUFFER_SIZE);
+    if (!loop->read_buffer) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+
+    if ((loop->epfd = epoll_create1(0)) == -1) {
+        perror("epoll_create1 :(\n");
+        exit(ERROR_SERVER);
+    }
+
+    /* A listener shared by several processes only wakes one of them up */
+    watch_fd(loop, listenfd, EPOLLIN | EPOLLEXCLUSIVE, EPOLL_CTL_ADD);
+    watch_fd(loop, loop->wake_fd, EPOLLIN, EPOLL_CTL_ADD);
+}
+
+void loop_set_shard(EventLoop *loop, Shard *shard) {
+    loop->shard = shard;
+    shard->loop = loop;
+    watch_fd(loop, shard->inbox_fd, EPOLLIN, EPOLL_CTL_ADD);
+}
+
+/* Helper function. Not in `loop.h` */
+static Watch *watch_of(EventLoop *loop, int fd) {
+    if ((size_t)fd >= loop->watches_cap) {
+        return NULL;
+    }
+    return loop->watches[fd];
+}
+
+void connection_watch(Connection *conn, int fd, WatchHandler handler, void *ctx) {
+    add_watch(conn->loop, fd, handler, ctx);
+    watch_fd(conn->loop, fd, EPOLLIN, EPOLL_CTL_ADD);
+}
+
+void connection_unwatch(Connection *conn, int fd) {
+    EventLoop *loop = conn->loop;
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    free(loop->watches[fd]);
+    loop->watches[fd] = NULL;
+}
+
+/* Helper function. Not in `loop.h`
+ * Writes queued packets until the queue is empty or the socket is full. In
+ * the latter case the loop waits for EPOLLOUT to go on. Returns -1 if the
+ * socket failed. */
+static int write_output(EventLoop *loop, Connection *conn) {
+    struct iovec iov[IOV_MAX];
+    for (;;) {
+        Frame *frame = frame_queue_peek(conn->out);
+        if (!frame) {
+            /* A packet queued right before this is seen here, any later one
+             * finds `out_scheduled` unset and schedules the connection */
+            atomic_store(&conn->out_scheduled, 0);
+            if (frame_queue_peek(conn->out) && !atomic_exchange(&conn->out_scheduled, 1)) {
+                continue;
+            }
+            if (conn->want_write) {
+                conn->want_write = 0;
+                watch_fd(loop, conn->fd, EPOLLIN, EPOLL_CTL_MOD);
+            }
+            return 0;
+        }
+
+        /* A burst of packets goes out in a single call, starting with what
+         * is left of the oldest one */
+        size_t count = 0;
+        size_t bytes = 0;
+        while (frame && count < IOV_MAX) {
+            size_t skip = count == 0 ? conn->out_sent : 0;
+            if (count > 0 && bytes + frame->len > WRITE_BATCH_BYTES) {
+                break;
+            }
+            iov[count].iov_base = frame->data + skip;
+            iov[count].iov_len = frame->len - skip;
+            bytes += frame->len - skip;
+            count++;
+            frame = frame_queue_peek_at(conn->out, count);
+        }
+
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = count };
+        ssize_t put = sendmsg(conn->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (put < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!conn->want_write) {
+                conn->want_write = 1;
+                watch_fd(loop, conn->fd, EPOLLIN | EPOLLOUT, EPOLL_CTL_MOD);
+            }
+            return 0;
+        }
+        if (put < 0 && errno == EINTR) {
+            continue;
+        }
+        if (put < 0) {
+            return -1;
+        }
+
+        loop->written.writes++;
+
+        /* The socket may have taken only part of them */
+        size_t left = put;
+        while (left > 0) {
+            frame = frame_queue_peek(conn->out);
+            size_t rest = frame->len - conn->out_sent;
+            if (left < rest) {
+                conn->out_sent += left;
+                break;
+            }
+            left -= rest;
+            frame_queue_pop(conn->out);
+            atomic_fetch_sub_explicit(&conn->out_bytes, frame->len, memory_order_relaxed);
+            conn->out_sent = 0;
+            frame_release(frame);
+            loop->written.packets++;
+        }
+    }
+}
+
+/* Helper function. Not in `loop.h` */
+static void close_connection(EventLoop *loop, Connection *conn) {
+    printf("[Connection closed for user %lld]\n", conn->id);
+
+    release_connection(loop, conn);
+
+    /* Whatever the client can still take, e.g. answers to its last packets */
+    write_output(loop, conn);
+    forget_output(loop, conn);
+
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    io_detach(conn->fd);
+    close(conn->fd);
+    loop->conns[conn->fd] = NULL;
+    free_connection(conn);
+}
+
+/* Helper function. Not in `loop.h`
+ * Writes the output queued while the last events were treated. */
+static void write_pending(EventLoop *loop) {
+    while (loop->pending) {
+        Connection *conn = loop->pending;
+        loop->pending = conn->next_pending;
+        conn->next_pending = NULL;
+        if (write_output(loop, conn) == -1) {
+            close_connection(loop, conn);
+        }
+    }
+}
+
+/* Helper function. Not in `loop.h` */
+static void accept_connection(EventLoop *loop) {
+    int connfd;
+    if ((connfd = accept(loop->listenfd, (struct sockaddr *) NULL, NULL)) == -1) {
+        /* the client may have given up before we got to it */
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR) {
+            perror("accept :(\n");
+        }
+        return;
+    }
+
+    Connection *conn = add_connection(loop, connfd);
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = connfd };
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, connfd, &ev) == -1) {
+        perror("epoll_ctl :(\n");
+        close_connection(loop, conn);
+        return;
+    }
+
+    printf("[Connection open for user %lld on fd %d]\n", conn->id, connfd);
+}
+
+/* Helper function. Not in `loop.h` */
+static void handle_readable(EventLoop *loop, Connection *conn) {
+    /* Only this read must not wait, writes are queued.
+     * Every packet that came in it is treated before the next wakeup. */
+    ssize_t got = recv(conn->fd, loop->read_buffer, READ_BUFFER_SIZE, MSG_DONTWAIT);
+    if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if (got <= 0) {
+        close_connection(loop, conn);
+        return;
+    }
+
+    /* If more bytes are pending, the level-triggered epoll will report the
+     * socket again */
+    if (handle_input(loop, conn, loop->read_buffer, got)) {
+        close_connection(loop, conn);
+    }
+}
+
+void loop_run(EventLoop *loop) {
+    struct epoll_event events[MAX_EVENTS];
+    current_loop = loop;
+    io_set_flush_hook(queue_output, loop);
+
+    for (;;) {
+        write_pending(loop);
+        flush_write_stats(loop);
+
+        int ready = epoll_wait(loop->epfd, events, MAX_EVENTS, -1);
+        if (ready == -1) {
+            if (errno == EINTR) { continue; }
+            perror("epoll_wait :(\n");
+            exit(ERROR_SERVER);
+        }
+
+        for (int i = 0; i < ready; i++) {
+            int fd = events[i].data.fd;
+
+            if (fd == loop->listenfd) {
+                accept_connection(loop);
+                continue;
+            }
+            if (fd == loop->wake_fd) {
+                take_remote(loop);
+                continue;
+            }
+            if (loop->shard && fd == loop->shard->inbox_fd) {
+                shard_drain(loop->shard);
+                continue;
+            }
+            Watch *watch = watch_of(loop, fd);
+            if (watch) {
+                watch->handler(watch->ctx, fd);
+                continue;
+            }
+
+            /* the connection may have been closed by an earlier event */
+            if ((size_t)fd >= loop->conns_cap || loop->conns[fd] == NULL) {
+                continue;
+            }
+            Connection *conn = loop->conns[fd];
+            if ((events[i].events & EPOLLOUT) && write_output(loop, conn) == -1) {
+                close_connection(loop, conn);
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                handle_readable(loop, conn);
+            }
+        }
+    }
+}
+
+#else
+
+/* ==================== io_uring backend ==================== */
+
+/* Kind of request, stored in the top byte of each request's user_data.
+ * The rest holds the pointer to the Connection or Watch involved. */
+#define OP_ACCEPT 1ULL
+#define OP_RECV   2ULL
+#define OP_SEND   3ULL
+#define OP_CANCEL 4ULL
+#define OP_INBOX  5ULL
+#define OP_WAKE   6ULL
+#define OP_WATCH  7ULL
+
+#define USER_DATA(op, ptr)  (((op) << 56) | (uint64_t)(uintptr_t)(ptr))
+#define USER_OP(data)       ((data) >> 56)
+#define USER_PTR(data)      ((void*)(uintptr_t)((data) & ((1ULL << 56) - 1)))
+
+/* Helper function. Not in `loop.h` */
+static void arm_accept(EventLoop *loop) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    uring_prep_multishot_accept(sqe, loop->listenfd, USER_DATA(OP_ACCEPT, NULL));
+}
+
+/* Helper function. Not in `loop.h` */
+static void arm_recv(EventLoop *loop, Connection *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    uring_prep_multishot_recv(sqe, conn->fd, USER_DATA(OP_RECV, conn));
+}
+
+/* Helper function. Not in `loop.h` */
+static void arm_wake(EventLoop *loop) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    uring_prep_multishot_poll(sqe, loop->wake_fd, USER_DATA(OP_WAKE, NULL));
+}
+
+/* Helper function. Not in `loop.h` */
+static void arm_watch(EventLoop *loop, Watch *watch) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    uring_prep_multishot_poll(sqe, watch->fd, USER_DATA(OP_WATCH, watch));
+}
+
+/* Helper function. Not in `loop.h`
+ * Hands the queue of one connection to the kernel, in a single `sendmsg`
+ * of many packets. Two sends in flight could run at the same time and mix
+ * their bytes, so a connection only has one at a time. */
+static void submit_sends(EventLoop *loop, Connection *conn) {
+    if (conn->in_flight > 0) {
+        conn->out_waiting = 1;
+        return;
+    }
+
+    /* At most URING_SEND_BATCH packets and WRITE_BATCH_BYTES, the rest
+     * waits for the send to complete */
+    size_t taken = 0;
+    size_t bytes = 0;
+    for (;;) {
+        Frame *frame;
+        while (taken < URING_SEND_BATCH && (frame = frame_queue_peek(conn->out)) != NULL
+                && (taken == 0 || bytes + frame->len <= WRITE_BATCH_BYTES)) {
+            frame_queue_pop(conn->out);
+            conn->sending[taken] = frame;
+            conn->sending_iov[taken].iov_base = frame->data;
+            conn->sending_iov[taken].iov_len = frame->len;
+            bytes += frame->len;
+            taken++;
+        }
+        if (frame_queue_peek(conn->out)) {
+            /* stopped by a limit */
+            conn->out_waiting = 1;
+            break;
+        }
+        /* same as `write_output` in the epoll backend */
+        atomic_store(&conn->out_scheduled, 0);
+        if (!frame_queue_peek(conn->out) || atomic_exchange(&conn->out_scheduled, 1)) {
+            break;
+        }
+    }
+    if (taken == 0) {
+        return;
+    }
+
+    conn->sending_count = taken;
+    conn->in_flight = 1;
+    memset(&conn->sending_msg, 0, sizeof(conn->sending_msg));
+    conn->sending_msg.msg_iov = conn->sending_iov;
+    conn->sending_msg.msg_iovlen = taken;
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    uring_prep_sendmsg(sqe, conn->fd, &conn->sending_msg, USER_DATA(OP_SEND, conn));
+    loop->written.writes++;
+    loop->written.packets += taken;
+}
+
+/* Helper function. Not in `loop.h` */
+static void submit_pending(EventLoop *loop) {
+    while (loop->pending) {
+        Connection *conn = loop->pending;
+        loop->pending = conn->next_pending;
+        conn->next_pending = NULL;
+        submit_sends(loop, conn);
+    }
+}
+
+void loop_init(EventLoop *loop, int listenfd) {
+    init_common(loop, listenfd);
+
+    uring_init(&loop->ring);
+    arm_accept(loop);
+    arm_wake(loop);
+}
+
+/* Helper function. Not in `loop.h` */
+static void arm_inbox(EventLoop *loop) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    uring_prep_multishot_poll(sqe, loop->shard->inbox_fd, USER_DATA(OP_INBOX, NULL));
+}
+
+void loop_set_shard(EventLoop *loop, Shard *shard) {
+    loop->shard = shard;
+    shard->loop = loop;
+    arm_inbox(loop);
+}
+
+void connection_watch(Connection *conn, int fd, WatchHandler handler, void *ctx) {
+    arm_watch(conn->loop, add_watch(conn->loop, fd, handler, ctx));
+}
+
+/* The Watch itself is freed when its multishot poll ends */
+void connection_unwatch(Connection *conn, int fd) {
+    EventLoop *loop = conn->loop;
+    Watch *watch = loop->watches[fd];
+    watch->closing = 1;
+    loop->watches[fd] = NULL;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    uring_prep_cancel(sqe, USER_DATA(OP_WATCH, watch), USER_DATA(OP_CANCEL, NULL));
+    uring_submit_and_wait(&loop->ring, 0);
+    close(fd);
+}
+
+/* Helper function. Not in `loop.h`
+ * The Connection itself is freed when its multishot receive ends, since the
+ * kernel may still post completions pointing to it. */
+static void close_connection(EventLoop *loop, Connection *conn) {
+    printf("[Connection closed for user %lld]\n", conn->id);
+
+    release_connection(loop, conn);
+
+    /* Sends must reach the kernel while the fd is still open */
+    forget_output(loop, conn);
+    submit_sends(loop, conn);
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    uring_prep_cancel(sqe, USER_DATA(OP_RECV, conn), USER_DATA(OP_CANCEL, NULL));
+    uring_submit_and_wait(&loop->ring, 0);
+
+    conn->closing = 1;
+    io_detach(conn->fd);
+    close(conn->fd);
+    loop->conns[conn->fd] = NULL;
+}
+
+/* Helper function. Not in `loop.h` */
+static void accept_connection(EventLoop *loop, int connfd) {
+    Connection *conn = add_connection(loop, connfd);
+    arm_recv(loop, conn);
+
+    printf("[Connection open for user %lld on fd %d]\n", conn->id, connfd);
+}
+
+/* Helper function. Not in `loop.h` */
+static void handle_recv(EventLoop *loop, Connection *conn, struct io_uring_cqe *cqe) {
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        /* packets are decoded straight from the provided buffer */
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0 && !conn->closing) {
+            if (handle_input(loop, conn, uring_buffer(&loop->ring, bid), cqe->res)) {
+                close_connection(loop, conn);
+            }
+        }
+        uring_recycle_buffer(&loop->ring, bid);
+    } else if (!conn->closing && (cqe->res == 0 || cqe->res != -ENOBUFS)) {
+        /* end of file or a receive error */
+        close_connection(loop, conn);
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        if (conn->closing) {
+            conn->recv_done = 1;
+            if (conn->in_flight == 0) {
+                free_connection(conn);
+            }
+        } else {
+            /* out of provided buffers, or the kernel stopped the multishot */
+            arm_recv(loop, conn);
+        }
+    }
+}
+
+/* Helper function. Not in `loop.h`
+ * A client that doesn't read keeps its send waiting in the kernel, its
+ * packets count towards MAX_QUEUED_BYTES until it completes. */
+static void handle_send(Connection *conn, struct io_uring_cqe *cqe) {
+    if (cqe->res < 0 && cqe->res != -ECANCELED && !conn->closing) {
+        fprintf(stderr, "[Send failed: %s]\n", strerror(-cqe->res));
+    }
+    conn->in_flight--;
+
+    for (size_t i = 0; i < conn->sending_count; i++) {
+        atomic_fetch_sub_explicit(&conn->out_bytes, conn->sending[i]->len, memory_order_relaxed);
+        frame_release(conn->sending[i]);
+    }
+    conn->sending_count = 0;
+
+    if (conn->recv_done) {
+        free_connection(conn);
+    } else if (conn->out_waiting && !conn->closing) {
+        /* what was queued meanwhile goes in the next submission */
+        conn->out_waiting = 0;
+        conn->next_pending = conn->loop->pending;
+        conn->loop->pending = conn;
+    }
+}
+
+/* Helper function. Not in `loop.h` */
+static void handle_watch(EventLoop *loop, Watch *watch, struct io_uring_cqe *cqe) {
+    if (!watch->closing && cqe->res > 0) {
+        watch->handler(watch->ctx, watch->fd);
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        if (watch->closing) {
+            free(watch);
+        } else {
+            arm_watch(loop, watch);
+        }
+    }
+}
+
+void loop_run(EventLoop *loop) {
+    current_loop = loop;
+    io_set_flush_hook(queue_output, loop);
+
+    for (;;) {
+        submit_pending(loop);
+        flush_write_stats(loop);
+        uring_submit_and_wait(&loop->ring, 1);
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&loop->ring)) != NULL) {
+            uint64_t data = cqe->user_data;
+
+            switch (USER_OP(data)) {
+                case OP_ACCEPT:
+                    if (cqe->res >= 0) {
+                        accept_connection(loop, cqe->res);
+                    } else if (cqe->res != -ECONNABORTED && cqe->res != -EINTR) {
+                        fprintf(stderr, "[accept failed: %s]\n", strerror(-cqe->res));
+                    }
+                    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                        arm_accept(loop);
+                    }
+                    break;
+                case OP_RECV:
+                    handle_recv(loop, (Connection*)USER_PTR(data), cqe);
+                    break;
+                case OP_INBOX:
+                    shard_drain(loop->shard);
+                    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                        arm_inbox(loop);
+                    }
+                    break;
+                case OP_WAKE:
+                    take_remote(loop);
+                    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                        arm_wake(loop);
+                    }
+                    break;
+                case OP_WATCH:
+                    handle_watch(loop, (Watch*)USER_PTR(data), cqe);
+                    break;
+                case OP_SEND:
+                    handle_send((Connection*)USER_PTR(data), cqe);
+                    break;
+                default:
+                    /* cancellations need no treatment */
+                    break;
+            }
+
+            uring_cqe_seen(&loop->ring);
+        }
+    }
+}
+
+#endif
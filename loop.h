@@ -0,0 +1,160 @@
+#ifndef LOOP_H
+#define LOOP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "mqtt.h"
+#include "io.h"
+#include "queue.h"
+
+#ifdef USE_IO_URING
+#include "uring.h"
+#endif
+
+/* Maximum amount of events handled by a single `epoll_wait` call */
+#define MAX_EVENTS 64
+/* Bytes taken from a socket on each wakeup. Large enough for a publisher
+ * pipelining hundreds of small packets to be served by a single `recv`. */
+#define READ_BUFFER_SIZE 65536
+/* Output queued for a connection that doesn't read it. Past this, or
+ * FRAME_QUEUE_SLOTS packets, new packets are dropped, which QoS 0 allows,
+ * instead of growing forever. A packet longer than this is still queued
+ * when nothing else is. */
+#define MAX_QUEUED_BYTES (8 * 1024 * 1024)
+/* Bytes of queued packets gathered in a single write to a socket, along with
+ * at most IOV_MAX packets. A longer packet is still written, on its own. */
+#define WRITE_BATCH_BYTES (256 * 1024)
+
+/* Packets written to sockets, and the writes (`sendmsg` calls, or sends
+ * handed to io_uring) they took, over every loop */
+typedef struct WriteStats {
+    unsigned long long packets;
+    unsigned long long writes;
+} WriteStats;
+
+/* Called by the loop whenever a watched fd is readable */
+typedef void (*WatchHandler)(void *ctx, int fd);
+
+/* An fd other than a client socket, see `connection_watch` */
+typedef struct Watch {
+    int fd;
+    WatchHandler handler;
+    void *ctx;
+#ifdef USE_IO_URING
+    /* freed once its multishot poll is done */
+    int closing;
+#endif
+} Watch;
+
+/* A client connection, multiplexed by the event loop */
+typedef struct Connection {
+    int fd;
+    long long int id;
+    /* set once the client has sent its CONNECT */
+    int connected;
+    /* loop the connection belongs to, the only one writing to its socket */
+    struct EventLoop *loop;
+    /* packet being received, possibly across several reads */
+    MqttDecoder decoder;
+    /* topics subscribed, to drop them when the connection closes */
+    String *subscriptions;
+    size_t subscription_count;
+    size_t subscription_cap;
+    /* where PUBLISH packets arrive in the pre-fork mode, see `handlers.c` */
+    struct Mailbox *mailbox;
+    /* bytes written by the codec, see `io_attach` */
+    IoChannel channel;
+    /* Packets waiting to be written, oldest first. Any thread may queue
+     * them, without locks; only the loop takes them out. Each holds one
+     * reference to a frame, which may be queued to other connections too. */
+    FrameQueue *out;
+    _Atomic size_t out_bytes;
+    _Atomic unsigned long dropped;
+    /* set while the loop knows the queue has something: only the packet
+     * that finds it unset has to tell the loop */
+    _Atomic int out_scheduled;
+    struct Connection *next_pending;
+#ifndef USE_IO_URING
+    /* bytes of the oldest packet already written */
+    size_t out_sent;
+    /* set while the socket is full and watched for EPOLLOUT */
+    int want_write;
+#else
+    /* packets handed to the kernel in a single `sendmsg`, still counted in
+     * `out_bytes` until it completes */
+    Frame *sending[URING_SEND_BATCH];
+    struct iovec sending_iov[URING_SEND_BATCH];
+    struct msghdr sending_msg;
+    size_t sending_count;
+    size_t in_flight;
+    /* set when the queue waits for the send in flight to complete */
+    int out_waiting;
+    /* freed once its multishot receive and its send are done */
+    int closing;
+    int recv_done;
+#endif
+} Connection;
+
+/* Connection manager based on epoll, or on io_uring when built with
+ * `make IO_BACKEND=uring`.
+ * Every client socket accepted from `listenfd` is watched by the same loop,
+ * and the packet handlers from `handlers.c` run inside the loop instead of in
+ * a forked child. Each reactor thread runs its own loop. */
+typedef struct EventLoop {
+    int epfd;
+    int listenfd;
+    /* connections indexed by their socket file descriptor */
+    Connection **conns;
+    size_t conns_cap;
+    /* other fds read by the loop, also indexed by fd */
+    Watch **watches;
+    size_t watches_cap;
+    /* set in shared-nothing mode */
+    struct Shard *shard;
+    /* connections with output queued by this loop's thread, written before
+     * waiting for events again */
+    Connection *pending;
+    /* connections with output queued by other threads, a lock-free stack.
+     * Only the thread that finds it empty wakes the loop up, through
+     * `wake_fd`. */
+    _Atomic(Connection*) remote;
+    int wake_fd;
+    /* added to the totals of `loop_write_stats` before each wait */
+    WriteStats written;
+#ifndef USE_IO_URING
+    /* every socket of the loop is read into this same buffer */
+    uint8_t *read_buffer;
+#else
+    Uring ring;
+#endif
+} EventLoop;
+
+void loop_init(EventLoop *loop, int listenfd);
+void loop_run(EventLoop *loop);
+/* Makes the loop route packets through `shard` and watch its inbox */
+void loop_set_shard(EventLoop *loop, struct Shard *shard);
+/* Must be called before forking loops into other processes, so connection
+ * ids and write statistics stay common to all of them */
+void loop_share_counters(void);
+WriteStats loop_write_stats(void);
+
+/* Returns 0 if the connection was already subscribed to `topic` */
+int connection_add_topic(Connection *conn, String topic);
+/* Returns 0 if the connection wasn't subscribed to `topic` */
+int connection_remove_topic(Connection *conn, String topic);
+void connection_clear_topics(Connection *conn);
+
+/* Queues an encoded packet for `conn`, from any thread. Only the loop of the
+ * connection writes to its socket, so packets never interleave. */
+void connection_send(Connection *conn, const uint8_t *data, size_t len);
+/* Same as `connection_send`, without copying: takes a reference to `frame`,
+ * which the caller may queue to other connections as well */
+void connection_send_frame(Connection *conn, Frame *frame);
+/* Makes the loop of `conn` call `handler` whenever `fd` is readable */
+void connection_watch(Connection *conn, int fd, WatchHandler handler, void *ctx);
+/* Stops watching `fd` and closes it */
+void connection_unwatch(Connection *conn, int fd);
+
+#endif
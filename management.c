@@ -1,9 +1,12 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <ftw.h>
 
 #include "errors.h"
 #include "management.h"
@@ -14,10 +17,16 @@ int directory_exists(const char *path) {
 }
 
 /* Helper function. Not in `management.h` */
+int internal_remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st; (void)flag; (void)ftw;
+    return remove(path);
+}
+
+/* Helper function. Not in `management.h`
+ * Walks the tree instead of calling `system("rm -rf")`, so the broker never
+ * forks a shell. */
 int internal_remove_dir(const char *path) {
-    char command[1024];
-    snprintf(command, sizeof(command), "rm -rf \"%s\"", path);
-    return system(command);
+    return nftw(path, internal_remove_entry, 16, FTW_DEPTH | FTW_PHYS);
 }
 
 int fresh_dir(const char *path) {
@@ -110,3 +119,37 @@ int remove_fifo(const char *path) {
 
     return existed;
 }
+
+int file_exists(const char *path) {
+    struct stat st;
+    return (stat(path, &st) == 0 && S_ISREG(st.st_mode));
+}
+
+int ensure_file(const char *path) {
+    int existed = file_exists(path);
+
+    if (!existed) {
+        int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            /* the name comes from a client, only its request fails */
+            fprintf(stderr, "[ERROR: Could not create file '%s']\n", path);
+            return -1;
+        }
+        close(fd);
+    }
+
+    return existed;
+}
+
+int remove_file(const char *path) {
+    int existed = file_exists(path);
+
+    if (existed) {
+        if (unlink(path) == -1) {
+            fprintf(stderr, "[ERROR: Could not remove file '%s']\n", path);
+            exit(ERROR_SERVER);
+        }
+    }
+
+    return existed;
+}
@@ -12,4 +12,9 @@ int fresh_fifo(const char *path);
 int ensure_fifo(const char *path);
 int remove_fifo(const char *path);
 
+int file_exists(const char *path);
+/* Returns 1 if the file existed, 0 if it was created, -1 if it couldn't be */
+int ensure_file(const char *path);
+int remove_file(const char *path);
+
 #endif
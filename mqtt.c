@@ -1,68 +1,262 @@
 #define _GNU_SOURCE
 #include <unistd.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 #include "mqtt.h"
 #include "io.h"
+#include "topics.h"
+
+/* === Buffer decoding ===
+ * Internally, decoding moves a cursor over bytes that are already in memory.
+ * The public `decode_*` functions wrap these and return how many bytes they
+ * consumed; the `read_*` functions get the bytes from a file descriptor and
+ * hand them over. */
+
+/* Bytes of a packet body that are being decoded */
+typedef struct Cursor {
+    const uint8_t *data;
+    size_t len;
+    size_t pos;
+} Cursor;
+
+/* Helper function. Not in `mqtt.h`
+ * All `take_*` functions return 0 on success and -1 if the body ends too
+ * early or holds something invalid. */
+static int take_bytes(Cursor *cur, void *dst, size_t len) {
+    if (cur->len - cur->pos < len) {
+        return -1;
+    }
+    memcpy(dst, cur->data + cur->pos, len);
+    cur->pos += len;
+    return 0;
+}
 
-// Read a Variable Byte Integer from a file descriptor.
-ssize_t read_var_int(int fd, uint32_t *val) {
-    ssize_t bytes_read = 0;
+/* Helper function. Not in `mqtt.h` */
+static int take_uint8(Cursor *cur, uint8_t *val) {
+    return take_bytes(cur, val, 1);
+}
+
+/* Helper function. Not in `mqtt.h` */
+static int take_uint16(Cursor *cur, uint16_t *val) {
+    if (take_bytes(cur, val, 2) == -1) {
+        return -1;
+    }
+    *val = ntohs(*val);
+    return 0;
+}
+
+/* Helper function. Not in `mqtt.h` */
+static int take_uint32(Cursor *cur, uint32_t *val) {
+    if (take_bytes(cur, val, 4) == -1) {
+        return -1;
+    }
+    *val = ntohl(*val);
+    return 0;
+}
+
+/* Helper function. Not in `mqtt.h` */
+static int take_var_int(Cursor *cur, uint32_t *val) {
     uint32_t multiplier = 1;
     uint8_t byte = 0;
 
     *val = 0;
     do {
-        bytes_read += read_uint8(fd, &byte);
+        if (multiplier > 128 * 128 * 128 || take_uint8(cur, &byte) == -1) {
+            return -1;
+        }
         *val += (byte & 127) * multiplier;
-        if (multiplier > 128 * 128 * 128) {
+        multiplier *= 128;
+    } while ((byte & 128) != 0);
+
+    return 0;
+}
+
+/* Helper function. Not in `mqtt.h` */
+static int take_binary_data(Cursor *cur, BinaryData *data) {
+    uint16_t len;
+    if (take_uint16(cur, &len) == -1 || cur->len - cur->pos < len) {
+        return -1;
+    }
+
+    data->bytes = (uint8_t*)malloc(len);
+    if (!data->bytes && len > 0) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+    take_bytes(cur, data->bytes, len);
+    data->len = len;
+    return 0;
+}
+
+/* Helper function. Not in `mqtt.h` */
+static int take_string(Cursor *cur, String *str) {
+    uint16_t len;
+    if (take_uint16(cur, &len) == -1 || cur->len - cur->pos < len) {
+        return -1;
+    }
+
+    str->val = (char*)malloc(len + 1);
+    if (!str->val) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+    take_bytes(cur, str->val, len);
+    str->val[len] = '\0';
+    str->len = len;
+    return 0;
+}
+
+/* Helper function. Not in `mqtt.h` */
+static int take_string_pair(Cursor *cur, StringPair *pair) {
+    if (take_string(cur, &pair->str1) == -1) {
+        return -1;
+    }
+    if (take_string(cur, &pair->str2) == -1) {
+        destroy_string(pair->str1);
+        return -1;
+    }
+    return 0;
+}
+
+/* === Buffer encoding ===
+ * The other way around: fields are appended to an IoBuffer, and the `write_*`
+ * functions send everything that was appended with a single system call.
+ * Given a NULL buffer, encoding only counts the bytes it would append, which
+ * is how the Remaining Length of a packet is computed. */
+
+/* Where the `write_*` functions stage their bytes, reused between calls */
+static __thread IoBuffer scratch = { 0 };
+
+/* Helper function. Not in `mqtt.h`
+ * All `put_*` functions return how many bytes they appended. */
+static size_t put_bytes(IoBuffer *out, const void *src, size_t len) {
+    if (out != NULL && len > 0) {
+        io_buffer_append(out, (const uint8_t*)src, len);
+    }
+    return len;
+}
+
+/* Helper function. Not in `mqtt.h` */
+static size_t put_uint8(IoBuffer *out, uint8_t val) {
+    return put_bytes(out, &val, 1);
+}
+
+/* Helper function. Not in `mqtt.h` */
+static size_t put_uint16(IoBuffer *out, uint16_t val) {
+    uint16_t net = htons(val);
+    return put_bytes(out, &net, 2);
+}
+
+/* Helper function. Not in `mqtt.h` */
+static size_t put_uint32(IoBuffer *out, uint32_t val) {
+    uint32_t net = htonl(val);
+    return put_bytes(out, &net, 4);
+}
+
+/* Helper function. Not in `mqtt.h` */
+static size_t put_var_int(IoBuffer *out, uint32_t val) {
+    uint8_t bytes[4];
+    size_t len = 0;
+    do {
+        uint8_t byte = val % 128;
+        val = val / 128;
+        if (val > 0) { byte = byte | 128; }
+        bytes[len++] = byte;
+    } while (val > 0 && len < sizeof(bytes));
+    return put_bytes(out, bytes, len);
+}
+
+/* Helper function. Not in `mqtt.h` */
+static size_t put_binary_data(IoBuffer *out, BinaryData *data) {
+    return put_uint16(out, data->len) + put_bytes(out, data->bytes, data->len);
+}
+
+/* Helper function. Not in `mqtt.h` */
+static size_t put_string(IoBuffer *out, String *str) {
+    return put_uint16(out, str->len) + put_bytes(out, str->val, str->len);
+}
+
+/* Helper function. Not in `mqtt.h` */
+static size_t put_string_pair(IoBuffer *out, StringPair *pair) {
+    return put_string(out, &pair->str1) + put_string(out, &pair->str2);
+}
+
+/* Helper function. Not in `mqtt.h`
+ * Sends what was staged in `scratch` and empties it. */
+static ssize_t flush_scratch(int fd) {
+    size_t len = scratch.end - scratch.start;
+    ssize_t bytes_written = write_many(fd, scratch.data + scratch.start, len);
+    io_buffer_consume(&scratch, len);
+    return bytes_written;
+}
+
+// Decodes a Variable Byte Integer from memory.
+ssize_t decode_var_int(const uint8_t *buf, size_t len, uint32_t *val) {
+    Cursor cur = { .data = buf, .len = len, .pos = 0 };
+    return take_var_int(&cur, val) == -1 ? -1 : (ssize_t)cur.pos;
+}
+
+// Read a Variable Byte Integer from a file descriptor.
+ssize_t read_var_int(int fd, uint32_t *val) {
+    uint8_t bytes[4];
+    size_t len = 0;
+
+    do {
+        if (len == sizeof(bytes)) {
             // Invalid variable byte integer.
             fprintf(stderr, "[Read invalid Variable Byte Integer]\n");
             exit(ERROR_INVALID_INP);
         }
-        multiplier *= 128;
-    } while ((byte & 128) != 0);
+        read_uint8(fd, &bytes[len]);
+    } while ((bytes[len++] & 128) != 0);
 
-    return bytes_read;
+    return decode_var_int(bytes, len, val);
 }
 
 ssize_t write_var_int(int fd, uint32_t *val) {
-    ssize_t bytes_written = 0;
-    uint32_t x = *val;
-    do {
-        uint8_t byte = x % 128;
-        x = x / 128;
-        if (x > 0) { byte = byte | 128; }
-        bytes_written += write_uint8(fd, &byte);
-    } while (x > 0);
-    
-    return bytes_written;
+    put_var_int(&scratch, *val);
+    return flush_scratch(fd);
 }
 
-ssize_t read_binary_data(int fd, BinaryData *data) {
-    ssize_t bytes_read = 0;
-    bytes_read += read_uint16(fd, &(data->len));
+/* Helper function. Not in `mqtt.h`
+ * Reads a 2-byte length and what follows it, for the decoders of strings
+ * and binary data. The returned buffer includes the length. */
+static uint8_t *read_prefixed(int fd, size_t *total) {
+    uint16_t len;
+    read_uint16(fd, &len);
 
-    data->bytes = (uint8_t*)malloc(data->len * sizeof(uint8_t));
-    // we don't have to do this byte by byte, but when I tried to
-    // change it it failed catastrophically... better leave as is...
-    // same for the others
-    for (uint32_t i = 0; i < data->len; i++) {
-        bytes_read += read_uint8(fd, &(data->bytes[i]));
+    uint8_t *bytes = (uint8_t*)malloc(2 + (size_t)len);
+    if (!bytes) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+    bytes[0] = len >> 8;
+    bytes[1] = len & 0xFF;
+    if (len > 0) {
+        read_many(fd, bytes + 2, len);
     }
 
-    return bytes_read;
+    *total = 2 + (size_t)len;
+    return bytes;
 }
 
-ssize_t write_binary_data(int fd, BinaryData *data) {
-    ssize_t bytes_written = 0;
-    bytes_written += write_uint16(fd, &(data->len));
+ssize_t decode_binary_data(const uint8_t *buf, size_t len, BinaryData *data) {
+    Cursor cur = { .data = buf, .len = len, .pos = 0 };
+    return take_binary_data(&cur, data) == -1 ? -1 : (ssize_t)cur.pos;
+}
 
-    for (uint32_t i = 0; i < data->len; i++) {
-        bytes_written += write_uint8(fd, &(data->bytes[i]));
-    }
+ssize_t read_binary_data(int fd, BinaryData *data) {
+    size_t total;
+    uint8_t *bytes = read_prefixed(fd, &total);
+    ssize_t bytes_read = decode_binary_data(bytes, total, data);
+    free(bytes);
+    return bytes_read;
+}
 
-    return bytes_written;
+ssize_t write_binary_data(int fd, BinaryData *data) {
+    put_binary_data(&scratch, data);
+    return flush_scratch(fd);
 }
 
 void destroy_binary_data(BinaryData data) {
@@ -70,36 +264,34 @@ void destroy_binary_data(BinaryData data) {
 }
 
 // MQTT protocol asks for UTF-8, but we'll do ASCII strings
-ssize_t read_string(int fd, String *str) {
-    ssize_t bytes_read = 0;
-    uint32_t i = 0;
-    bytes_read += read_uint16(fd, &str->len);
-
-    str->val = (char*)malloc((str->len + 1) * sizeof(char));
-    for (i = 0; i < str->len; i++) {
-        bytes_read += read_uint8(fd, (uint8_t*)&(str->val)[i]);
-    }
-    str->val[i] = '\0';
+ssize_t decode_string(const uint8_t *buf, size_t len, String *str) {
+    Cursor cur = { .data = buf, .len = len, .pos = 0 };
+    return take_string(&cur, str) == -1 ? -1 : (ssize_t)cur.pos;
+}
 
+ssize_t read_string(int fd, String *str) {
+    size_t total;
+    uint8_t *bytes = read_prefixed(fd, &total);
+    ssize_t bytes_read = decode_string(bytes, total, str);
+    free(bytes);
     return bytes_read;
 }
 
 // Writing null-terminated strings, without the '\0'
 ssize_t write_string(int fd, String *str) {
-    ssize_t bytes_written = 0;
-
-    bytes_written += write_uint16(fd, &str->len);
-    for (uint16_t i = 0; i < str->len; i++) {
-        bytes_written += write_uint8(fd, (uint8_t*)&(str->val)[i]);
-    }
-
-    return bytes_written;
+    put_string(&scratch, str);
+    return flush_scratch(fd);
 }
 
 void destroy_string(String str) {
     free(str.val);
 }
 
+ssize_t decode_string_pair(const uint8_t *buf, size_t len, StringPair *pair) {
+    Cursor cur = { .data = buf, .len = len, .pos = 0 };
+    return take_string_pair(&cur, pair) == -1 ? -1 : (ssize_t)cur.pos;
+}
+
 ssize_t read_string_pair(int fd, StringPair *pair) {
     ssize_t bytes_read = 0;
 
@@ -110,12 +302,8 @@ ssize_t read_string_pair(int fd, StringPair *pair) {
 }
 
 ssize_t write_string_pair(int fd, StringPair *pair) {
-    ssize_t bytes_written = 0;
-
-    bytes_written += write_string(fd, &(pair->str1));
-    bytes_written += write_string(fd, &(pair->str2));
-
-    return bytes_written;
+    put_string_pair(&scratch, pair);
+    return flush_scratch(fd);
 }
 
 void destroy_string_pair(StringPair pair) {
@@ -123,16 +311,25 @@ void destroy_string_pair(StringPair pair) {
     destroy_string(pair.str2);
 }
 
+ssize_t decode_packet_identifier(const uint8_t *buf, size_t len, PacketID *id) {
+    Cursor cur = { .data = buf, .len = len, .pos = 0 };
+    uint16_t value;
+    if (take_uint16(&cur, &value) == -1) {
+        return -1;
+    }
+    *id = value;
+    return cur.pos;
+}
+
 ssize_t read_packet_identifier(int fd, PacketID *id) {
-    ssize_t bytes_read = 0;
-    bytes_read = read_uint16(fd, (uint16_t*)id);
-    return bytes_read;
+    uint8_t bytes[2];
+    read_many(fd, bytes, sizeof(bytes));
+    return decode_packet_identifier(bytes, sizeof(bytes), id);
 }
 
 ssize_t write_packet_identifier(int fd, PacketID *id) {
-    ssize_t bytes_written = 0;
-    bytes_written = write_uint16(fd, (uint16_t*)id);
-    return bytes_written;
+    put_uint16(&scratch, *id);
+    return flush_scratch(fd);
 }
 
 MqttPropType prop_id_to_type(uint16_t id) {
@@ -172,98 +369,122 @@ MqttPropType prop_id_to_type(uint16_t id) {
         case 38:
             return STR_PAIR;
         default:
-            fprintf(stderr, "[Invalid prop id %d, stopping]\n", id);
-            exit(ERROR_SERVER);
+            /* callers decide what to do with it */
+            return INVALID_PROP;
     }
 }
 
-ssize_t read_properties(int fd, MqttProperty **props, var_int len) {
-    ssize_t bytes_read = 0;
-
-    if (len <= 0) {
-        *props = NULL;
-        return bytes_read;
+/* Helper function. Not in `mqtt.h`
+ * The Property Length on the wire is a size in bytes, but `*props_len` keeps
+ * the amount of properties, like everywhere else. Both `*props` and
+ * `*props_len` are only set once every property was read, so a failure
+ * leaves nothing behind. */
+static int take_properties(Cursor *cur, MqttProperty **props, var_int *props_len) {
+    var_int size;
+    *props = NULL;
+    *props_len = 0;
+
+    if (take_var_int(cur, &size) == -1 || size > cur->len - cur->pos) {
+        return -1;
+    }
+    if (size == 0) {
+        return 0;
     }
 
-    *props = (MqttProperty *)malloc(len * sizeof(MqttProperty));
-    if (!*props && len > 0) { 
+    /* properties take at least two bytes each */
+    Cursor section = { .data = cur->data + cur->pos, .len = size, .pos = 0 };
+    MqttProperty *read = (MqttProperty*)malloc((size / 2) * sizeof(MqttProperty));
+    if (!read) {
         fprintf(stderr, "[Memory error, stopping]\n");
         exit(ERROR_SERVER);
     }
 
-    for (uint32_t i = 0; i < len; i++) {
+    var_int count = 0;
+    while (section.pos < section.len) {
         MqttProperty prop;
-
-        bytes_read += read_var_int(fd, &(prop.id));
-        switch (prop_id_to_type(prop.id)) {
-            case BYTE:
-                bytes_read += read_uint8(fd, &prop.content.byte);
-                break;
-            case TWO_BYTE:
-                bytes_read += read_uint16(fd, &prop.content.two_byte);
-                break;
-            case FOUR_BYTE:
-                bytes_read += read_uint32(fd, &prop.content.four_byte);
-                break;
-            case VAR_INT:
-                bytes_read += read_var_int(fd, &prop.content.var_int);
-                break;
-            case BIN_DATA:
-                bytes_read += read_binary_data(fd, &prop.content.data);
-                break;
-            case STR:
-                bytes_read += read_string(fd, &prop.content.string);
-                break;
-            case STR_PAIR:
-                bytes_read += read_string_pair(fd, &prop.content.string_pair);
-                break;
-            default:
-                // This case should not be reached if the packet is well-formed.
-                fprintf(stderr, "[Attempted to read invalid property id %d]\n", prop.id);
-                exit(ERROR_CLIENT);
-                break;
+        int result = take_var_int(&section, &prop.id);
+
+        if (result == 0) {
+            switch (prop_id_to_type(prop.id)) {
+                case BYTE:
+                    result = take_uint8(&section, &prop.content.byte);
+                    break;
+                case TWO_BYTE:
+                    result = take_uint16(&section, &prop.content.two_byte);
+                    break;
+                case FOUR_BYTE:
+                    result = take_uint32(&section, &prop.content.four_byte);
+                    break;
+                case VAR_INT:
+                    result = take_var_int(&section, &prop.content.var_int);
+                    break;
+                case BIN_DATA:
+                    result = take_binary_data(&section, &prop.content.data);
+                    break;
+                case STR:
+                    result = take_string(&section, &prop.content.string);
+                    break;
+                case STR_PAIR:
+                    result = take_string_pair(&section, &prop.content.string_pair);
+                    break;
+                default:
+                    result = -1;
+            }
         }
 
-        (*props)[i] = prop;
+        if (result == -1) {
+            destroy_properties(read, count);
+            return -1;
+        }
+        read[count++] = prop;
     }
 
-    return bytes_read;
+    cur->pos += size;
+    *props = read;
+    *props_len = count;
+    return 0;
 }
 
-ssize_t write_properties(int fd, MqttProperty **props, var_int len) {
-    ssize_t bytes_written = 0;
+ssize_t decode_properties(const uint8_t *buf, size_t len, MqttProperty **props, var_int *props_len) {
+    Cursor cur = { .data = buf, .len = len, .pos = 0 };
+    return take_properties(&cur, props, props_len) == -1 ? -1 : (ssize_t)cur.pos;
+}
+
+/* Helper function. Not in `mqtt.h` */
+static size_t put_properties(IoBuffer *out, MqttProperty *props, var_int len) {
+    size_t bytes_written = 0;
 
     if (len <= 0) {
         return bytes_written;
     }
 
     for (uint32_t i = 0; i < len; i++) {
-        bytes_written += write_var_int(fd, &((*props)[i].id));
-        switch (prop_id_to_type((*props)[i].id)) {
+        bytes_written += put_var_int(out, props[i].id);
+        switch (prop_id_to_type(props[i].id)) {
             case BYTE:
-                bytes_written += write_uint8(fd, &((*props)[i].content.byte));
+                bytes_written += put_uint8(out, props[i].content.byte);
                 break;
             case TWO_BYTE:
-                bytes_written += write_uint16(fd, &((*props)[i].content.two_byte));
+                bytes_written += put_uint16(out, props[i].content.two_byte);
                 break;
             case FOUR_BYTE:
-                bytes_written += write_uint32(fd, &((*props)[i].content.four_byte));
+                bytes_written += put_uint32(out, props[i].content.four_byte);
                 break;
             case VAR_INT:
-                bytes_written += write_var_int(fd, &((*props)[i].content.var_int));
+                bytes_written += put_var_int(out, props[i].content.var_int);
                 break;
             case BIN_DATA:
-                bytes_written += write_binary_data(fd, &((*props)[i].content.data));
+                bytes_written += put_binary_data(out, &props[i].content.data);
                 break;
             case STR:
-                bytes_written += write_string(fd, &((*props)[i].content.string));
+                bytes_written += put_string(out, &props[i].content.string);
                 break;
             case STR_PAIR:
-                bytes_written += write_string_pair(fd, &((*props)[i].content.string_pair));
+                bytes_written += put_string_pair(out, &props[i].content.string_pair);
                 break;
             default:
                 // This case should not be reached if the packet is well-formed.
-                fprintf(stderr, "[Attempted to read invalid property id %d]\n", (*props)[i].id);
+                fprintf(stderr, "[Attempted to write invalid property id %d]\n", props[i].id);
                 exit(ERROR_CLIENT);
                 break;
         }
@@ -272,6 +493,13 @@ ssize_t write_properties(int fd, MqttProperty **props, var_int len) {
     return bytes_written;
 }
 
+/* Helper function. Not in `mqtt.h`
+ * The Property Length, which counts bytes, and then the properties. */
+static size_t put_property_block(IoBuffer *out, MqttProperty *props, var_int len) {
+    size_t props_size = put_properties(NULL, props, len);
+    return put_var_int(out, props_size) + put_properties(out, props, len);
+}
+
 void destroy_properties(MqttProperty *props, var_int len) {
     for (uint32_t i = 0; i < len; i++) {
         MqttProperty prop = props[i];
@@ -293,205 +521,201 @@ void destroy_properties(MqttProperty *props, var_int len) {
     free(props);
 }
 
-ssize_t read_var_header(int fd, MqttVarHeader *var_header, MqttFixedHeader fixed_header) {
-    ssize_t bytes_read = 0;
+/* Helper function. Not in `mqtt.h`
+ * Reason code and properties that may be left out at the end of a packet */
+static int take_optional_reason(Cursor *cur, uint8_t *reason_code, MqttProperty **props, var_int *props_len) {
+    *reason_code = 0;
+    *props = NULL;
+    *props_len = 0;
+
+    if (cur->pos < cur->len && take_uint8(cur, reason_code) == -1) {
+        return -1;
+    }
+    if (cur->pos < cur->len) {
+        return take_properties(cur, props, props_len);
+    }
+    return 0;
+}
+
+/* Helper function. Not in `mqtt.h`
+ * Packet identifier followed by properties */
+static int take_identified(Cursor *cur, PacketID *packet_id, MqttProperty **props, var_int *props_len) {
+    uint16_t id;
+    if (take_uint16(cur, &id) == -1) {
+        return -1;
+    }
+    *packet_id = id;
+    return take_properties(cur, props, props_len);
+}
+
+/* Helper function. Not in `mqtt.h`
+ * Packet identifier of a PUBLISH acknowledgement, then its optional reason */
+static int take_ack(Cursor *cur, PacketID *packet_id, uint8_t *reason_code,
+                    MqttProperty **props, var_int *props_len) {
+    uint16_t id;
+    if (take_uint16(cur, &id) == -1) {
+        return -1;
+    }
+    *packet_id = id;
+    return take_optional_reason(cur, reason_code, props, props_len);
+}
 
+/* Helper function. Not in `mqtt.h` */
+static int take_var_header(Cursor *cur, MqttVarHeader *var_header, MqttFixedHeader fixed_header) {
     switch ((MqttControlType)fixed_header.type) {
         case CONNECT:
-            bytes_read += read_string(fd, &(var_header->connect.protocol_name));
-            bytes_read += read_uint8(fd, &(var_header->connect.protocol_version));
-            bytes_read += read_uint8(fd, &(var_header->connect.connect_flags));
-            bytes_read += read_var_int(fd, &(var_header->connect.props_len));
-            bytes_read += read_properties(fd, &(var_header->connect.props), var_header->connect.props_len);
-            break;
+            if (take_string(cur, &var_header->connect.protocol_name) == -1) {
+                return -1;
+            }
+            if (take_uint8(cur, &var_header->connect.protocol_version) == -1 ||
+                take_uint8(cur, &var_header->connect.connect_flags) == -1) {
+                return -1;
+            }
+            return take_properties(cur, &var_header->connect.props, &var_header->connect.props_len);
         case CONNACK:
-            bytes_read += read_uint8(fd, &(var_header->connack.ack_flags));
-            bytes_read += read_uint8(fd, &(var_header->connack.reason_code));
-            bytes_read += read_var_int(fd, &(var_header->connack.props_len));
-            bytes_read += read_properties(fd, &(var_header->connack.props), var_header->connack.props_len);
-            break;
+            if (take_uint8(cur, &var_header->connack.ack_flags) == -1 ||
+                take_uint8(cur, &var_header->connack.reason_code) == -1) {
+                return -1;
+            }
+            return take_properties(cur, &var_header->connack.props, &var_header->connack.props_len);
         case PUBLISH:
-            bytes_read += read_string(fd, &(var_header->publish.topic_name));
+            if (take_string(cur, &var_header->publish.topic_name) == -1) {
+                return -1;
+            }
             /* note: 0x6 = 0b0110 */
             if ((fixed_header.flags & 0x6) > 0) {
-                bytes_read += read_packet_identifier(fd, &(var_header->publish.packet_id));
+                uint16_t id;
+                if (take_uint16(cur, &id) == -1) {
+                    return -1;
+                }
+                var_header->publish.packet_id = id;
             }
-            bytes_read += read_var_int(fd, &(var_header->publish.props_len));
-            bytes_read += read_properties(fd, &(var_header->publish.props), var_header->publish.props_len);
-            break;
+            return take_properties(cur, &var_header->publish.props, &var_header->publish.props_len);
         case PUBACK:
-            bytes_read += read_packet_identifier(fd, &(var_header->puback.packet_id));
-            bytes_read += read_uint8(fd, &(var_header->puback.reason_code));
-            if (fixed_header.len - bytes_read >= 4) {
-                bytes_read += read_var_int(fd, &(var_header->puback.props_len));
-                bytes_read += read_properties(fd, &(var_header->puback.props), var_header->puback.props_len);
-            } else {
-                var_header->puback.props_len = 0;
-                var_header->puback.props = NULL;
-            }
-            break;
+            return take_ack(cur, &var_header->puback.packet_id, &var_header->puback.reason_code,
+                            &var_header->puback.props, &var_header->puback.props_len);
         case PUBREC:
-            bytes_read += read_packet_identifier(fd, &(var_header->pubrec.packet_id));
-            bytes_read += read_uint8(fd, &(var_header->pubrec.reason_code));
-            if (fixed_header.len - bytes_read >= 4) {
-                bytes_read += read_var_int(fd, &(var_header->pubrec.props_len));
-                bytes_read += read_properties(fd, &(var_header->pubrec.props), var_header->pubrec.props_len);
-            } else {
-                var_header->pubrec.props_len = 0;
-                var_header->pubrec.props = NULL;
-            }
-            break;
+            return take_ack(cur, &var_header->pubrec.packet_id, &var_header->pubrec.reason_code,
+                            &var_header->pubrec.props, &var_header->pubrec.props_len);
         case PUBREL:
-            bytes_read += read_packet_identifier(fd, &(var_header->pubrel.packet_id));
-            bytes_read += read_uint8(fd, &(var_header->pubrel.reason_code));
-            if (fixed_header.len - bytes_read >= 4) {
-                bytes_read += read_var_int(fd, &(var_header->pubrel.props_len));
-                bytes_read += read_properties(fd, &(var_header->pubrel.props), var_header->pubrel.props_len);
-            } else {
-                var_header->pubrel.props_len = 0;
-                var_header->pubrel.props = NULL;
-            }
-            break;
+            return take_ack(cur, &var_header->pubrel.packet_id, &var_header->pubrel.reason_code,
+                            &var_header->pubrel.props, &var_header->pubrel.props_len);
         case PUBCOMP:
-            bytes_read += read_packet_identifier(fd, &(var_header->pubcomp.packet_id));
-            bytes_read += read_uint8(fd, &(var_header->pubcomp.reason_code));
-            if (fixed_header.len - bytes_read >= 4) {
-                bytes_read += read_var_int(fd, &(var_header->pubcomp.props_len));
-                bytes_read += read_properties(fd, &(var_header->pubcomp.props), var_header->pubcomp.props_len);
-            } else {
-                var_header->pubcomp.props_len = 0;
-                var_header->pubcomp.props = NULL;
-            }
-            break;
+            return take_ack(cur, &var_header->pubcomp.packet_id, &var_header->pubcomp.reason_code,
+                            &var_header->pubcomp.props, &var_header->pubcomp.props_len);
         case SUBSCRIBE:
-            bytes_read += read_packet_identifier(fd, &(var_header->subscribe.packet_id));
-            bytes_read += read_var_int(fd, &(var_header->subscribe.props_len));
-            bytes_read += read_properties(fd, &(var_header->subscribe.props), var_header->subscribe.props_len);
-            break;
+            return take_identified(cur, &var_header->subscribe.packet_id,
+                                   &var_header->subscribe.props, &var_header->subscribe.props_len);
         case SUBACK:
-            bytes_read += read_packet_identifier(fd, &(var_header->suback.packet_id));
-            bytes_read += read_var_int(fd, &(var_header->suback.props_len));
-            bytes_read += read_properties(fd, &(var_header->suback.props), var_header->suback.props_len);
-            break;
+            return take_identified(cur, &var_header->suback.packet_id,
+                                   &var_header->suback.props, &var_header->suback.props_len);
         case UNSUBSCRIBE:
-            bytes_read += read_packet_identifier(fd, &(var_header->unsubscribe.packet_id));
-            bytes_read += read_var_int(fd, &(var_header->unsubscribe.props_len));
-            bytes_read += read_properties(fd, &(var_header->unsubscribe.props), var_header->unsubscribe.props_len);
-            break;
+            return take_identified(cur, &var_header->unsubscribe.packet_id,
+                                   &var_header->unsubscribe.props, &var_header->unsubscribe.props_len);
         case UNSUBACK:
-            bytes_read += read_packet_identifier(fd, &(var_header->unsuback.packet_id));
-            bytes_read += read_var_int(fd, &(var_header->unsuback.props_len));
-            bytes_read += read_properties(fd, &(var_header->unsuback.props), var_header->unsuback.props_len);
-            break;
+            return take_identified(cur, &var_header->unsuback.packet_id,
+                                   &var_header->unsuback.props, &var_header->unsuback.props_len);
         case PINGREQ:
-            /* empty */
-            break;
         case PINGRESP:
             /* empty */
-            break;
+            return 0;
         case DISCONNECT:
-            bytes_read += read_uint8(fd, &(var_header->disconnect.reason_code));
-            if (fixed_header.len - bytes_read >= 2) {
-                bytes_read += read_var_int(fd, &(var_header->disconnect.props_len));
-                bytes_read += read_properties(fd, &(var_header->disconnect.props), var_header->disconnect.props_len);
-            } else {
-                var_header->disconnect.props_len = 0;
-                var_header->disconnect.props = NULL;
-            }
-            break;
+            /* A Remaining Length of 0 means Reason Code 0x00 (Normal disconnection) */
+            return take_optional_reason(
+                cur,
+                &var_header->disconnect.reason_code,
+                &var_header->disconnect.props,
+                &var_header->disconnect.props_len
+            );
         case AUTH:
-            bytes_read += read_uint8(fd, &(var_header->auth.reason_code));
-            bytes_read += read_var_int(fd, &(var_header->auth.props_len));
-            bytes_read += read_properties(fd, &(var_header->auth.props), var_header->auth.props_len);
-            break;
-        default:
-            /* This case should not be reached if the packet is well-formed. */
-            fprintf(stderr, "[Attempted to read invalid var header type %d]\n", fixed_header.type);
-            exit(ERROR_CLIENT);
-            break;
+            return take_optional_reason(
+                cur,
+                &var_header->auth.reason_code,
+                &var_header->auth.props,
+                &var_header->auth.props_len
+            );
     }
 
-    return bytes_read;
+    return -1;
+}
+
+ssize_t write_properties(int fd, MqttProperty **props, var_int len) {
+    put_properties(&scratch, *props, len);
+    return flush_scratch(fd);
 }
 
+ssize_t decode_var_header(const uint8_t *buf, size_t len, MqttVarHeader *var_header, MqttFixedHeader fixed_header) {
+    Cursor cur = { .data = buf, .len = len, .pos = 0 };
+    return take_var_header(&cur, var_header, fixed_header) == -1 ? -1 : (ssize_t)cur.pos;
+}
 
-ssize_t write_var_header(int fd, MqttVarHeader *var_header, MqttFixedHeader fixed_header) {
-    ssize_t bytes_written = 0;
+/* Helper function. Not in `mqtt.h` */
+static size_t put_var_header(IoBuffer *out, MqttVarHeader *var_header, MqttFixedHeader fixed_header) {
+    size_t bytes_written = 0;
 
     switch ((MqttControlType)fixed_header.type) {
         case CONNECT:
-            bytes_written += write_string(fd, &(var_header->connect.protocol_name));
-            bytes_written += write_uint8(fd, &(var_header->connect.protocol_version));
-            bytes_written += write_uint8(fd, &(var_header->connect.connect_flags));
-            bytes_written += write_var_int(fd, &(var_header->connect.props_len));
-            bytes_written += write_properties(fd, &(var_header->connect.props), var_header->connect.props_len);
+            bytes_written += put_string(out, &var_header->connect.protocol_name);
+            bytes_written += put_uint8(out, var_header->connect.protocol_version);
+            bytes_written += put_uint8(out, var_header->connect.connect_flags);
+            bytes_written += put_property_block(out, var_header->connect.props, var_header->connect.props_len);
             break;
         case CONNACK:
-            bytes_written += write_uint8(fd, &(var_header->connack.ack_flags));
-            bytes_written += write_uint8(fd, &(var_header->connack.reason_code));
-            bytes_written += write_var_int(fd, &(var_header->connack.props_len));
-            bytes_written += write_properties(fd, &(var_header->connack.props), var_header->connack.props_len);
+            bytes_written += put_uint8(out, var_header->connack.ack_flags);
+            bytes_written += put_uint8(out, var_header->connack.reason_code);
+            bytes_written += put_property_block(out, var_header->connack.props, var_header->connack.props_len);
             break;
         case PUBLISH:
-            bytes_written += write_string(fd, &(var_header->publish.topic_name));
+            bytes_written += put_string(out, &var_header->publish.topic_name);
             /* note: 0x6 = 0b0110 */
             if ((fixed_header.flags & 0x6) > 0) {
-                bytes_written += write_packet_identifier(fd, &(var_header->publish.packet_id));
+                bytes_written += put_uint16(out, var_header->publish.packet_id);
             }
-            bytes_written += write_var_int(fd, &(var_header->publish.props_len));
-            bytes_written += write_properties(fd, &(var_header->publish.props), var_header->publish.props_len);
+            bytes_written += put_property_block(out, var_header->publish.props, var_header->publish.props_len);
             break;
         case PUBACK:
-            bytes_written += write_packet_identifier(fd, &(var_header->puback.packet_id));
-            bytes_written += write_uint8(fd, &(var_header->puback.reason_code));
+            bytes_written += put_uint16(out, var_header->puback.packet_id);
+            bytes_written += put_uint8(out, var_header->puback.reason_code);
             if (var_header->puback.props_len > 0) {
-                bytes_written += write_var_int(fd, &(var_header->puback.props_len));
-                bytes_written += write_properties(fd, &(var_header->puback.props), var_header->puback.props_len);
+                bytes_written += put_property_block(out, var_header->puback.props, var_header->puback.props_len);
             }
             break;
         case PUBREC:
-            bytes_written += write_packet_identifier(fd, &(var_header->pubrec.packet_id));
-            bytes_written += write_uint8(fd, &(var_header->pubrec.reason_code));
+            bytes_written += put_uint16(out, var_header->pubrec.packet_id);
+            bytes_written += put_uint8(out, var_header->pubrec.reason_code);
             if (var_header->pubrec.props_len > 0) {
-                bytes_written += write_var_int(fd, &(var_header->pubrec.props_len));
-                bytes_written += write_properties(fd, &(var_header->pubrec.props), var_header->pubrec.props_len);
+                bytes_written += put_property_block(out, var_header->pubrec.props, var_header->pubrec.props_len);
             }
             break;
         case PUBREL:
-            bytes_written += write_packet_identifier(fd, &(var_header->pubrel.packet_id));
-            bytes_written += write_uint8(fd, &(var_header->pubrel.reason_code));
+            bytes_written += put_uint16(out, var_header->pubrel.packet_id);
+            bytes_written += put_uint8(out, var_header->pubrel.reason_code);
             if (var_header->pubrel.props_len > 0) {
-                bytes_written += write_var_int(fd, &(var_header->pubrel.props_len));
-                bytes_written += write_properties(fd, &(var_header->pubrel.props), var_header->pubrel.props_len);
+                bytes_written += put_property_block(out, var_header->pubrel.props, var_header->pubrel.props_len);
             }
             break;
         case PUBCOMP:
-            bytes_written += write_packet_identifier(fd, &(var_header->pubcomp.packet_id));
-            bytes_written += write_uint8(fd, &(var_header->pubcomp.reason_code));
+            bytes_written += put_uint16(out, var_header->pubcomp.packet_id);
+            bytes_written += put_uint8(out, var_header->pubcomp.reason_code);
             if (var_header->pubcomp.props_len > 0) {
-                bytes_written += write_var_int(fd, &(var_header->pubcomp.props_len));
-                bytes_written += write_properties(fd, &(var_header->pubcomp.props), var_header->pubcomp.props_len);
+                bytes_written += put_property_block(out, var_header->pubcomp.props, var_header->pubcomp.props_len);
             }
             break;
         case SUBSCRIBE:
-            bytes_written += write_packet_identifier(fd, &(var_header->subscribe.packet_id));
-            bytes_written += write_var_int(fd, &(var_header->subscribe.props_len));
-            bytes_written += write_properties(fd, &(var_header->subscribe.props), var_header->subscribe.props_len);
+            bytes_written += put_uint16(out, var_header->subscribe.packet_id);
+            bytes_written += put_property_block(out, var_header->subscribe.props, var_header->subscribe.props_len);
             break;
         case SUBACK:
-            bytes_written += write_packet_identifier(fd, &(var_header->suback.packet_id));
-            bytes_written += write_var_int(fd, &(var_header->suback.props_len));
-            bytes_written += write_properties(fd, &(var_header->suback.props), var_header->suback.props_len);
+            bytes_written += put_uint16(out, var_header->suback.packet_id);
+            bytes_written += put_property_block(out, var_header->suback.props, var_header->suback.props_len);
             break;
         case UNSUBSCRIBE:
-            bytes_written += write_packet_identifier(fd, &(var_header->unsubscribe.packet_id));
-            bytes_written += write_var_int(fd, &(var_header->unsubscribe.props_len));
-            bytes_written += write_properties(fd, &(var_header->unsubscribe.props), var_header->unsubscribe.props_len);
+            bytes_written += put_uint16(out, var_header->unsubscribe.packet_id);
+            bytes_written += put_property_block(out, var_header->unsubscribe.props, var_header->unsubscribe.props_len);
             break;
         case UNSUBACK:
-            bytes_written += write_packet_identifier(fd, &(var_header->unsuback.packet_id));
-            bytes_written += write_var_int(fd, &(var_header->unsuback.props_len));
-            bytes_written += write_properties(fd, &(var_header->unsuback.props), var_header->unsuback.props_len);
+            bytes_written += put_uint16(out, var_header->unsuback.packet_id);
+            bytes_written += put_property_block(out, var_header->unsuback.props, var_header->unsuback.props_len);
             break;
         case PINGREQ:
             /* empty */
@@ -500,16 +724,14 @@ ssize_t write_var_header(int fd, MqttVarHeader *var_header, MqttFixedHeader fixe
             /* empty */
             break;
         case DISCONNECT:
-            bytes_written += write_uint8(fd, &(var_header->disconnect.reason_code));
+            bytes_written += put_uint8(out, var_header->disconnect.reason_code);
             if (var_header->disconnect.props_len > 0) {
-                bytes_written += write_var_int(fd, &(var_header->disconnect.props_len));
-                bytes_written += write_properties(fd, &(var_header->disconnect.props), var_header->disconnect.props_len);
+                bytes_written += put_property_block(out, var_header->disconnect.props, var_header->disconnect.props_len);
             }
             break;
         case AUTH:
-            bytes_written += write_uint8(fd, &(var_header->auth.reason_code));
-            bytes_written += write_var_int(fd, &(var_header->auth.props_len));
-            bytes_written += write_properties(fd, &(var_header->auth.props), var_header->auth.props_len);
+            bytes_written += put_uint8(out, var_header->auth.reason_code);
+            bytes_written += put_property_block(out, var_header->auth.props, var_header->auth.props_len);
             break;
         default:
             /* This case should not be reached if the packet is well-formed. */
@@ -521,6 +743,11 @@ ssize_t write_var_header(int fd, MqttVarHeader *var_header, MqttFixedHeader fixe
     return bytes_written;
 }
 
+ssize_t write_var_header(int fd, MqttVarHeader *var_header, MqttFixedHeader fixed_header) {
+    put_var_header(&scratch, var_header, fixed_header);
+    return flush_scratch(fd);
+}
+
 void destroy_var_header(MqttVarHeader var_header, MqttFixedHeader fixed_header) {
     switch ((MqttControlType)fixed_header.type) {
         case CONNECT:
@@ -573,62 +800,76 @@ void destroy_var_header(MqttVarHeader var_header, MqttFixedHeader fixed_header)
     }
 }
 
-ssize_t read_payload(int fd, MqttPayload *payload, MqttFixedHeader fixed_header) {
-    ssize_t bytes_read = 0;
-
-    /* kind of a hack... */
-    ssize_t byte_len = payload->other.len;
+/* Helper function. Not in `mqtt.h`
+ * The payload is whatever is left of the body after the variable header. */
+static int take_payload(Cursor *cur, MqttPayload *payload, MqttFixedHeader fixed_header) {
     switch (fixed_header.type) {
         case SUBSCRIBE:
             payload->subscribe.topic_amount = 0;
             payload->subscribe.topics = NULL;
-            
-            while (bytes_read < byte_len) {
-                payload->subscribe.topic_amount++;
+
+            while (cur->pos < cur->len) {
+                struct StringWithOptions topic;
+                if (take_string(cur, &topic.str) == -1) {
+                    return -1;
+                }
+                if (take_uint8(cur, &topic.options) == -1) {
+                    destroy_string(topic.str);
+                    return -1;
+                }
+
                 payload->subscribe.topics = (struct StringWithOptions*)realloc(
                     payload->subscribe.topics,
-                    payload->subscribe.topic_amount * sizeof(struct StringWithOptions)
+                    (payload->subscribe.topic_amount + 1) * sizeof(struct StringWithOptions)
                 );
                 if (!payload->subscribe.topics) {
                     perror("[Couldn't reallocate memory for topics]\n");
                     exit(ERROR_SERVER);
                 }
-
-                size_t i = payload->subscribe.topic_amount - 1;
-                bytes_read += read_string(fd, &(payload->subscribe.topics[i].str));
-                bytes_read += read_uint8(fd, &(payload->subscribe.topics[i].options));
+                payload->subscribe.topics[payload->subscribe.topic_amount++] = topic;
             }
-            break;
+            return 0;
         case UNSUBSCRIBE:
             payload->unsubscribe.topic_amount = 0;
             payload->unsubscribe.topics = NULL;
 
-            while (bytes_read < byte_len) {
-                payload->unsubscribe.topic_amount++;
+            while (cur->pos < cur->len) {
+                String topic;
+                if (take_string(cur, &topic) == -1) {
+                    return -1;
+                }
+
                 payload->unsubscribe.topics = (String*)realloc(
                     payload->unsubscribe.topics,
-                    payload->unsubscribe.topic_amount * sizeof(String)
+                    (payload->unsubscribe.topic_amount + 1) * sizeof(String)
                 );
                 if (!payload->unsubscribe.topics) {
                     perror("[Couldn't reallocate memory for topics]\n");
                     exit(ERROR_SERVER);
                 }
-
-                size_t i = payload->unsubscribe.topic_amount - 1;
-                bytes_read += read_string(fd, &(payload->unsubscribe.topics[i]));
+                payload->unsubscribe.topics[payload->unsubscribe.topic_amount++] = topic;
             }
-            break;
+            return 0;
         default:
-            payload->other.content = (uint8_t*)malloc(byte_len * sizeof(uint8_t));
-            bytes_read += read_many(fd, payload->other.content, byte_len);
+            payload->other.len = cur->len - cur->pos;
+            payload->other.content = (uint8_t*)malloc(payload->other.len + 1);
+            if (!payload->other.content) {
+                fprintf(stderr, "[Memory error, stopping]\n");
+                exit(ERROR_SERVER);
+            }
+            return take_bytes(cur, payload->other.content, payload->other.len);
     }
-
-    return bytes_read;
 }
 
-ssize_t write_payload(int fd, MqttPayload *payload, MqttFixedHeader fixed_header) {
-    ssize_t bytes_written = 0;
+/* The payload takes all of `len` */
+ssize_t decode_payload(const uint8_t *buf, size_t len, MqttPayload *payload, MqttFixedHeader fixed_header) {
+    Cursor cur = { .data = buf, .len = len, .pos = 0 };
+    return take_payload(&cur, payload, fixed_header) == -1 ? -1 : (ssize_t)cur.pos;
+}
 
+/* Helper function. Not in `mqtt.h`
+ * Payloads that can be written are sent as they are, without copying. */
+static struct iovec payload_bytes(MqttPayload *payload, MqttFixedHeader fixed_header) {
     switch (fixed_header.type) {
         case SUBSCRIBE:
             fprintf(stderr, "[Writing SUBSCRIBE payloads not implemented.]\n");
@@ -639,12 +880,19 @@ ssize_t write_payload(int fd, MqttPayload *payload, MqttFixedHeader fixed_header
             exit(ERROR_SERVER);
             break;
         default:
-            if (payload->other.len > 0) {
-                bytes_written += write_many(fd, payload->other.content, payload->other.len);
-            }
+            break;
     }
 
-    return bytes_written;
+    struct iovec bytes = { .iov_base = payload->other.content, .iov_len = payload->other.len };
+    return bytes;
+}
+
+ssize_t write_payload(int fd, MqttPayload *payload, MqttFixedHeader fixed_header) {
+    struct iovec bytes = payload_bytes(payload, fixed_header);
+    if (bytes.iov_len == 0) {
+        return 0;
+    }
+    return write_many(fd, (uint8_t*)bytes.iov_base, bytes.iov_len);
 }
 
 void destroy_payload(MqttPayload payload, MqttFixedHeader fixed_header) {
@@ -666,81 +914,352 @@ void destroy_payload(MqttPayload payload, MqttFixedHeader fixed_header) {
     }
 }
 
-ssize_t read_control_packet(int fd, MqttControlPacket *packet) {
-    ssize_t bytes_read = 0;
+/* Helper function. Not in `mqtt.h`
+ * Whether the flags are the ones required for the packet type */
+static int valid_flags(MqttFixedHeader header) {
+    switch ((MqttControlType)header.type) {
+        case PUBLISH:
+            /* QoS 3 doesn't exist */
+            return ((header.flags >> 1) & 0x3) != 0x3;
+        case PUBREL:
+            return header.flags == MQTT_FLG_PUBREL;
+        case SUBSCRIBE:
+            return header.flags == MQTT_FLG_SUBSCRIBE;
+        case UNSUBSCRIBE:
+            return header.flags == MQTT_FLG_UNSUBSCRIBE;
+        default:
+            return header.flags == 0;
+    }
+}
 
-    // === MQTT Control Packet Fixed Header
+/* Helper function. Not in `mqtt.h`
+ * Decodes a whole body. On failure, everything allocated so far is freed. */
+static int decode_body(const uint8_t *body, MqttFixedHeader header, MqttControlPacket *packet) {
+    Cursor cur = { .data = body, .len = header.len, .pos = 0 };
 
-    MqttFixedHeader header = { 0 };
-    uint8_t byte;
-    bytes_read += read_uint8(fd, &byte);
-    header.flags = byte & 0x0F;
-    header.type  = byte >> 4;
-    bytes_read += read_var_int(fd, &header.len);
+    memset(packet, 0, sizeof(MqttControlPacket));
+    packet->fixed_header = header;
 
-    // === MQTT Control Packet Variable Header
+    if (take_var_header(&cur, &packet->var_header, header) == -1 ||
+        take_payload(&cur, &packet->payload, header) == -1) {
+        destroy_control_packet(*packet);
+        memset(packet, 0, sizeof(MqttControlPacket));
+        return -1;
+    }
+    return 0;
+}
 
-    MqttVarHeader var_header = { 0 };
-    ssize_t remaining_read = 0;
-    remaining_read += read_var_header(fd, &var_header, header);
-    bytes_read += remaining_read;
+/* Helper function. Not in `mqtt.h`
+ * Size of the fixed header at `buf`, 0 if it isn't complete, -1 if invalid */
+static ssize_t decode_fixed_header(const uint8_t *buf, size_t len, MqttFixedHeader *header) {
+    if (len < 1) {
+        return 0;
+    }
 
-    // === MQTT Control Packet Payload
+    header->flags = buf[0] & 0x0F;
+    header->type  = buf[0] >> 4;
+    /* type 0 is reserved */
+    if (header->type == 0 || !valid_flags(*header)) {
+        return -1;
+    }
+
+    /* a Remaining Length has up to 4 bytes */
+    size_t end = 1;
+    while (end < len && end < 5 && (buf[end] & 128) != 0) {
+        end++;
+    }
+    if (end == 5) {
+        return -1;
+    }
+    if (end == len) {
+        return 0;
+    }
 
-    MqttPayload payload = { 0 };
-    /* This is kind of a hack. It would be better not to do this. */
-    payload.other.len = (ssize_t)header.len - remaining_read;
+    decode_var_int(buf + 1, end, &header->len);
+    return end + 1;
+}
 
-    bytes_read += read_payload(fd, &payload, header);
+ssize_t decode_control_packet(const uint8_t *buf, size_t len, MqttControlPacket *packet) {
+    MqttFixedHeader header = { 0 };
+    ssize_t header_size = decode_fixed_header(buf, len, &header);
+    if (header_size <= 0) {
+        return header_size;
+    }
 
-    packet->fixed_header = header;
-    packet->var_header = var_header;
-    packet->payload = payload;
+    size_t total = (size_t)header_size + header.len;
+    if (len < total) {
+        return 0;
+    }
+    if (decode_body(buf + header_size, header, packet) == -1) {
+        return -1;
+    }
+    return total;
+}
+
+ssize_t read_control_packet(int fd, MqttControlPacket *packet) {
+    /* Fixed header first, it tells how much is left to read */
+    uint8_t header[5];
+    size_t header_size = 0;
+    do {
+        if (header_size == sizeof(header)) {
+            fprintf(stderr, "[Read invalid Variable Byte Integer]\n");
+            exit(ERROR_INVALID_INP);
+        }
+        read_uint8(fd, &header[header_size]);
+        header_size++;
+    } while (header_size < 2 || (header[header_size - 1] & 128) != 0);
+
+    uint32_t remaining_length;
+    decode_var_int(header + 1, header_size - 1, &remaining_length);
+
+    uint8_t *frame = (uint8_t*)malloc(header_size + remaining_length);
+    if (!frame) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+    memcpy(frame, header, header_size);
+    if (remaining_length > 0) {
+        read_many(fd, frame + header_size, remaining_length);
+    }
 
+    ssize_t bytes_read = decode_control_packet(frame, header_size + remaining_length, packet);
+    free(frame);
+    if (bytes_read <= 0) {
+        fprintf(stderr, "[Read invalid control packet]\n");
+        exit(ERROR_INVALID_INP);
+    }
     return bytes_read;
 }
 
+/* === Incremental decoding === */
+
+/* First size of a decoder's body buffer, doubled as bytes arrive */
+#define DECODER_MIN_CAP 256
+/* Largest body buffer kept for the next packets of a connection. One left
+ * by a bigger packet is freed once that packet is decoded. */
+#define DECODER_KEEP_CAP (64 * 1024)
+
+void mqtt_decoder_init(MqttDecoder *decoder) {
+    memset(decoder, 0, sizeof(MqttDecoder));
+    decoder->state = DECODER_TYPE;
+}
+
+void mqtt_decoder_free(MqttDecoder *decoder) {
+    free(decoder->body);
+    mqtt_decoder_init(decoder);
+}
+
+MqttDecodeStatus mqtt_decoder_feed(MqttDecoder *decoder, const uint8_t *data, size_t len,
+                                   size_t *consumed, MqttControlPacket *packet) {
+    size_t pos = 0;
+    *consumed = 0;
+
+    /* Usual case: a whole packet at the start of the bytes */
+    if (decoder->state == DECODER_TYPE) {
+        ssize_t used = decode_control_packet(data, len, packet);
+        if (used < 0) {
+            return MQTT_DECODE_ERROR;
+        }
+        if (used > 0) {
+            *consumed = used;
+            return MQTT_DECODE_COMPLETE;
+        }
+    }
+
+    while (pos < len) {
+        switch (decoder->state) {
+            case DECODER_TYPE:
+                decoder->header.flags = data[pos] & 0x0F;
+                decoder->header.type  = data[pos] >> 4;
+                decoder->header.len = 0;
+                decoder->multiplier = 1;
+                pos++;
+
+                /* type 0 is reserved */
+                if (decoder->header.type == 0 || !valid_flags(decoder->header)) {
+                    *consumed = pos;
+                    return MQTT_DECODE_ERROR;
+                }
+                decoder->state = DECODER_LENGTH;
+                break;
+
+            case DECODER_LENGTH: {
+                uint8_t byte = data[pos++];
+                decoder->header.len += (byte & 127) * decoder->multiplier;
+                if ((byte & 128) == 0) {
+                    if (decoder->header.len > MQTT_MAX_PACKET_SIZE) {
+                        *consumed = pos;
+                        return MQTT_DECODE_ERROR;
+                    }
+                    decoder->received = 0;
+                    decoder->state = DECODER_BODY;
+                    break;
+                }
+                if (decoder->multiplier > 128 * 128) {
+                    /* more than 4 bytes, invalid Variable Byte Integer */
+                    *consumed = pos;
+                    return MQTT_DECODE_ERROR;
+                }
+                decoder->multiplier *= 128;
+                break;
+            }
+
+            case DECODER_BODY:
+                /* handled below */
+                break;
+        }
+
+        if (decoder->state != DECODER_BODY) {
+            continue;
+        }
+
+        size_t body_len = decoder->header.len;
+        size_t available = len - pos;
+        MqttDecodeStatus status;
+
+        if (decoder->received == 0 && available >= body_len) {
+            /* the whole body is at hand, decode it in place */
+            status = decode_body(data + pos, decoder->header, packet) == -1
+                ? MQTT_DECODE_ERROR : MQTT_DECODE_COMPLETE;
+            pos += body_len;
+        } else {
+            /* keep what arrived until the rest comes */
+            size_t missing = body_len - decoder->received;
+            size_t take = available < missing ? available : missing;
+
+            /* The buffer grows with the bytes that actually arrived. The
+             * Remaining Length costs nothing to send, so it isn't trusted. */
+            size_t needed = decoder->received + take;
+            if (decoder->body_cap < needed) {
+                size_t new_cap = decoder->body_cap ? decoder->body_cap : DECODER_MIN_CAP;
+                while (new_cap < needed) { new_cap *= 2; }
+                if (new_cap > body_len) {
+                    new_cap = body_len;
+                }
+
+                uint8_t *body = (uint8_t*)realloc(decoder->body, new_cap);
+                if (!body) {
+                    *consumed = pos;
+                    return MQTT_DECODE_NO_MEMORY;
+                }
+                decoder->body = body;
+                decoder->body_cap = new_cap;
+            }
+
+            memcpy(decoder->body + decoder->received, data + pos, take);
+            decoder->received += take;
+            pos += take;
+
+            if (decoder->received < body_len) {
+                *consumed = pos;
+                return MQTT_DECODE_NEED_MORE;
+            }
+            status = decode_body(decoder->body, decoder->header, packet) == -1
+                ? MQTT_DECODE_ERROR : MQTT_DECODE_COMPLETE;
+
+            if (decoder->body_cap > DECODER_KEEP_CAP) {
+                free(decoder->body);
+                decoder->body = NULL;
+                decoder->body_cap = 0;
+            }
+        }
+
+        decoder->state = DECODER_TYPE;
+        *consumed = pos;
+        return status;
+    }
+
+    /* packets without a body end with their length */
+    if (decoder->state == DECODER_BODY && decoder->header.len == 0) {
+        decoder->state = DECODER_TYPE;
+        *consumed = pos;
+        return decode_body(NULL, decoder->header, packet) == -1
+            ? MQTT_DECODE_ERROR : MQTT_DECODE_COMPLETE;
+    }
+
+    *consumed = pos;
+    return MQTT_DECODE_NEED_MORE;
+}
+
 void update_remaining_length(MqttControlPacket *packet) {
-    ssize_t remaining_length = 0;
-    
-    // We'll use a pipe as a temporary, in-memory buffer to "write" the
-    // variable header and payload to, just so we can measure their total size.
-    int pipe_fds[2];
-    if (pipe(pipe_fds) == -1) {
-        perror("[Pipe creation for length calculation failed]\n");
+    /* a counting pass of the same encoder that writes the packet */
+    size_t remaining_length = put_var_header(NULL, &packet->var_header, packet->fixed_header);
+    remaining_length += payload_bytes(&packet->payload, packet->fixed_header).iov_len;
+
+    packet->fixed_header.len = remaining_length;
+}
+
+/* Helper function. Not in `mqtt.h`
+ * Appends the fixed and variable headers of a packet whose Remaining Length
+ * is already known. */
+static size_t put_headers(IoBuffer *out, MqttControlPacket *packet) {
+    uint8_t first_byte = (packet->fixed_header.type << 4) | (packet->fixed_header.flags & 0x0F);
+    return put_uint8(out, first_byte)
+         + put_var_int(out, packet->fixed_header.len)
+         + put_var_header(out, &packet->var_header, packet->fixed_header);
+}
+
+Frame *frame_new(size_t len) {
+    Frame *frame = (Frame*)malloc(sizeof(Frame) + len);
+    if (!frame) {
+        fprintf(stderr, "[Memory error, stopping]\n");
         exit(ERROR_SERVER);
     }
+    atomic_init(&frame->refs, 1);
+    frame->len = len;
+    return frame;
+}
 
-    // Write the variable header to the write-end of the pipe.
-    remaining_length += write_var_header(pipe_fds[1], &packet->var_header, packet->fixed_header);
-    remaining_length += write_payload(pipe_fds[1], &packet->payload, packet->fixed_header);
+Frame *frame_encode(MqttControlPacket *packet) {
+    update_remaining_length(packet);
+    struct iovec payload = payload_bytes(&packet->payload, packet->fixed_header);
+
+    /* A counting pass sizes the frame, so encoding never reallocates it */
+    Frame *frame = frame_new(put_headers(NULL, packet) + payload.iov_len);
+    IoBuffer out = { .data = frame->data, .start = 0, .end = 0, .cap = frame->len };
+    put_headers(&out, packet);
+    put_bytes(&out, payload.iov_base, payload.iov_len);
+    return frame;
+}
 
-    // Close both ends of the pipe as we are done with them.
-    close(pipe_fds[0]);
-    close(pipe_fds[1]);
-    
-    packet->fixed_header.len = remaining_length;
+Frame *frame_from_bytes(const uint8_t *data, size_t len) {
+    Frame *frame = frame_new(len);
+    memcpy(frame->data, data, len);
+    return frame;
 }
 
-ssize_t write_control_packet(int fd, MqttControlPacket *packet) {
-    ssize_t total_bytes_written = 0;
+void frame_hold(Frame *frame) {
+    atomic_fetch_add_explicit(&frame->refs, 1, memory_order_relaxed);
+}
+
+void frame_release(Frame *frame) {
+    if (atomic_fetch_sub_explicit(&frame->refs, 1, memory_order_acq_rel) == 1) {
+        free(frame);
+    }
+}
 
+ssize_t write_control_packet(int fd, MqttControlPacket *packet) {
     // Fix the Remaining Length
     update_remaining_length(packet);
 
-    // === Fixed Header
+    // === Fixed and Variable Headers
 
-    uint8_t first_byte = (packet->fixed_header.type << 4) | (packet->fixed_header.flags & 0x0F);
-    total_bytes_written += write_uint8(fd, &first_byte);
-    total_bytes_written += write_var_int(fd, &packet->fixed_header.len);
+    put_headers(&scratch, packet);
 
-    // === Variable Header
+    // === Payload
 
-    total_bytes_written += write_var_header(fd, &packet->var_header, packet->fixed_header);
+    /* Headers go from `scratch` and the payload from where it already is,
+     * all in one writev */
+    struct iovec parts[2];
+    parts[0].iov_base = scratch.data + scratch.start;
+    parts[0].iov_len = scratch.end - scratch.start;
+    parts[1] = payload_bytes(&packet->payload, packet->fixed_header);
 
-    // === Payload
+    ssize_t total_bytes_written = writev_many(fd, parts, 2);
+    io_buffer_consume(&scratch, scratch.end - scratch.start);
 
-    total_bytes_written += write_payload(fd, &packet->payload, packet->fixed_header);
+    /* Hand the whole packet over at once if the fd is being staged */
+    io_flush(fd);
 
     return total_bytes_written;
 }
@@ -821,14 +1340,15 @@ MqttControlPacket create_suback(MqttControlPacket subscribe) {
     }};
 
     /* Payload contains a Reason Code for each topic.
-     * Send 0x0 (Granted QoS 0) to all.
+     * Send 0x0 (Granted QoS 0) to all valid filters.
      */
     size_t content_len = sizeof(uint8_t) * subscribe.payload.subscribe.topic_amount;
     uint8_t *content = (uint8_t*)malloc(content_len);
 
     for (size_t i = 0; i < content_len; i++) {
-        /* Granted QoS 0 */
-        content[i] = 0x0;
+        String filter = subscribe.payload.subscribe.topics[i].str;
+        content[i] = topic_filter_valid(filter.val, filter.len)
+            ? MQTT_RC_GRANTED_QOS_0 : MQTT_RC_TOPIC_FILTER_INVALID;
     }
 
     MqttPayload payload = { .other = {
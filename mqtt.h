@@ -7,8 +7,10 @@
 #include <sys/types.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdatomic.h>
 
 #include "errors.h"
+#include "io.h"
 
 /* === MQTT Control Packet types === */
 typedef enum MqttControlType {
@@ -52,6 +54,13 @@ typedef struct MqttFlgPublish {
 #define MQTT_FLG_DISCONNECT  0x0
 #define MQTT_FLG_AUTH        0x0
 
+/* === SUBACK reason codes === */
+#define MQTT_RC_GRANTED_QOS_0          0x00
+#define MQTT_RC_UNSPECIFIED_ERROR      0x80
+#define MQTT_RC_TOPIC_FILTER_INVALID   0x8F
+#define MQTT_RC_SHARED_UNSUPPORTED     0x9E
+#define MQTT_RC_WILDCARDS_UNSUPPORTED  0xA2
+
 typedef enum MqttPropType {
     BYTE      = 0,
     TWO_BYTE  = 1,
@@ -60,6 +69,7 @@ typedef enum MqttPropType {
     BIN_DATA  = 4,
     STR       = 5,
     STR_PAIR  = 6,
+    INVALID_PROP = -1,
 } MqttPropType;
 
 /* === Data structs === */
@@ -271,40 +281,113 @@ typedef struct MqttControlPacket {
     MqttPayload payload;
 } MqttControlPacket;
 
+/* === Incremental decoding === */
+
+/* Largest Remaining Length accepted from a client. A bigger packet is a
+ * protocol error, found before any of its body is kept. */
+#define MQTT_MAX_PACKET_SIZE (64 * 1024 * 1024)
+
+typedef enum MqttDecodeStatus {
+    MQTT_DECODE_NEED_MORE = 0,
+    MQTT_DECODE_COMPLETE  = 1,
+    MQTT_DECODE_ERROR     = -1,
+    MQTT_DECODE_NO_MEMORY = -2,
+} MqttDecodeStatus;
+
+typedef enum MqttDecoderState {
+    DECODER_TYPE,
+    DECODER_LENGTH,
+    DECODER_BODY,
+} MqttDecoderState;
+
+/* Decoding progress of one connection. Bytes are fed as they arrive, in
+ * chunks of any size; a packet split across TCP segments is resumed where
+ * it stopped. Bodies are only copied when they arrive in pieces, into
+ * `body`, which grows with the bytes received so far. */
+typedef struct MqttDecoder {
+    MqttDecoderState state;
+    MqttFixedHeader header;
+    uint32_t multiplier;
+    uint8_t *body;
+    size_t received;
+    size_t body_cap;
+} MqttDecoder;
+
+/* An encoded packet, never changed once built. A PUBLISH is encoded once and
+ * the same frame is queued to every subscriber, each queue holding a
+ * reference; the last one released frees it. */
+typedef struct Frame {
+    _Atomic size_t refs;
+    size_t len;
+    uint8_t data[];
+} Frame;
+
 /* === Function declarations === */
+
+/* `decode_*` functions take bytes already in memory and return how many of
+ * them were consumed, or -1 if they end too early or are invalid. They never
+ * exit. `read_*` functions get the same bytes from a file descriptor, and
+ * exit on failure. */
+ssize_t decode_var_int(const uint8_t *buf, size_t len, uint32_t *val);
 ssize_t read_var_int(int fd, uint32_t *val);
 ssize_t write_var_int(int fd, uint32_t *val);
 
+ssize_t decode_binary_data(const uint8_t *buf, size_t len, BinaryData *data);
 ssize_t read_binary_data(int fd, BinaryData *data);
 ssize_t write_binary_data(int fd, BinaryData *data);
 void destroy_binary_data(BinaryData data);
 
+ssize_t decode_string(const uint8_t *buf, size_t len, String *str);
 ssize_t read_string(int fd, String *str);
 ssize_t write_string(int fd, String *str);
 void destroy_string(String str);
 
+ssize_t decode_string_pair(const uint8_t *buf, size_t len, StringPair *pair);
 ssize_t read_string_pair(int fd, StringPair *pair);
 ssize_t write_string_pair(int fd, StringPair *pair);
 void destroy_string_pair(StringPair pair);
 
+ssize_t decode_packet_identifier(const uint8_t *buf, size_t len, PacketID *id);
 ssize_t read_packet_identifier(int fd, PacketID *id);
 ssize_t write_packet_identifier(int fd, PacketID *id);
 
 MqttPropType prop_id_to_type(uint16_t id);
-ssize_t read_properties(int fd, MqttProperty **props, var_int len);
+/* Reads the Property Length and the properties. `props_len` gets the amount
+ * of properties, not their size. */
+ssize_t decode_properties(const uint8_t *buf, size_t len, MqttProperty **props, var_int *props_len);
 ssize_t write_properties(int fd, MqttProperty **props, var_int len);
 void destroy_properties(MqttProperty *props, var_int len);
 
-ssize_t read_var_header(int fd, MqttVarHeader *var_header, MqttFixedHeader fixed_header);
+ssize_t decode_var_header(const uint8_t *buf, size_t len, MqttVarHeader *var_header, MqttFixedHeader fixed_header);
 ssize_t write_var_header(int fd, MqttVarHeader *var_header, MqttFixedHeader fixed_header);
 void destroy_var_header(MqttVarHeader var_header, MqttFixedHeader fixed_header);
 
-ssize_t read_payload(int fd, MqttPayload *payload, MqttFixedHeader fixed_header);
+ssize_t decode_payload(const uint8_t *buf, size_t len, MqttPayload *payload, MqttFixedHeader fixed_header);
 ssize_t write_payload(int fd, MqttPayload *payload, MqttFixedHeader fixed_header);
 void destroy_payload(MqttPayload payload, MqttFixedHeader fixed_header);
 
+/* Decodes the packet at the start of `buf`. Returns its full size, 0 if it
+ * isn't complete yet, or -1 if it's malformed. */
+ssize_t decode_control_packet(const uint8_t *buf, size_t len, MqttControlPacket *packet);
 ssize_t read_control_packet(int fd, MqttControlPacket *packet);
+void mqtt_decoder_init(MqttDecoder *decoder);
+void mqtt_decoder_free(MqttDecoder *decoder);
+/* Decodes from `data` until a packet is complete or the bytes run out, and
+ * tells in `consumed` how many were used. `packet` is only filled when the
+ * result is MQTT_DECODE_COMPLETE. After MQTT_DECODE_ERROR, or
+ * MQTT_DECODE_NO_MEMORY if the body couldn't be kept, the connection should
+ * be dropped. Never exits. */
+MqttDecodeStatus mqtt_decoder_feed(MqttDecoder *decoder, const uint8_t *data, size_t len,
+                                   size_t *consumed, MqttControlPacket *packet);
 void update_remaining_length(MqttControlPacket *packet);
+/* Encodes `packet` into a new Frame, holding a single reference */
+Frame *frame_encode(MqttControlPacket *packet);
+/* A frame of `len` bytes for the caller to fill, before sharing it */
+Frame *frame_new(size_t len);
+Frame *frame_from_bytes(const uint8_t *data, size_t len);
+void frame_hold(Frame *frame);
+/* The last release frees the frame */
+void frame_release(Frame *frame);
 ssize_t write_control_packet(int fd, MqttControlPacket *packet);
 void destroy_control_packet(MqttControlPacket packet);
 
@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "errors.h"
+#include "queue.h"
+
+/* Emptied queues kept by this thread for its next connections, which skips
+ * clearing their slots again */
+#define FRAME_QUEUE_CACHE 64
+static __thread FrameQueue *cached[FRAME_QUEUE_CACHE];
+static __thread size_t cached_count = 0;
+
+FrameQueue *frame_queue_new(void) {
+    if (cached_count > 0) {
+        return cached[--cached_count];
+    }
+
+    size_t size = sizeof(FrameQueue) + FRAME_QUEUE_SLOTS * sizeof(Frame*);
+    FrameQueue *queue = (FrameQueue*)aligned_alloc(64, size);
+    if (!queue) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->head, 0);
+    for (size_t i = 0; i < FRAME_QUEUE_SLOTS; i++) {
+        atomic_init(&queue->slots[i], NULL);
+    }
+    return queue;
+}
+
+void frame_queue_free(FrameQueue *queue) {
+    Frame *frame;
+    while ((frame = frame_queue_peek(queue)) != NULL) {
+        frame_queue_pop(queue);
+        frame_release(frame);
+    }
+    /* no producer is left, so every slot is empty */
+    if (cached_count < FRAME_QUEUE_CACHE) {
+        cached[cached_count++] = queue;
+        return;
+    }
+    free(queue);
+}
+
+int frame_queue_push(FrameQueue *queue, Frame *frame) {
+    uint64_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    do {
+        /* the consumer empties a slot before moving past it */
+        uint64_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+        if (tail - head >= FRAME_QUEUE_SLOTS) {
+            return 0;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(
+        &queue->tail, &tail, tail + 1, memory_order_relaxed, memory_order_relaxed
+    ));
+
+    /* Sequentially consistent, like `frame_queue_peek`: a consumer about to
+     * stop waiting either sees the frame or is seen stopping, see
+     * `connection_send_frame` */
+    atomic_store(&queue->slots[tail & (FRAME_QUEUE_SLOTS - 1)], frame);
+    return 1;
+}
+
+Frame *frame_queue_peek(FrameQueue *queue) {
+    uint64_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    return atomic_load(&queue->slots[head & (FRAME_QUEUE_SLOTS - 1)]);
+}
+
+Frame *frame_queue_peek_at(FrameQueue *queue, size_t index) {
+    if (index >= FRAME_QUEUE_SLOTS) {
+        return NULL;
+    }
+    uint64_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    return atomic_load_explicit(&queue->slots[(head + index) & (FRAME_QUEUE_SLOTS - 1)],
+                                memory_order_acquire);
+}
+
+void frame_queue_pop(FrameQueue *queue) {
+    uint64_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    atomic_store_explicit(&queue->slots[head & (FRAME_QUEUE_SLOTS - 1)], NULL, memory_order_relaxed);
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+}
@@ -0,0 +1,44 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "mqtt.h"
+
+/* Frames a queue holds at most, a power of two. Past this, new frames are
+ * dropped until the consumer catches up, which QoS 0 allows. */
+#define FRAME_QUEUE_SLOTS 4096
+
+/* Bounded queue of frame references, filled by any amount of threads
+ * without locks nor allocations, and emptied by a single one. A producer
+ * claims a position by moving `tail`, then fills its slot. The consumer
+ * takes slots in order, and stops at an empty one: its producer isn't done
+ * yet, and the frame is taken on the next pass. */
+typedef struct FrameQueue {
+    /* next position a producer claims, and next one the consumer takes.
+     * Kept on their own cache lines, since each side writes one of them. */
+    _Alignas(64) _Atomic uint64_t tail;
+    _Alignas(64) _Atomic uint64_t head;
+    _Alignas(64) _Atomic(Frame*) slots[];
+} FrameQueue;
+
+FrameQueue *frame_queue_new(void);
+/* Releases every frame still in the queue, then frees it. No producer may
+ * use it anymore. */
+void frame_queue_free(FrameQueue *queue);
+
+/* Adds a frame, whose reference goes to the queue. Returns 0, leaving the
+ * reference to the caller, if the queue is full. */
+int frame_queue_push(FrameQueue *queue, Frame *frame);
+/* Returns the oldest frame without taking it, or NULL if there is none.
+ * Only the consumer may call it, and `frame_queue_pop`. */
+Frame *frame_queue_peek(FrameQueue *queue);
+/* Same as `frame_queue_peek`, for the frame `index` places after the oldest.
+ * Returns NULL if it isn't there, or its producer isn't done yet. */
+Frame *frame_queue_peek_at(FrameQueue *queue, size_t index);
+/* Takes the frame returned by `frame_queue_peek`, with its reference */
+void frame_queue_pop(FrameQueue *queue);
+
+#endif
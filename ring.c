@@ -0,0 +1,309 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "errors.h"
+#include "ring.h"
+
+/* Where `shm_open` keeps its objects on Linux, see `ring_unlink_all` */
+#define SHM_FOLDER "/dev/shm"
+/* Set in the length of a frame that is the name of a spill */
+#define RING_SPILLED 0x80000000u
+
+/* What a spill's shared memory object holds */
+typedef struct SpillObject {
+    /* rings it's in, plus one for the writer while it pushes it */
+    _Atomic size_t refs;
+    size_t len;
+    uint8_t data[];
+} SpillObject;
+
+/* Helper function. Not in `ring.h` */
+static Ring *map_ring(int fd, size_t size) {
+    Ring *ring = (Ring*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    return ring == MAP_FAILED ? NULL : ring;
+}
+
+/* Helper function. Not in `ring.h`
+ * Copies into the ring from position `pos` on, wrapping around its end. */
+static void copy_in(Ring *ring, uint64_t pos, const void *src, size_t len) {
+    size_t offset = pos & (ring->capacity - 1);
+    size_t first = ring->capacity - offset < len ? ring->capacity - offset : len;
+    memcpy(ring->data + offset, src, first);
+    memcpy(ring->data, (const uint8_t*)src + first, len - first);
+}
+
+/* Helper function. Not in `ring.h` */
+static void copy_out(Ring *ring, uint64_t pos, void *dst, size_t len) {
+    size_t offset = pos & (ring->capacity - 1);
+    size_t first = ring->capacity - offset < len ? ring->capacity - offset : len;
+    memcpy(dst, ring->data + offset, first);
+    memcpy((uint8_t*)dst + first, ring->data, len - first);
+}
+
+Ring *ring_create(const char *name, size_t capacity) {
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        return NULL;
+    }
+    size_t size = sizeof(Ring) + capacity;
+    if (ftruncate(fd, size) == -1) {
+        int saved_errno = errno;
+        close(fd);
+        shm_unlink(name);
+        errno = saved_errno;
+        return NULL;
+    }
+    Ring *ring = map_ring(fd, size);
+    close(fd);
+    if (!ring) {
+        shm_unlink(name);
+        return NULL;
+    }
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&ring->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    ring->capacity = capacity;
+    atomic_init(&ring->closed, 0);
+    atomic_init(&ring->dropped, 0);
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return ring;
+}
+
+Ring *ring_open(const char *name) {
+    int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+    if (fd == -1) {
+        return NULL;
+    }
+    /* the creator may not have sized it yet */
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size <= sizeof(Ring)) {
+        close(fd);
+        errno = EAGAIN;
+        return NULL;
+    }
+    Ring *ring = map_ring(fd, st.st_size);
+    close(fd);
+    return ring;
+}
+
+void ring_unmap(Ring *ring) {
+    munmap(ring, sizeof(Ring) + ring->capacity);
+}
+
+/* Helper function. Not in `ring.h`
+ * Drops the reference of a reader to the spill `name`, mapped at `spill` */
+static void release_spill(const char *name, SpillObject *spill) {
+    if (atomic_fetch_sub_explicit(&spill->refs, 1, memory_order_acq_rel) == 1) {
+        shm_unlink(name);
+    }
+    munmap(spill, sizeof(SpillObject) + spill->len);
+}
+
+/* Helper function. Not in `ring.h`
+ * Maps the spill `name`, or returns NULL */
+static SpillObject *open_spill(const char *name) {
+    int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    SpillObject *spill = NULL;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(SpillObject)) {
+        spill = (SpillObject*)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        spill = spill == MAP_FAILED ? NULL : spill;
+    }
+    close(fd);
+    return spill;
+}
+
+void ring_destroy(Ring *ring, const char *name) {
+    /* Under the lock, so no writer is in the middle of a frame after it */
+    if (pthread_mutex_lock(&ring->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&ring->lock);
+    }
+    atomic_store(&ring->closed, 1);
+    pthread_mutex_unlock(&ring->lock);
+
+    /* Spills are only removed once every ring they are in is done with them */
+    uint64_t head = atomic_load(&ring->head);
+    uint64_t tail = atomic_load(&ring->tail);
+    while (head != tail) {
+        uint32_t frame_len;
+        copy_out(ring, head, &frame_len, sizeof(frame_len));
+        head += sizeof(frame_len);
+        if (frame_len & RING_SPILLED) {
+            char spill_name[NAME_MAX + 1];
+            frame_len &= ~RING_SPILLED;
+            copy_out(ring, head, spill_name, frame_len);
+            spill_name[frame_len] = '\0';
+            SpillObject *spill = open_spill(spill_name);
+            if (spill) {
+                release_spill(spill_name, spill);
+            }
+        }
+        head += frame_len;
+    }
+
+    shm_unlink(name);
+    ring_unmap(ring);
+}
+
+void ring_unlink_all(const char *prefix) {
+    /* names given to `shm_open` start with a `/` that the entries don't have */
+    prefix += prefix[0] == '/';
+    size_t prefix_len = strlen(prefix);
+
+    DIR *dir = opendir(SHM_FOLDER);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, prefix, prefix_len) == 0) {
+            char name[NAME_MAX + 2];
+            snprintf(name, sizeof(name), "/%s", entry->d_name);
+            shm_unlink(name);
+        }
+    }
+    closedir(dir);
+}
+
+/* Helper function. Not in `ring.h`
+ * Appends `len` bytes of `data` as a frame whose length is `header`. */
+static int push(Ring *ring, uint32_t header, const uint8_t *data, size_t len) {
+    size_t needed = sizeof(uint32_t) + len;
+    if (needed > ring->capacity) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return -1;
+    }
+
+    if (pthread_mutex_lock(&ring->lock) == EOWNERDEAD) {
+        /* a writer died in the middle of a frame, which `tail` never got to */
+        pthread_mutex_consistent(&ring->lock);
+    }
+    if (atomic_load_explicit(&ring->closed, memory_order_relaxed)) {
+        pthread_mutex_unlock(&ring->lock);
+        return -1;
+    }
+
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head + needed > ring->capacity) {
+        pthread_mutex_unlock(&ring->lock);
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return -1;
+    }
+
+    copy_in(ring, tail, &header, sizeof(header));
+    copy_in(ring, tail + sizeof(header), data, len);
+
+    /* Publish the frame, then look at where the reader is. The reader does
+     * the opposite, so either it sees this frame before it stops, or this
+     * sees that it had taken everything and may be waiting. */
+    atomic_store_explicit(&ring->tail, tail + needed, memory_order_seq_cst);
+    head = atomic_load_explicit(&ring->head, memory_order_seq_cst);
+    pthread_mutex_unlock(&ring->lock);
+
+    return head == tail;
+}
+
+int ring_push(Ring *ring, const uint8_t *data, size_t len) {
+    return push(ring, len, data, len);
+}
+
+int ring_push_spill(Ring *ring, RingSpill *spill) {
+    /* the reader may take it as soon as it's pushed */
+    atomic_fetch_add_explicit(&spill->shared->refs, 1, memory_order_relaxed);
+    size_t name_len = strlen(spill->name);
+    int pushed = push(ring, RING_SPILLED | name_len, (const uint8_t*)spill->name, name_len);
+    if (pushed == -1) {
+        atomic_fetch_sub_explicit(&spill->shared->refs, 1, memory_order_relaxed);
+    }
+    return pushed;
+}
+
+Frame *ring_pop(Ring *ring) {
+    for (;;) {
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_seq_cst);
+        if (head == tail) {
+            return NULL;
+        }
+
+        uint32_t frame_len;
+        copy_out(ring, head, &frame_len, sizeof(frame_len));
+        uint64_t next = head + sizeof(frame_len) + (frame_len & ~RING_SPILLED);
+        if (!(frame_len & RING_SPILLED)) {
+            Frame *frame = frame_new(frame_len);
+            copy_out(ring, head + sizeof(frame_len), frame->data, frame_len);
+            atomic_store_explicit(&ring->head, next, memory_order_seq_cst);
+            return frame;
+        }
+
+        char name[NAME_MAX + 1];
+        frame_len &= ~RING_SPILLED;
+        copy_out(ring, head + sizeof(frame_len), name, frame_len);
+        name[frame_len] = '\0';
+        atomic_store_explicit(&ring->head, next, memory_order_seq_cst);
+
+        /* a spill that can't be mapped is skipped, like a dropped frame */
+        SpillObject *spill = open_spill(name);
+        if (spill) {
+            Frame *frame = frame_from_bytes(spill->data, spill->len);
+            release_spill(name, spill);
+            return frame;
+        }
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    }
+}
+
+RingSpill *ring_spill(const char *name, const uint8_t *data, size_t len) {
+    RingSpill *spill = (RingSpill*)malloc(sizeof(RingSpill));
+    if (!spill) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+    snprintf(spill->name, sizeof(spill->name), "%s", name);
+    spill->size = sizeof(SpillObject) + len;
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        free(spill);
+        return NULL;
+    }
+    if (ftruncate(fd, spill->size) == -1
+            || (spill->shared = (SpillObject*)mmap(NULL, spill->size, PROT_READ | PROT_WRITE,
+                                                   MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        int saved_errno = errno;
+        close(fd);
+        shm_unlink(name);
+        free(spill);
+        errno = saved_errno;
+        return NULL;
+    }
+    close(fd);
+
+    atomic_init(&spill->shared->refs, 1);
+    spill->shared->len = len;
+    memcpy(spill->shared->data, data, len);
+    return spill;
+}
+
+void ring_spill_release(RingSpill *spill) {
+    release_spill(spill->name, spill->shared);
+    free(spill);
+}
@@ -0,0 +1,74 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <limits.h>
+
+#include "mqtt.h"
+
+/* Bytes of frames a ring holds, a power of two. Past this, new frames are
+ * dropped until the reader catches up, which QoS 0 allows. */
+#define RING_CAPACITY (1024 * 1024)
+/* Frames longer than this are spilled, see `RingSpill` */
+#define RING_MAX_FRAME (RING_CAPACITY / 8)
+
+/* Frames between processes, in shared memory (`shm_open`). Any process
+ * mapping the ring writes to it, and only the one that created it reads.
+ * Each frame is a 32-bit length followed by its bytes, and may wrap around
+ * the end of `data`. A length with RING_SPILLED set is followed by the name
+ * of a spill instead. Writers take `lock`, the reader never does: it only
+ * follows `tail`, which is moved once a frame is complete. */
+typedef struct Ring {
+    /* process-shared and robust, a writer dying while holding it doesn't
+     * block the others */
+    pthread_mutex_t lock;
+    size_t capacity;
+    /* set by the reader when it goes away, writers then forget the ring */
+    _Atomic int closed;
+    _Atomic unsigned long dropped;
+    /* next byte the reader takes, and end of the last complete frame. Kept
+     * on their own cache lines, since each side writes one of them. */
+    _Alignas(64) _Atomic uint64_t head;
+    _Alignas(64) _Atomic uint64_t tail;
+    _Alignas(64) uint8_t data[];
+} Ring;
+
+/* A frame too long for rings, up to the largest MQTT packet, in its own
+ * shared memory object. It's written once and pushed to any amount of rings,
+ * which only carry its name; the last reader to take it removes it. */
+typedef struct RingSpill {
+    struct SpillObject *shared;
+    size_t size;
+    char name[NAME_MAX + 1];
+} RingSpill;
+
+/* Creates the ring `name` and maps it, or returns NULL and sets errno */
+Ring *ring_create(const char *name, size_t capacity);
+/* Maps the existing ring `name`, or returns NULL and sets errno */
+Ring *ring_open(const char *name);
+void ring_unmap(Ring *ring);
+/* Called by the reader: closes the ring for writers, removes and unmaps it */
+void ring_destroy(Ring *ring, const char *name);
+/* Removes every ring whose name starts with `prefix`, left by processes
+ * that died without destroying them */
+void ring_unlink_all(const char *prefix);
+
+/* Appends a frame. Returns 1 if the reader may be waiting for it and must be
+ * woken up, 0 if it will see it anyway, and -1 if the frame was dropped
+ * because the ring is full or closed. */
+int ring_push(Ring *ring, const uint8_t *data, size_t len);
+/* Same as `ring_push`, for a spill */
+int ring_push_spill(Ring *ring, RingSpill *spill);
+/* Takes the oldest frame, or returns NULL if there are none. Only the
+ * creator of the ring may call it. */
+Frame *ring_pop(Ring *ring);
+
+/* Copies a frame into the new spill `name`, or returns NULL and sets errno */
+RingSpill *ring_spill(const char *name, const uint8_t *data, size_t len);
+/* Called by the writer once it's done pushing the spill */
+void ring_spill_release(RingSpill *spill);
+
+#endif
@@ -22,13 +22,18 @@
 #include <sys/fcntl.h>
 #include <signal.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <sys/wait.h>
 
 #include "errors.h"
 #include "mqtt.h"
 #include "management.h"
 #include "handlers.h"
+#include "loop.h"
+#include "shard.h"
+#include "fanout.h"
 
-#define LISTENQ 1
+#define LISTENQ SOMAXCONN
 #define MAXDATASIZE 100
 #define MAXLINE 4096
 
@@ -38,32 +43,21 @@
 
 /* ========================================================= */
 
-int main (int argc, char **argv) {
-    // Server listening socket
+/* Each reactor thread owns a listening socket and an event loop */
+typedef struct Reactor {
+    pthread_t thread;
     int listenfd;
-    // Individual connection socket.
-    // Must be open from the main process, and then closed after each fork.
-    int connfd;
-    // Identifies the current connection.
-    long long int connection_id = 0;
+    EventLoop loop;
+} Reactor;
 
+/* Creates a listening socket on `port`. Several of them can be bound to the
+ * same port thanks to SO_REUSEPORT, and the kernel balances new connections
+ * between them. */
+static int open_listener(uint16_t port) {
+    // Server listening socket
+    int listenfd;
     // Socket information
     struct sockaddr_in servaddr;
-    // Fork return
-    pid_t childpid;
-   
-    // Choose server port
-    uint16_t server_port;
-    if (argc >= 2) {
-        server_port = atoi(argv[1]);
-    } else {
-        server_port = DEFAULT_SERVER_PORT;
-    }
-
-    /* Setup: prepare FIFO directory, wait for previous children to _stop_ */
-    signal(SIGINT, catch_int);
-    fresh_dir(BASE_FOLDER);
-    sleep(1); /* wait for orphan children to die */
 
     // IPv4, TCP, Internet socket creation
     if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
@@ -77,6 +71,11 @@ int main (int argc, char **argv) {
         perror("setsockopt");
         exit(EXIT_FAILURE);
     }
+    /* Allow every reactor thread to bind its own socket to the same port */
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) == -1) {
+        perror("setsockopt");
+        exit(EXIT_FAILURE);
+    }
 
     // Socket binding.
     // Uses IPv4, connects to any address, sets port to command line
@@ -84,7 +83,7 @@ int main (int argc, char **argv) {
     bzero(&servaddr, sizeof(servaddr));
     servaddr.sin_family      = AF_INET;
     servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    servaddr.sin_port        = htons(server_port);
+    servaddr.sin_port        = htons(port);
     if (bind(listenfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) == -1) {
         perror("bind :(\n");
         exit(3);
@@ -96,144 +95,228 @@ int main (int argc, char **argv) {
         exit(4);
     }
 
-    printf("[Server up. Waiting for connections in port %d]\n", server_port);
+    /* Several loops may be woken up for the same connection (pre-fork mode),
+     * only one of them gets it and the others must not block */
+    if (fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        exit(EXIT_FAILURE);
+    }
+
+    return listenfd;
+}
+
+/* Prints the routing counters once the server stops */
+static void report(MatchStats stats) {
+    printf("[%lu PUBLISH packets had no subscribers and were dropped before routing]\n", stats.unmatched);
+    printf("[Subscribers matched against filters: %lu found in the cache, %lu matched]\n",
+           stats.cache_hits, stats.cache_misses);
+
+    WriteStats written = loop_write_stats();
+    printf("[%llu packets written to sockets in %llu writes, %.1f per write]\n",
+           written.packets, written.writes,
+           written.writes ? (double)written.packets / written.writes : 0.0);
+}
+
+static void *run_reactor(void *arg) {
+    Reactor *reactor = (Reactor*)arg;
+    loop_run(&reactor->loop);
+    return NULL;
+}
+
+/* Threads mode: one process, `thread_amount` reactors, each with its own
+ * listener. With `shared_nothing`, each reactor is also a shard pinned to a
+ * core, see `shard.h`. Returns once CTRL+C is received. */
+static void run_threads(uint16_t port, long thread_amount, int shared_nothing, sigset_t *stop_signals) {
+    /* All listeners are opened before any thread starts, so a failed bind
+     * stops the server right away */
+    Reactor *reactors = (Reactor*)calloc(thread_amount, sizeof(Reactor));
+    if (!reactors) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+    if (shared_nothing) {
+        shards_init(thread_amount);
+    } else {
+        handlers_init(0);
+        /* the thread that received a PUBLISH is one of those fanning it out */
+        fanout_init(thread_amount - 1);
+    }
+    for (long i = 0; i < thread_amount; i++) {
+        reactors[i].listenfd = open_listener(port);
+        loop_init(&reactors[i].loop, reactors[i].listenfd);
+        if (shared_nothing) {
+            loop_set_shard(&reactors[i].loop, shard_get(i));
+        }
+    }
+
+    printf("[Server up. Waiting for connections in port %d with %ld threads]\n", port, thread_amount);
     printf("[To stop the server, do CTRL+C]\n");
-   
-    /* ===================== Server loop ======================= */
-	for (;;) {
-        // Accepts connection to the first socket in the listening queue
-        if ((connfd = accept(listenfd, (struct sockaddr *) NULL, NULL)) == -1 ) {
-            perror("accept :(\n");
-            exit(5);
+
+    /* Each thread runs its own event loop over the connections accepted by
+     * its own listener. A PUBLISH is queued by the thread that received it
+     * for every subscriber found in the index of `handlers.c`, with the help
+     * of the fan-out pool when they are many, and written by the thread each
+     * subscriber belongs to. */
+    for (long i = 0; i < thread_amount; i++) {
+        if (pthread_create(&reactors[i].thread, NULL, run_reactor, &reactors[i]) != 0) {
+            fprintf(stderr, "[ERROR: Could not start reactor thread %ld]\n", i);
+            exit(ERROR_SERVER);
         }
 
-        // Create the identifier for the new connection.
-        connection_id++;
-
-        // Forks to new process.
-        // The child should treat the connection open on `connfd`, while the
-        // parent should close this socket to listen for more connections.
-        if ((childpid = fork()) == 0) {
-            // Child process
-            close(listenfd);
-            int mypid = getpid();
-            printf("[Connection open for user %lld on PID %d]\n", connection_id, mypid);
-
-            /* ========================================================= */
-            /* ========================================================= */
-            /*                         EP1 START                         */
-            /* ========================================================= */
-            /* ========================================================= */
-
-            MqttControlPacket received = { 0 };
-            MqttControlPacket connack = { 0 };
-
-            read_control_packet(connfd, &received);
-
-            /* Useful for debugging
-            // FIXED HEADER
-            printf("Fixed header:\n");
-            printf("header.len = %d\n", packet.fixed_header.len);
-            printf("header.type = %d\n", packet.fixed_header.type);
-            printf("header.flags = %d\n", packet.fixed_header.flags);
-
-            // VAR HEADER
-            printf("Variable header:\n");
-            printf("pack_id = %d\n", packet.var_header.pack_id);
-            printf("props.len = %d\n", packet.var_header.props_len);
-            printf("payload[1] = %c\n", packet.payload.content[1]);
-
-            // PAYLOAD
-            printf("Payload length: %d\n", packet.payload.len);
-            printf("Payload:\n");
-            for (ssize_t i = 0; i < packet.payload.len; i++) {
-                printf("%d:%c\n", packet.payload.content[i], packet.payload.content[i]);
-            }
-            */
+        if (shared_nothing) {
+            /* A shard never migrates, so its topics stay in its core's cache */
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(i % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+            pthread_setaffinity_np(reactors[i].thread, sizeof(cpus), &cpus);
+        }
+    }
 
-            /* First packet should be CONNECT */
-            if (received.fixed_header.type != CONNECT) {
-                fprintf(stderr, "[Got invalid connection, probably not MQTT]\n");
-                exit(ERROR_CLIENT);
-            }
-            destroy_control_packet(received);
-        
-            /* Answer CONNECT with CONNACK */
-            connack = create_connack();
-            write_control_packet(connfd, &connack);
-            destroy_control_packet(connack);
-
-            /* Now, we treat any other packets this client may send */
-            for (;;) {
-                int stop = 0;
-
-                memset(&received, 0, sizeof(MqttControlPacket)); 
-
-                /* This can fail with a weird message if the client
-                 * suddenly closes the connection.
-                 * The broker will still work, so won't fix for now. */
-                read_control_packet(connfd, &received);
-
-                switch ((MqttControlType)received.fixed_header.type) {
-                    case SUBSCRIBE:
-                        treat_subscribe(connfd, connection_id, received);
-                        break;
-                    case UNSUBSCRIBE:
-                        treat_unsubscribe(connfd, connection_id, received);
-                        break;
-                    case PUBLISH:
-                        /* We only accept PUBLISH with QoS = 0 */
-                        treat_publish(connection_id, received);
-                        
-                        // I don't really understand why, but if the next two bytes are
-                        // [0xE0, 0x00], we got a disconnect request.
-                        // My guess is that's the start of a disconnect packet, and the
-                        // client assumes we'll instantly stop if we get these two bytes.
-
-                        // Peek at the next two bytes without consuming them.
-                        unsigned char peek_buffer[2];
-                        ssize_t peek_result = recv(connfd, peek_buffer, 2, MSG_PEEK);
-                        if (peek_result == 2) {
-                            if (peek_buffer[0] == 0xE0 && peek_buffer[1] == 0x00) {
-                                // disconnect request
-                                stop = 1;
-                            } else {
-                                // printf("[Debug] Next bytes are 0x%02x 0x%02x\n", 
-                                //     peek_buffer[0], peek_buffer[1]);
-                            }
-                        }
-                        
-                        break;
-                    case DISCONNECT:
-                        treat_disconnect(connection_id);
-                        stop = 1;
-                        break;
-                    case PINGREQ:
-                        treat_pingreq(connfd);
-                        break;
-                    default:
-                        fprintf(stderr, "[Warning: packet type %d not implemented]\n", received.fixed_header.type);
-                }
+    int sig;
+    sigwait(stop_signals, &sig);
+    report(shared_nothing ? shards_stats() : handlers_stats());
+}
 
-                destroy_control_packet(received);
+/* Forks a worker process of the pre-fork mode. The worker runs an event
+ * loop over the shared listener until it's told to stop. */
+static pid_t start_worker(int listenfd, long index) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork :(\n");
+        exit(ERROR_SERVER);
+    }
+    if (pid > 0) {
+        return pid;
+    }
 
-                if (stop) { break; }
-            }
+    /* Worker: stop on CTRL+C or when the master asks to */
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    sigset_t no_signals;
+    sigemptyset(&no_signals);
+    pthread_sigmask(SIG_SETMASK, &no_signals, NULL);
 
-            /* ========================================================= */
-            /* ========================================================= */
-            /*                         EP1 END                           */
-            /* ========================================================= */
-            /* ========================================================= */
+    printf("[Worker %ld up on PID %d]\n", index, getpid());
 
-            printf("[Connection closed for user %lld on PID %d]\n", connection_id, mypid);
-            exit(0);
-        } else {
-            close(connfd);
+    EventLoop loop;
+    loop_init(&loop, listenfd);
+    loop_run(&loop);
+    exit(0);
+}
+
+/* Pre-fork mode: `worker_amount` processes started at boot, like nginx.
+ * All of them accept from the same listening socket and each multiplexes
+ * many connections. Subscriptions are kept in BASE_FOLDER, which every
+ * worker sees, so PUBLISH fan-out reaches subscribers of any worker.
+ * Returns once CTRL+C is received. */
+static void run_prefork(uint16_t port, long worker_amount, sigset_t *stop_signals) {
+    int listenfd = open_listener(port);
+    /* User ids name the directories and mailboxes, they must be unique among
+     * workers */
+    loop_share_counters();
+    handlers_init(1);
+
+    pid_t *workers = (pid_t*)calloc(worker_amount, sizeof(pid_t));
+    if (!workers) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+
+    /* The master only waits for signals, SIGCHLD included */
+    sigset_t master_signals = *stop_signals;
+    sigaddset(&master_signals, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &master_signals, NULL);
+
+    for (long i = 0; i < worker_amount; i++) {
+        workers[i] = start_worker(listenfd, i);
+    }
+
+    printf("[Server up. Waiting for connections in port %d with %ld worker processes]\n", port, worker_amount);
+    printf("[To stop the server, do CTRL+C]\n");
+
+    for (;;) {
+        int sig;
+        sigwait(&master_signals, &sig);
+        if (sig != SIGCHLD) {
+            break;
         }
+
+        /* Replace workers that died, e.g. on a malformed packet */
+        pid_t pid;
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+            for (long i = 0; i < worker_amount; i++) {
+                if (workers[i] == pid) {
+                    fprintf(stderr, "[Worker %ld on PID %d died, restarting it]\n", i, pid);
+                    /* its users are gone with it */
+                    handlers_release_worker(pid);
+                    workers[i] = start_worker(listenfd, i);
+                }
+            }
+        }
+    }
+
+    for (long i = 0; i < worker_amount; i++) {
+        kill(workers[i], SIGTERM);
+    }
+    while (waitpid(-1, NULL, 0) > 0) { }
+    report(handlers_stats());
+    handlers_cleanup();
+}
+
+int main (int argc, char **argv) {
+    // Choose server port
+    uint16_t server_port;
+    if (argc >= 2) {
+        server_port = atoi(argv[1]);
+    } else {
+        server_port = DEFAULT_SERVER_PORT;
+    }
+
+    // Choose amount of reactor threads (or worker processes), one per core
+    // by default
+    long thread_amount;
+    if (argc >= 3) {
+        thread_amount = atol(argv[2]);
+    } else {
+        thread_amount = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (thread_amount < 1) {
+        thread_amount = 1;
+    }
+
+    // Choose how reactors are run: `threads` (default), `shared-nothing`
+    // or `prefork`
+    const char *mode = argc >= 4 ? argv[3] : "threads";
+    if (strcmp(mode, "threads") != 0 && strcmp(mode, "shared-nothing") != 0 && strcmp(mode, "prefork") != 0) {
+        fprintf(stderr, "[ERROR: Unknown mode '%s', use 'threads', 'shared-nothing' or 'prefork']\n", mode);
+        exit(EXIT_FAILURE);
+    }
+
+    /* A client closing its socket must not kill the whole broker */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Setup: prepare the subscription directory. Mailboxes are read by the
+     * loops themselves and end with them, so nothing of a previous run is
+     * left waiting on it. */
+    fresh_dir(BASE_FOLDER);
+
+    /* CTRL+C is only handled by the main thread, with `sigwait`. Cleaning up
+     * from a signal handler could deadlock a reactor in the middle of a
+     * `malloc`. The mask is inherited by the reactor threads. */
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+
+    /* ===================== Server loop ======================= */
+
+    if (strcmp(mode, "prefork") == 0) {
+        run_prefork(server_port, thread_amount, &stop_signals);
+    } else {
+        run_threads(server_port, thread_amount, strcmp(mode, "shared-nothing") == 0, &stop_signals);
     }
 
-    /* I don't think the program can get here */
     remove_dir(BASE_FOLDER);
     exit(0);
 }
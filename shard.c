@@ -0,0 +1,346 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "errors.h"
+#include "shard.h"
+
+static Shard *shards = NULL;
+static size_t shard_count = 0;
+
+void shards_init(size_t count) {
+    shards = (Shard*)calloc(count, sizeof(Shard));
+    if (!shards) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+    shard_count = count;
+
+    for (size_t i = 0; i < count; i++) {
+        Shard *shard = &shards[i];
+        shard->index = i;
+        shard->loop = NULL;
+        atomic_init(&shard->inbox, NULL);
+        topic_index_init(&shard->topics);
+
+        shard->counts = (size_t*)calloc(count, sizeof(size_t));
+        shard->outbox = (ShardMessage**)calloc(count, sizeof(ShardMessage*));
+        if (!shard->counts || !shard->outbox) {
+            fprintf(stderr, "[Memory error, stopping]\n");
+            exit(ERROR_SERVER);
+        }
+
+        if ((shard->inbox_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+            perror("eventfd :(\n");
+            exit(ERROR_SERVER);
+        }
+    }
+}
+
+Shard *shard_get(size_t index) {
+    return &shards[index];
+}
+
+MatchStats shards_stats(void) {
+    MatchStats total = { 0 };
+    for (size_t i = 0; i < shard_count; i++) {
+        MatchStats stats = topic_index_stats(&shards[i].topics);
+        total.unmatched += stats.unmatched;
+        total.cache_hits += stats.cache_hits;
+        total.cache_misses += stats.cache_misses;
+    }
+    return total;
+}
+
+/* Helper function. Not in `shard.h` */
+static size_t owner_of(String topic) {
+    return topic_hash(topic.val, topic.len) % shard_count;
+}
+
+/* Helper function. Not in `shard.h`
+ * Copies topic and payload into the message, so it outlives the packet. */
+static ShardMessage *new_message(ShardMessageType type, String topic, const uint8_t *payload,
+                                 size_t payload_len, size_t target_count) {
+    size_t targets_size = target_count * sizeof(Subscriber);
+    ShardMessage *msg = (ShardMessage*)malloc(
+        sizeof(ShardMessage) + targets_size + topic.len + 1 + payload_len
+    );
+    if (!msg) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+
+    msg->next = NULL;
+    msg->type = type;
+    msg->targets = (Subscriber*)msg->data;
+    msg->target_count = 0;
+    msg->frame = NULL;
+
+    msg->topic.len = topic.len;
+    msg->topic.val = (char*)msg->data + targets_size;
+    if (topic.len > 0) {
+        memcpy(msg->topic.val, topic.val, topic.len);
+    }
+    msg->topic.val[topic.len] = '\0';
+
+    msg->payload = (uint8_t*)msg->topic.val + topic.len + 1;
+    msg->payload_len = payload_len;
+    if (payload_len > 0) {
+        memcpy(msg->payload, payload, payload_len);
+    }
+    return msg;
+}
+
+/* Helper function. Not in `shard.h`
+ * A SHARD_DELIVER only carries its targets, the PUBLISH is already encoded. */
+static ShardMessage *new_delivery(Frame *frame, size_t target_count) {
+    ShardMessage *msg = (ShardMessage*)malloc(sizeof(ShardMessage) + target_count * sizeof(Subscriber));
+    if (!msg) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+
+    msg->next = NULL;
+    msg->type = SHARD_DELIVER;
+    msg->targets = (Subscriber*)msg->data;
+    msg->target_count = 0;
+    frame_hold(frame);
+    msg->frame = frame;
+    msg->topic.val = NULL;
+    msg->topic.len = 0;
+    msg->payload = NULL;
+    msg->payload_len = 0;
+    return msg;
+}
+
+/* Helper function. Not in `shard.h`
+ * Pushes into the destination's inbox. Only the push that finds the inbox
+ * empty has to wake the destination up. */
+static void post(Shard *to, ShardMessage *msg) {
+    ShardMessage *head = atomic_load_explicit(&to->inbox, memory_order_relaxed);
+    do {
+        msg->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(
+        &to->inbox, &head, msg, memory_order_release, memory_order_relaxed
+    ));
+
+    if (head == NULL) {
+        uint64_t one = 1;
+        if (write(to->inbox_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+            perror("[Could not wake shard up]");
+        }
+    }
+}
+
+/* Helper function. Not in `shard.h`
+ * Queues a PUBLISH to connections of this shard. Targets that are gone, or
+ * whose fd now belongs to another connection, are skipped. */
+static void deliver(Shard *shard, const Subscriber *targets, size_t count, Frame *frame) {
+    EventLoop *loop = shard->loop;
+    for (size_t i = 0; i < count; i++) {
+        int fd = targets[i].fd;
+        if ((size_t)fd >= loop->conns_cap) {
+            continue;
+        }
+        Connection *conn = loop->conns[fd];
+        if (conn == NULL || conn->id != targets[i].id || !conn->connected) {
+            continue;
+        }
+        connection_send_frame(conn, frame);
+    }
+}
+
+/* Helper function. Not in `shard.h`
+ * Runs in the topic's owner: sends the PUBLISH to every subscriber's shard.
+ * It's encoded once here, and every shard queues that same frame. */
+static void fan_out(Shard *shard, String name, uint8_t *payload, size_t payload_len) {
+    /* Most topics without subscribers stop here, before anything is
+     * allocated for them */
+    if (!topic_index_may_match(&shard->topics, name.val, name.len)) {
+        return;
+    }
+
+    Topic *topic = topic_lookup(name.val, name.len);
+    const SubscriberList *subs = topic_index_match(&shard->topics, topic, &shard->matched);
+    topic_done(topic);
+    if (subs == NULL) {
+        return;
+    }
+
+    MqttControlPacket send = create_publish(name, (char*)payload, payload_len);
+    Frame *frame = frame_encode(&send);
+    /* don't destroy `send` since it doesn't allocate anything new */
+
+    /* One message per shard with subscribers, sized on a first pass */
+    size_t *counts = shard->counts;
+    for (size_t i = 0; i < subs->count; i++) {
+        counts[subs->items[i].shard]++;
+    }
+    for (size_t s = 0; s < shard_count; s++) {
+        if (counts[s] > 0 && s != shard->index) {
+            shard->outbox[s] = new_delivery(frame, counts[s]);
+        }
+        counts[s] = 0;
+    }
+
+    for (size_t i = 0; i < subs->count; i++) {
+        const Subscriber *sub = &subs->items[i];
+        if (sub->shard == shard->index) {
+            deliver(shard, sub, 1, frame);
+        } else {
+            ShardMessage *msg = shard->outbox[sub->shard];
+            msg->targets[msg->target_count++] = *sub;
+        }
+    }
+
+    for (size_t s = 0; s < shard_count; s++) {
+        if (shard->outbox[s]) {
+            post(&shards[s], shard->outbox[s]);
+            shard->outbox[s] = NULL;
+        }
+    }
+    frame_release(frame);
+
+    /* `subs` may be one of them, and is done with */
+    if (topic_index_retired(&shard->topics) > MATCH_CACHE_SLOTS) {
+        topic_index_reclaim(&shard->topics);
+    }
+}
+
+/* Helper function. Not in `shard.h` */
+static void apply_subscription(Shard *shard, ShardMessageType type, String topic, Subscriber sub) {
+    if (type == SHARD_SUBSCRIBE) {
+        topic_index_add(&shard->topics, topic.val, topic.len, sub);
+    } else {
+        topic_index_remove(&shard->topics, topic.val, topic.len, sub);
+    }
+}
+
+/* Helper function. Not in `shard.h`
+ * Updates the topic's owner, directly when it is this same shard. A filter
+ * with wildcards may match topics of any shard, so every shard keeps it.
+ * A shared subscription goes where its filter would, so that the members of
+ * a group meet in the same shards. */
+static void route_subscription(Shard *shard, ShardMessageType type, Connection *conn, String topic) {
+    Subscriber sub = { .shard = shard->index, .fd = conn->fd, .id = conn->id };
+    size_t prefix = topic_share_prefix(topic.val, topic.len);
+    String filter = { .val = topic.val + prefix, .len = topic.len - prefix };
+    int everywhere = topic_has_wildcards(filter.val, filter.len);
+    size_t owner = owner_of(filter);
+
+    for (size_t s = 0; s < shard_count; s++) {
+        if (!everywhere && s != owner) {
+            continue;
+        }
+        if (s == shard->index) {
+            apply_subscription(shard, type, topic, sub);
+            continue;
+        }
+
+        ShardMessage *msg = new_message(type, topic, NULL, 0, 0);
+        msg->subscriber = sub;
+        post(&shards[s], msg);
+    }
+}
+
+void shard_subscribe(Shard *shard, Connection *conn, MqttControlPacket packet) {
+    for (ssize_t i = 0; i < packet.payload.subscribe.topic_amount; i++) {
+        String topic = packet.payload.subscribe.topics[i].str;
+        if (!topic_filter_valid(topic.val, topic.len)) {
+            /* refused in the SUBACK */
+            continue;
+        }
+        if (connection_add_topic(conn, topic)) {
+            route_subscription(shard, SHARD_SUBSCRIBE, conn, topic);
+        }
+    }
+
+    MqttControlPacket send = create_suback(packet);
+    write_control_packet(conn->fd, &send);
+    /* we allocated for the payload */
+    destroy_control_packet(send);
+}
+
+void shard_unsubscribe(Shard *shard, Connection *conn, MqttControlPacket packet) {
+    for (ssize_t i = 0; i < packet.payload.unsubscribe.topic_amount; i++) {
+        String topic = packet.payload.unsubscribe.topics[i];
+        if (connection_remove_topic(conn, topic)) {
+            route_subscription(shard, SHARD_UNSUBSCRIBE, conn, topic);
+        } else {
+            fprintf(stderr,
+                "[Warning: User %lld tried to unsubscribe from non-existent topic: %s]\n",
+                conn->id, topic.val
+            );
+        }
+    }
+
+    MqttControlPacket send = create_unsuback(packet);
+    write_control_packet(conn->fd, &send);
+    destroy_control_packet(send);
+}
+
+void shard_publish(Shard *shard, MqttControlPacket packet) {
+    String name = packet.var_header.publish.topic_name;
+    uint8_t *payload = packet.payload.other.content;
+    size_t payload_len = packet.payload.other.len;
+
+    /* The owner looks the topic up, only once it knows it may have
+     * subscribers */
+    size_t owner = owner_of(name);
+    if (owner == shard->index) {
+        fan_out(shard, name, payload, payload_len);
+    } else {
+        post(&shards[owner], new_message(SHARD_PUBLISH, name, payload, payload_len, 0));
+    }
+}
+
+void shard_release(Shard *shard, Connection *conn) {
+    for (size_t i = 0; i < conn->subscription_count; i++) {
+        route_subscription(shard, SHARD_UNSUBSCRIBE, conn, conn->subscriptions[i]);
+    }
+    connection_clear_topics(conn);
+}
+
+void shard_drain(Shard *shard) {
+    /* Reset the eventfd before taking the messages: a push that happens in
+     * between finds the inbox empty and wakes the shard up again */
+    uint64_t wakeups;
+    if (read(shard->inbox_fd, &wakeups, sizeof(wakeups)) == -1 && errno != EAGAIN) {
+        perror("[Could not read shard inbox]");
+    }
+
+    ShardMessage *msg = atomic_exchange_explicit(&shard->inbox, NULL, memory_order_acquire);
+
+    /* The inbox is a stack, put messages back in the order they were sent */
+    ShardMessage *ordered = NULL;
+    while (msg) {
+        ShardMessage *next = msg->next;
+        msg->next = ordered;
+        ordered = msg;
+        msg = next;
+    }
+
+    while (ordered) {
+        msg = ordered;
+        ordered = msg->next;
+
+        switch (msg->type) {
+            case SHARD_SUBSCRIBE:
+            case SHARD_UNSUBSCRIBE:
+                apply_subscription(shard, msg->type, msg->topic, msg->subscriber);
+                break;
+            case SHARD_PUBLISH:
+                fan_out(shard, msg->topic, msg->payload, msg->payload_len);
+                break;
+            case SHARD_DELIVER:
+                deliver(shard, msg->targets, msg->target_count, msg->frame);
+                frame_release(msg->frame);
+                break;
+        }
+        free(msg);
+    }
+}
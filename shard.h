@@ -0,0 +1,74 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "mqtt.h"
+#include "topics.h"
+#include "loop.h"
+
+typedef enum ShardMessageType {
+    SHARD_SUBSCRIBE,
+    SHARD_UNSUBSCRIBE,
+    /* a PUBLISH for a topic owned by the receiving shard */
+    SHARD_PUBLISH,
+    /* a PUBLISH to be written to connections of the receiving shard */
+    SHARD_DELIVER,
+} ShardMessageType;
+
+/* Message between shards. Topic, payload and targets live right after it. */
+typedef struct ShardMessage {
+    struct ShardMessage *next;
+    ShardMessageType type;
+    /* who subscribes or unsubscribes */
+    Subscriber subscriber;
+    /* connections a SHARD_DELIVER is written to */
+    Subscriber *targets;
+    size_t target_count;
+    /* the encoded PUBLISH of a SHARD_DELIVER, shared with the other shards
+     * it goes to, of which the message holds one reference */
+    Frame *frame;
+    /* the filter of a SHARD_SUBSCRIBE or SHARD_UNSUBSCRIBE, or the topic of
+     * a SHARD_PUBLISH */
+    String topic;
+    uint8_t *payload;
+    size_t payload_len;
+    uint8_t data[];
+} ShardMessage;
+
+/* Shared-nothing mode: each reactor thread is a shard that owns the topics
+ * whose hash falls on it. Only the owner touches a topic's subscribers, so
+ * routing takes no locks. Filters with wildcards are copied to every shard.
+ * Shards talk through their inboxes: a lock-free stack of messages, with an
+ * eventfd to wake the shard up. */
+typedef struct Shard {
+    size_t index;
+    int inbox_fd;
+    _Atomic(ShardMessage*) inbox;
+    /* topics owned by this shard, and every filter with wildcards */
+    TopicIndex topics;
+    EventLoop *loop;
+    /* scratch space for fan-out, one slot per shard */
+    size_t *counts;
+    SubscriberList matched;
+    ShardMessage **outbox;
+} Shard;
+
+void shards_init(size_t count);
+Shard *shard_get(size_t index);
+/* Counters of every shard together */
+MatchStats shards_stats(void);
+
+/* Handlers used instead of the ones in `handlers.h`, they run in the shard
+ * of the connection */
+void shard_subscribe(Shard *shard, Connection *conn, MqttControlPacket packet);
+void shard_unsubscribe(Shard *shard, Connection *conn, MqttControlPacket packet);
+void shard_publish(Shard *shard, MqttControlPacket packet);
+/* Drops every subscription of a connection that is closing */
+void shard_release(Shard *shard, Connection *conn);
+
+/* Treats every message in the shard's inbox */
+void shard_drain(Shard *shard);
+
+#endif
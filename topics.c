@@ -0,0 +1,1167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "errors.h"
+#include "topics.h"
+
+#define INITIAL_BUCKETS 64
+#define SHARE_PREFIX "$share/"
+#define SHARE_PREFIX_LEN (sizeof(SHARE_PREFIX) - 1)
+
+uint32_t topic_hash(const char *name, size_t len) {
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+int topic_has_wildcards(const char *name, size_t len) {
+    return memchr(name, '+', len) != NULL || memchr(name, '#', len) != NULL;
+}
+
+size_t topic_share_prefix(const char *filter, size_t len) {
+    if (len <= SHARE_PREFIX_LEN || memcmp(filter, SHARE_PREFIX, SHARE_PREFIX_LEN) != 0) {
+        return 0;
+    }
+    const char *group = filter + SHARE_PREFIX_LEN;
+    const char *slash = (const char*)memchr(group, '/', len - SHARE_PREFIX_LEN);
+    if (!slash || slash == group || topic_has_wildcards(group, slash - group)) {
+        return 0;
+    }
+
+    size_t prefix = slash - filter + 1;
+    /* the filter itself can't be empty */
+    return prefix < len ? prefix : 0;
+}
+
+int topic_filter_valid(const char *filter, size_t len) {
+    if (len >= SHARE_PREFIX_LEN && memcmp(filter, SHARE_PREFIX, SHARE_PREFIX_LEN) == 0) {
+        size_t prefix = topic_share_prefix(filter, len);
+        if (prefix == 0) {
+            return 0;
+        }
+        filter += prefix;
+        len -= prefix;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (filter[i] != '+' && filter[i] != '#') {
+            continue;
+        }
+        /* wildcards take a whole level, and `#` can only be the last one */
+        if ((i > 0 && filter[i - 1] != '/') || (i + 1 < len && filter[i + 1] != '/')) {
+            return 0;
+        }
+        if (filter[i] == '#' && i + 1 != len) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int topic_matches(const char *filter, size_t filter_len, const char *topic, size_t topic_len) {
+    /* topics starting with `$` are only matched explicitly */
+    if (topic_len > 0 && topic[0] == '$' && filter_len > 0 && (filter[0] == '+' || filter[0] == '#')) {
+        return 0;
+    }
+
+    size_t f = 0, t = 0;
+    for (;;) {
+        if (f < filter_len && filter[f] == '#') {
+            return 1;
+        }
+
+        size_t f_end = f, t_end = t;
+        while (f_end < filter_len && filter[f_end] != '/') { f_end++; }
+        while (t_end < topic_len && topic[t_end] != '/') { t_end++; }
+
+        int plus = f_end - f == 1 && filter[f] == '+';
+        if (!plus && (f_end - f != t_end - t || memcmp(filter + f, topic + t, f_end - f) != 0)) {
+            return 0;
+        }
+
+        int filter_done = f_end == filter_len, topic_done = t_end == topic_len;
+        if (filter_done || topic_done) {
+            /* "a/#" also matches "a" */
+            return (filter_done && topic_done)
+                || (topic_done && f_end + 2 == filter_len && filter[f_end + 1] == '#');
+        }
+        f = f_end + 1;
+        t = t_end + 1;
+    }
+}
+
+/* === Interned topics === */
+
+/* Open addressing table of interned topics. It's only written with
+ * `names_lock` taken, and read without any lock: slots are filled once, and
+ * a table that grows is replaced by a bigger copy. */
+typedef struct TopicSlots {
+    /* the table this one replaced, which readers may still be looking at */
+    struct TopicSlots *previous;
+    size_t mask;
+    _Atomic(Topic*) items[];
+} TopicSlots;
+
+static _Atomic(TopicSlots*) names = NULL;
+static pthread_mutex_t names_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic size_t interned = 0;
+/* taken by the interned topics, only used with `names_lock` taken */
+static size_t interned_bytes = 0;
+
+/* Helper function. Not in `topics.h` */
+static Topic *new_topic(const char *name, size_t len, uint32_t hash) {
+    size_t level_count = 1;
+    for (size_t i = 0; i < len; i++) {
+        level_count += name[i] == '/';
+    }
+
+    /* a single allocation, levels go after the name */
+    size_t levels_at = (sizeof(Topic) + len + 1 + sizeof(size_t) - 1) / sizeof(size_t) * sizeof(size_t);
+    Topic *topic = (Topic*)malloc(levels_at + level_count * (sizeof(size_t) + sizeof(uint32_t)));
+    if (!topic) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+    topic->id = TOPIC_TRANSIENT;
+    topic->hash = hash;
+    topic->name_len = len;
+    memcpy(topic->name, name, len);
+    topic->name[len] = '\0';
+
+    topic->level_count = level_count;
+    topic->level_ends = (size_t*)((char*)topic + levels_at);
+    topic->level_hashes = (uint32_t*)(topic->level_ends + level_count);
+    size_t start = 0;
+    for (size_t level = 0; level < level_count; level++) {
+        size_t end = start;
+        while (end < len && name[end] != '/') { end++; }
+        topic->level_ends[level] = end;
+        topic->level_hashes[level] = topic_hash(name + start, end - start);
+        start = end + 1;
+    }
+    return topic;
+}
+
+/* Helper function. Not in `topics.h` */
+static Topic *find_name(TopicSlots *slots, const char *name, size_t len, uint32_t hash) {
+    if (!slots) {
+        return NULL;
+    }
+    for (size_t i = hash & slots->mask;; i = (i + 1) & slots->mask) {
+        Topic *topic = atomic_load_explicit(&slots->items[i], memory_order_acquire);
+        if (!topic) {
+            return NULL;
+        }
+        if (topic->hash == hash && topic->name_len == len && memcmp(topic->name, name, len) == 0) {
+            return topic;
+        }
+    }
+}
+
+/* Helper function. Not in `topics.h`
+ * Bytes allocated for `topic`, its levels included. */
+static size_t topic_bytes(const Topic *topic) {
+    return (size_t)((const char*)(topic->level_hashes + topic->level_count) - (const char*)topic);
+}
+
+/* Helper function. Not in `topics.h`
+ * Called with `names_lock` taken. */
+static void place_name(TopicSlots *slots, Topic *topic) {
+    size_t i = topic->hash & slots->mask;
+    while (atomic_load_explicit(&slots->items[i], memory_order_relaxed)) {
+        i = (i + 1) & slots->mask;
+    }
+    atomic_store_explicit(&slots->items[i], topic, memory_order_release);
+}
+
+/* Helper function. Not in `topics.h`
+ * Called with `names_lock` taken. */
+static TopicSlots *grow_names(TopicSlots *old) {
+    size_t count = old ? (old->mask + 1) * 2 : INITIAL_BUCKETS;
+    TopicSlots *slots = (TopicSlots*)calloc(1, sizeof(TopicSlots) + count * sizeof(Topic*));
+    if (!slots) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+    slots->previous = old;
+    slots->mask = count - 1;
+    for (size_t i = 0; old && i <= old->mask; i++) {
+        Topic *topic = atomic_load_explicit(&old->items[i], memory_order_relaxed);
+        if (topic) {
+            place_name(slots, topic);
+        }
+    }
+    atomic_store_explicit(&names, slots, memory_order_release);
+    return slots;
+}
+
+Topic *topic_intern(const char *name, size_t len) {
+    uint32_t hash = topic_hash(name, len);
+    Topic *topic = find_name(atomic_load_explicit(&names, memory_order_acquire), name, len, hash);
+    if (topic) {
+        return topic;
+    }
+
+    /* Not seen yet, or added by another thread after the lookup */
+    pthread_mutex_lock(&names_lock);
+    TopicSlots *slots = atomic_load_explicit(&names, memory_order_relaxed);
+    topic = find_name(slots, name, len, hash);
+    if (!topic) {
+        topic = new_topic(name, len, hash);
+        size_t count = atomic_load_explicit(&interned, memory_order_relaxed);
+        size_t bytes = topic_bytes(topic);
+        /* a few long names can't take all the memory */
+        if (count < TOPIC_INTERN_MAX && interned_bytes + bytes <= TOPIC_INTERN_BYTES) {
+            topic->id = count;
+            /* kept at most half full */
+            if (!slots || (count + 1) * 2 > slots->mask + 1) {
+                slots = grow_names(slots);
+            }
+            place_name(slots, topic);
+            interned_bytes += bytes;
+            atomic_store_explicit(&interned, count + 1, memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&names_lock);
+    return topic;
+}
+
+Topic *topic_lookup(const char *name, size_t len) {
+    uint32_t hash = topic_hash(name, len);
+    Topic *topic = find_name(atomic_load_explicit(&names, memory_order_acquire), name, len, hash);
+    return topic ? topic : new_topic(name, len, hash);
+}
+
+void topic_done(Topic *topic) {
+    if (topic->id == TOPIC_TRANSIENT) {
+        free(topic);
+    }
+}
+
+size_t topic_interned_count(void) {
+    return atomic_load_explicit(&interned, memory_order_relaxed);
+}
+
+/* === Subscriber lists === */
+
+/* Helper function. Not in `topics.h` */
+static size_t id_slot(long long int id, size_t mask) {
+    return (size_t)(((uint64_t)id * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+}
+
+/* Helper function. Not in `topics.h`
+ * Position of `id` in the list, or `list->count` if it isn't there. */
+static size_t find_subscriber(const SubscriberList *list, long long int id) {
+    if (!list->slots) {
+        size_t i = 0;
+        while (i < list->count && list->items[i].id != id) { i++; }
+        return i;
+    }
+    for (size_t i = id_slot(id, list->slot_mask);; i = (i + 1) & list->slot_mask) {
+        uint32_t at = list->slots[i];
+        if (at == 0) {
+            return list->count;
+        }
+        if (list->items[at - 1].id == id) {
+            return at - 1;
+        }
+    }
+}
+
+/* Helper function. Not in `topics.h` */
+static void place_subscriber(SubscriberList *list, size_t at) {
+    size_t i = id_slot(list->items[at].id, list->slot_mask);
+    while (list->slots[i]) {
+        i = (i + 1) & list->slot_mask;
+    }
+    list->slots[i] = (uint32_t)(at + 1);
+}
+
+/* Helper function. Not in `topics.h`
+ * Builds the slots again for `size` of them, kept at most half full. */
+static void index_subscribers(SubscriberList *list, size_t size) {
+    free(list->slots);
+    list->slots = (uint32_t*)calloc(size, sizeof(uint32_t));
+    if (!list->slots) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+    list->slot_mask = size - 1;
+    for (size_t at = 0; at < list->count; at++) {
+        place_subscriber(list, at);
+    }
+}
+
+/* Helper function. Not in `topics.h`
+ * Empties the slot pointing to `at`, moving back the ones after it that
+ * would no longer be found. */
+static void unplace_subscriber(SubscriberList *list, size_t at) {
+    size_t hole = id_slot(list->items[at].id, list->slot_mask);
+    while (list->slots[hole] != at + 1) {
+        hole = (hole + 1) & list->slot_mask;
+    }
+    for (size_t i = (hole + 1) & list->slot_mask; list->slots[i]; i = (i + 1) & list->slot_mask) {
+        size_t home = id_slot(list->items[list->slots[i] - 1].id, list->slot_mask);
+        /* stays if its home is cyclically in (hole, i] */
+        if (((i - home) & list->slot_mask) < ((i - hole) & list->slot_mask)) {
+            continue;
+        }
+        list->slots[hole] = list->slots[i];
+        hole = i;
+    }
+    list->slots[hole] = 0;
+}
+
+/* Helper function. Not in `topics.h`
+ * Points the slot of the subscriber at `from` to `to`. */
+static void move_subscriber(SubscriberList *list, size_t from, size_t to) {
+    size_t i = id_slot(list->items[from].id, list->slot_mask);
+    while (list->slots[i] != from + 1) {
+        i = (i + 1) & list->slot_mask;
+    }
+    list->slots[i] = (uint32_t)(to + 1);
+}
+
+int subscribers_add(SubscriberList *list, Subscriber sub) {
+    if (find_subscriber(list, sub.id) < list->count) {
+        return 0;
+    }
+
+    if (list->count == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 4;
+        list->items = (Subscriber*)realloc(list->items, list->cap * sizeof(Subscriber));
+        if (!list->items) {
+            fprintf(stderr, "[Memory error, stopping]\n");
+            exit(ERROR_SERVER);
+        }
+    }
+    list->items[list->count++] = sub;
+    if (list->slots && list->count * 2 <= list->slot_mask + 1) {
+        place_subscriber(list, list->count - 1);
+    } else if (list->slots || list->count >= SUBSCRIBERS_INDEXED) {
+        index_subscribers(list, list->slots ? (list->slot_mask + 1) * 2 : SUBSCRIBERS_INDEXED * 4);
+    }
+    return 1;
+}
+
+int subscribers_remove(SubscriberList *list, Subscriber sub) {
+    size_t at = find_subscriber(list, sub.id);
+    if (at == list->count) {
+        return 0;
+    }
+    size_t last = list->count - 1;
+    if (list->slots) {
+        unplace_subscriber(list, at);
+        if (at != last) {
+            move_subscriber(list, last, at);
+        }
+    }
+    /* order of subscribers doesn't matter */
+    list->items[at] = list->items[last];
+    list->count = last;
+    if (list->slots && list->count < SUBSCRIBERS_INDEXED / 2) {
+        free(list->slots);
+        list->slots = NULL;
+        list->slot_mask = 0;
+    }
+    return 1;
+}
+
+void subscribers_free(SubscriberList *list) {
+    free(list->items);
+    free(list->slots);
+    list->items = NULL;
+    list->slots = NULL;
+    list->count = 0;
+    list->cap = 0;
+    list->slot_mask = 0;
+}
+
+/* Helper function. Not in `topics.h`
+ * Appends without looking for repeated subscribers. */
+static void append_all(SubscriberList *out, const SubscriberList *from) {
+    if (from->count == 0) {
+        return;
+    }
+    if (out->count + from->count > out->cap) {
+        size_t new_cap = out->cap ? out->cap : 16;
+        while (new_cap < out->count + from->count) { new_cap *= 2; }
+        out->items = (Subscriber*)realloc(out->items, new_cap * sizeof(Subscriber));
+        if (!out->items) {
+            fprintf(stderr, "[Memory error, stopping]\n");
+            exit(ERROR_SERVER);
+        }
+        out->cap = new_cap;
+    }
+    memcpy(out->items + out->count, from->items, from->count * sizeof(Subscriber));
+    out->count += from->count;
+}
+
+/* Helper function. Not in `topics.h` */
+static int compare_ids(const void *a, const void *b) {
+    long long int x = ((const Subscriber*)a)->id, y = ((const Subscriber*)b)->id;
+    return (x > y) - (x < y);
+}
+
+/* Helper function. Not in `topics.h`
+ * A connection matching several filters gets a single copy. */
+static void remove_repeated(SubscriberList *list) {
+    if (list->count < 2) {
+        return;
+    }
+    qsort(list->items, list->count, sizeof(Subscriber), compare_ids);
+    size_t kept = 1;
+    for (size_t i = 1; i < list->count; i++) {
+        if (list->items[i].id != list->items[kept - 1].id) {
+            list->items[kept++] = list->items[i];
+        }
+    }
+    list->count = kept;
+}
+
+/* === Exact topics === */
+
+void topics_init(TopicTable *table) {
+    table->bucket_count = INITIAL_BUCKETS;
+    table->entry_count = 0;
+    table->by_id = NULL;
+    table->by_id_cap = 0;
+    table->buckets = (TopicEntry**)calloc(table->bucket_count, sizeof(TopicEntry*));
+    if (!table->buckets) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+}
+
+/* Helper function. Not in `topics.h` */
+static void grow(TopicTable *table) {
+    size_t new_count = table->bucket_count * 2;
+    TopicEntry **buckets = (TopicEntry**)calloc(new_count, sizeof(TopicEntry*));
+    if (!buckets) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+
+    for (size_t i = 0; i < table->bucket_count; i++) {
+        TopicEntry *entry = table->buckets[i];
+        while (entry) {
+            TopicEntry *next = entry->next;
+            entry->next = buckets[entry->hash & (new_count - 1)];
+            buckets[entry->hash & (new_count - 1)] = entry;
+            entry = next;
+        }
+    }
+
+    free(table->buckets);
+    table->buckets = buckets;
+    table->bucket_count = new_count;
+}
+
+/* Helper function. Not in `topics.h`
+ * Returns the link pointing to the topic's entry, or to the end of its bucket. */
+static TopicEntry **find_link(TopicTable *table, const char *name, size_t len, uint32_t hash) {
+    TopicEntry **link = &table->buckets[hash & (table->bucket_count - 1)];
+    while (*link) {
+        TopicEntry *entry = *link;
+        if (entry->hash == hash && entry->name_len == len && memcmp(entry->name, name, len) == 0) {
+            break;
+        }
+        link = &entry->next;
+    }
+    return link;
+}
+
+int topics_add(TopicTable *table, const char *name, size_t len, Subscriber sub) {
+    uint32_t hash = topic_hash(name, len);
+    TopicEntry **link = find_link(table, name, len, hash);
+    TopicEntry *entry = *link;
+
+    if (!entry) {
+        entry = (TopicEntry*)calloc(1, sizeof(TopicEntry) + len + 1);
+        if (!entry) {
+            fprintf(stderr, "[Memory error, stopping]\n");
+            exit(ERROR_SERVER);
+        }
+        entry->hash = hash;
+        entry->name_len = len;
+        memcpy(entry->name, name, len);
+        *link = entry;
+
+        Topic *topic = topic_intern(name, len);
+        entry->id = topic->id;
+        topic_done(topic);
+        if (entry->id != TOPIC_TRANSIENT) {
+            if (entry->id >= table->by_id_cap) {
+                size_t new_cap = table->by_id_cap ? table->by_id_cap : INITIAL_BUCKETS;
+                while (new_cap <= entry->id) { new_cap *= 2; }
+                table->by_id = (TopicEntry**)realloc(table->by_id, new_cap * sizeof(TopicEntry*));
+                if (!table->by_id) {
+                    fprintf(stderr, "[Memory error, stopping]\n");
+                    exit(ERROR_SERVER);
+                }
+                memset(table->by_id + table->by_id_cap, 0, (new_cap - table->by_id_cap) * sizeof(TopicEntry*));
+                table->by_id_cap = new_cap;
+            }
+            table->by_id[entry->id] = entry;
+        }
+
+        if (++table->entry_count > table->bucket_count) {
+            grow(table);
+        }
+    }
+
+    return subscribers_add(&entry->subs, sub);
+}
+
+int topics_remove(TopicTable *table, const char *name, size_t len, Subscriber sub) {
+    TopicEntry **link = find_link(table, name, len, topic_hash(name, len));
+    TopicEntry *entry = *link;
+    if (!entry) {
+        return 0;
+    }
+
+    if (!subscribers_remove(&entry->subs, sub)) {
+        return 0;
+    }
+    if (entry->subs.count == 0) {
+        *link = entry->next;
+        if (entry->id != TOPIC_TRANSIENT) {
+            table->by_id[entry->id] = NULL;
+        }
+        subscribers_free(&entry->subs);
+        free(entry);
+        table->entry_count--;
+    }
+    return 1;
+}
+
+TopicEntry *topics_find(TopicTable *table, const char *name, size_t len) {
+    return *find_link(table, name, len, topic_hash(name, len));
+}
+
+TopicEntry *topics_find_topic(TopicTable *table, const Topic *topic) {
+    if (topic->id != TOPIC_TRANSIENT) {
+        return topic->id < table->by_id_cap ? table->by_id[topic->id] : NULL;
+    }
+    /* Not interned when it was looked up, its entry is found by name */
+    return *find_link(table, topic->name, topic->name_len, topic->hash);
+}
+
+/* === Filters with wildcards === */
+
+/* Helper function. Not in `topics.h`
+ * Nodes are hashed by their level name and their parent. */
+static uint32_t level_hash(const FilterNode *parent, uint32_t name_hash) {
+    uintptr_t p = (uintptr_t)parent;
+    return name_hash ^ (uint32_t)(p >> 4) ^ (uint32_t)(p >> 36);
+}
+
+/* Helper function. Not in `topics.h` */
+static FilterNode *new_node(FilterNode *parent, const char *level, size_t len, uint32_t hash) {
+    FilterNode *node = (FilterNode*)calloc(1, sizeof(FilterNode) + len);
+    if (!node) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+    node->parent = parent;
+    node->hash = hash;
+    node->level_len = len;
+    memcpy(node->level, level, len);
+    return node;
+}
+
+void filters_init(FilterTrie *trie) {
+    trie->root = new_node(NULL, "", 0, 0);
+    trie->node_count = 0;
+    trie->bucket_count = INITIAL_BUCKETS;
+    trie->buckets = (FilterNode**)calloc(trie->bucket_count, sizeof(FilterNode*));
+    if (!trie->buckets) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+}
+
+/* Helper function. Not in `topics.h` */
+static void grow_trie(FilterTrie *trie) {
+    size_t new_count = trie->bucket_count * 2;
+    FilterNode **buckets = (FilterNode**)calloc(new_count, sizeof(FilterNode*));
+    if (!buckets) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+
+    for (size_t i = 0; i < trie->bucket_count; i++) {
+        FilterNode *node = trie->buckets[i];
+        while (node) {
+            FilterNode *next = node->next;
+            node->next = buckets[node->hash & (new_count - 1)];
+            buckets[node->hash & (new_count - 1)] = node;
+            node = next;
+        }
+    }
+
+    free(trie->buckets);
+    trie->buckets = buckets;
+    trie->bucket_count = new_count;
+}
+
+/* Helper function. Not in `topics.h`
+ * `name_hash` is the `topic_hash` of the level. */
+static FilterNode *find_child(FilterTrie *trie, FilterNode *parent, const char *level, size_t len,
+                              uint32_t name_hash) {
+    uint32_t hash = level_hash(parent, name_hash);
+    FilterNode *node = trie->buckets[hash & (trie->bucket_count - 1)];
+    while (node) {
+        if (node->hash == hash && node->parent == parent && node->level_len == len
+                && memcmp(node->level, level, len) == 0) {
+            return node;
+        }
+        node = node->next;
+    }
+    return NULL;
+}
+
+/* Helper function. Not in `topics.h` */
+static FilterNode *add_child(FilterTrie *trie, FilterNode *parent, const char *level, size_t len) {
+    uint32_t name_hash = topic_hash(level, len);
+    FilterNode *node = find_child(trie, parent, level, len, name_hash);
+    if (node) {
+        return node;
+    }
+
+    uint32_t hash = level_hash(parent, name_hash);
+    node = new_node(parent, level, len, hash);
+    node->next = trie->buckets[hash & (trie->bucket_count - 1)];
+    trie->buckets[hash & (trie->bucket_count - 1)] = node;
+    parent->children++;
+    if (len == 1 && level[0] == '+') {
+        parent->plus = node;
+    }
+
+    if (++trie->node_count > trie->bucket_count) {
+        grow_trie(trie);
+    }
+    return node;
+}
+
+/* Helper function. Not in `topics.h`
+ * Frees nodes left without subscribers nor children, up to the root. */
+static void prune(FilterTrie *trie, FilterNode *node) {
+    while (node != trie->root && node->children == 0 && node->subs.count == 0 && node->rest.count == 0) {
+        FilterNode **link = &trie->buckets[node->hash & (trie->bucket_count - 1)];
+        while (*link != node) { link = &(*link)->next; }
+        *link = node->next;
+
+        FilterNode *parent = node->parent;
+        parent->children--;
+        if (parent->plus == node) {
+            parent->plus = NULL;
+        }
+        subscribers_free(&node->subs);
+        subscribers_free(&node->rest);
+        free(node);
+        trie->node_count--;
+        node = parent;
+    }
+}
+
+/* Helper function. Not in `topics.h`
+ * Walks the levels of `filter`, creating them if `create` is set. Returns
+ * the list the filter's subscribers go in, or NULL. */
+static SubscriberList *filter_list(FilterTrie *trie, const char *filter, size_t len,
+                                   int create, FilterNode **last) {
+    FilterNode *node = trie->root;
+    size_t pos = 0;
+    for (;;) {
+        size_t end = pos;
+        while (end < len && filter[end] != '/') { end++; }
+
+        if (end - pos == 1 && filter[pos] == '#') {
+            *last = node;
+            return &node->rest;
+        }
+
+        node = create
+            ? add_child(trie, node, filter + pos, end - pos)
+            : find_child(trie, node, filter + pos, end - pos, topic_hash(filter + pos, end - pos));
+        if (!node) {
+            return NULL;
+        }
+        if (end == len) {
+            *last = node;
+            return &node->subs;
+        }
+        pos = end + 1;
+    }
+}
+
+int filters_add(FilterTrie *trie, const char *filter, size_t len, Subscriber sub) {
+    FilterNode *last;
+    return subscribers_add(filter_list(trie, filter, len, 1, &last), sub);
+}
+
+int filters_remove(FilterTrie *trie, const char *filter, size_t len, Subscriber sub) {
+    FilterNode *last;
+    SubscriberList *list = filter_list(trie, filter, len, 0, &last);
+    if (!list || !subscribers_remove(list, sub)) {
+        return 0;
+    }
+    prune(trie, last);
+    return 1;
+}
+
+/* Helper function. Not in `topics.h`
+ * Only the level with index `level` of `topic` on isn't matched by `node`
+ * yet. */
+static void match_from(FilterTrie *trie, FilterNode *node, const Topic *topic, size_t level,
+                       SubscriberList *out) {
+    /* "a/#" matches "a" and anything under it */
+    append_all(out, &node->rest);
+    if (level == topic->level_count) {
+        append_all(out, &node->subs);
+        return;
+    }
+    if (node->children == 0) {
+        return;
+    }
+
+    size_t start = level == 0 ? 0 : topic->level_ends[level - 1] + 1;
+    FilterNode *child = find_child(trie, node, topic->name + start, topic->level_ends[level] - start,
+                                   topic->level_hashes[level]);
+    if (child) {
+        match_from(trie, child, topic, level + 1, out);
+    }
+    if (node->plus) {
+        match_from(trie, node->plus, topic, level + 1, out);
+    }
+}
+
+void filters_match(FilterTrie *trie, const Topic *topic, SubscriberList *out) {
+    FilterNode *root = trie->root;
+
+    /* topics starting with `$` aren't matched by a leading wildcard */
+    if (topic->name_len > 0 && topic->name[0] == '$') {
+        FilterNode *child = find_child(trie, root, topic->name, topic->level_ends[0],
+                                       topic->level_hashes[0]);
+        if (child) {
+            match_from(trie, child, topic, 1, out);
+        }
+        return;
+    }
+    match_from(trie, root, topic, 0, out);
+}
+
+/* === Both together === */
+
+void topic_index_init(TopicIndex *index) {
+    topics_init(&index->exact);
+    filters_init(&index->wildcards);
+    index->wildcard_count = 0;
+    index->groups = NULL;
+    index->group_cap = 0;
+    index->group_count = 0;
+
+    index->cache = (_Atomic(CachedMatch*)*)calloc(MATCH_CACHE_SLOTS, sizeof(*index->cache));
+    index->candidates = (_Atomic uint32_t*)calloc(MATCH_CACHE_SLOTS, sizeof(*index->candidates));
+    if (!index->cache || !index->candidates) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+    atomic_init(&index->generation, 0);
+    atomic_init(&index->retired, NULL);
+    atomic_init(&index->retired_count, 0);
+    atomic_init(&index->unmatched, 0);
+    atomic_init(&index->cache_hits, 0);
+    atomic_init(&index->cache_misses, 0);
+}
+
+size_t topic_index_retired(TopicIndex *index) {
+    return atomic_load_explicit(&index->retired_count, memory_order_relaxed);
+}
+
+void topic_index_reclaim(TopicIndex *index) {
+    CachedMatch *match = atomic_exchange_explicit(&index->retired, NULL, memory_order_acquire);
+    atomic_store_explicit(&index->retired_count, 0, memory_order_relaxed);
+    while (match) {
+        CachedMatch *next = match->next;
+        free(match);
+        match = next;
+    }
+}
+
+/* Helper function. Not in `topics.h`
+ * Called on every change to the index, which no thread is matching in. */
+static void invalidate_matches(TopicIndex *index) {
+    atomic_fetch_add_explicit(&index->generation, 1, memory_order_relaxed);
+    topic_index_reclaim(index);
+}
+
+/* Helper function. Not in `topics.h`
+ * Same as `topic_index_add`, for filters that aren't shared. */
+static int add_unshared(TopicIndex *index, const char *filter, size_t len, Subscriber sub) {
+    if (!topic_has_wildcards(filter, len)) {
+        return topics_add(&index->exact, filter, len, sub);
+    }
+    int added = filters_add(&index->wildcards, filter, len, sub);
+    index->wildcard_count += added;
+    return added;
+}
+
+/* Helper function. Not in `topics.h` */
+static int remove_unshared(TopicIndex *index, const char *filter, size_t len, Subscriber sub) {
+    if (!topic_has_wildcards(filter, len)) {
+        return topics_remove(&index->exact, filter, len, sub);
+    }
+    int removed = filters_remove(&index->wildcards, filter, len, sub);
+    index->wildcard_count -= removed;
+    return removed;
+}
+
+/* Helper function. Not in `topics.h`
+ * The subscriber standing for the group in slot `slot` */
+static Subscriber group_marker(size_t slot) {
+    Subscriber marker = { .shard = 0, .fd = -1, .id = -(long long int)slot - 1 };
+    return marker;
+}
+
+/* Helper function. Not in `topics.h`
+ * Returns the slot of the group named `name`, or `index->group_cap`.
+ * There are few groups, each shared by many connections. */
+static size_t find_group(TopicIndex *index, const char *name, size_t len) {
+    for (size_t i = 0; i < index->group_cap; i++) {
+        SharedGroup *group = index->groups[i];
+        if (group && group->name_len == len && memcmp(group->name, name, len) == 0) {
+            return i;
+        }
+    }
+    return index->group_cap;
+}
+
+/* Helper function. Not in `topics.h` */
+static int add_shared(TopicIndex *index, const char *name, size_t len, size_t prefix, Subscriber sub) {
+    size_t slot = find_group(index, name, len);
+    if (slot == index->group_cap) {
+        /* take the first free slot, there is one past the last group */
+        for (slot = 0; slot < index->group_cap && index->groups[slot]; slot++) { }
+        if (slot == index->group_cap) {
+            size_t new_cap = index->group_cap ? index->group_cap * 2 : 4;
+            index->groups = (SharedGroup**)realloc(index->groups, new_cap * sizeof(SharedGroup*));
+            if (!index->groups) {
+                fprintf(stderr, "[Memory error, stopping]\n");
+                exit(ERROR_SERVER);
+            }
+            memset(index->groups + index->group_cap, 0, (new_cap - index->group_cap) * sizeof(SharedGroup*));
+            index->group_cap = new_cap;
+        }
+
+        SharedGroup *group = (SharedGroup*)calloc(1, sizeof(SharedGroup) + len + 1);
+        if (!group) {
+            fprintf(stderr, "[Memory error, stopping]\n");
+            exit(ERROR_SERVER);
+        }
+        atomic_init(&group->turn, 0);
+        group->prefix_len = prefix;
+        group->name_len = len;
+        memcpy(group->name, name, len);
+        index->groups[slot] = group;
+        index->group_count++;
+
+        add_unshared(index, name + prefix, len - prefix, group_marker(slot));
+    }
+    return subscribers_add(&index->groups[slot]->members, sub);
+}
+
+/* Helper function. Not in `topics.h`
+ * The group goes away with its last member. */
+static int remove_shared(TopicIndex *index, const char *name, size_t len, size_t prefix, Subscriber sub) {
+    size_t slot = find_group(index, name, len);
+    if (slot == index->group_cap) {
+        return 0;
+    }
+    SharedGroup *group = index->groups[slot];
+    if (!subscribers_remove(&group->members, sub)) {
+        return 0;
+    }
+
+    if (group->members.count == 0) {
+        remove_unshared(index, name + prefix, len - prefix, group_marker(slot));
+        subscribers_free(&group->members);
+        free(group);
+        index->groups[slot] = NULL;
+        index->group_count--;
+    }
+    return 1;
+}
+
+int topic_index_add(TopicIndex *index, const char *filter, size_t len, Subscriber sub) {
+    invalidate_matches(index);
+    size_t prefix = topic_share_prefix(filter, len);
+    if (prefix > 0) {
+        return add_shared(index, filter, len, prefix, sub);
+    }
+    return add_unshared(index, filter, len, sub);
+}
+
+int topic_index_remove(TopicIndex *index, const char *filter, size_t len, Subscriber sub) {
+    invalidate_matches(index);
+    size_t prefix = topic_share_prefix(filter, len);
+    if (prefix > 0) {
+        return remove_shared(index, filter, len, prefix, sub);
+    }
+    return remove_unshared(index, filter, len, sub);
+}
+
+/* Helper function. Not in `topics.h`
+ * Replaces each group's marker by the member whose turn it is. */
+static void pick_members(TopicIndex *index, SubscriberList *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        if (list->items[i].id >= 0) {
+            continue;
+        }
+        SharedGroup *group = index->groups[-(list->items[i].id + 1)];
+        size_t turn = atomic_fetch_add_explicit(&group->turn, 1, memory_order_relaxed);
+        list->items[i] = group->members.items[turn % group->members.count];
+    }
+}
+
+/* Helper function. Not in `topics.h`
+ * Tells if any subscription may match the topic `name`, only looking at its
+ * exact entry and at the first level of the filters. Shared subscriptions
+ * are in either, as their group's marker. */
+static int may_match(TopicIndex *index, const char *name, size_t len, const TopicEntry *entry) {
+    if (entry) {
+        return 1;
+    }
+    if (index->wildcard_count == 0) {
+        return 0;
+    }
+    FilterNode *root = index->wildcards.root;
+    /* topics starting with `$` aren't matched by a leading wildcard */
+    if ((len == 0 || name[0] != '$') && (root->plus || root->rest.count > 0)) {
+        return 1;
+    }
+    const char *slash = (const char*)memchr(name, '/', len);
+    size_t first_len = slash ? (size_t)(slash - name) : len;
+    return find_child(&index->wildcards, root, name, first_len, topic_hash(name, first_len)) != NULL;
+}
+
+int topic_index_may_match(TopicIndex *index, const char *name, size_t len) {
+    if (may_match(index, name, len, topics_find(&index->exact, name, len))) {
+        return 1;
+    }
+    atomic_fetch_add_explicit(&index->unmatched, 1, memory_order_relaxed);
+    return 0;
+}
+
+/* Helper function. Not in `topics.h`
+ * Subscribers of a match, cached or not. Markers of shared groups are
+ * replaced in `scratch`, leaving the match as it was. */
+static const SubscriberList *use_match(TopicIndex *index, const SubscriberList *subs, int shared,
+                                       SubscriberList *scratch) {
+    if (subs->count == 0) {
+        return NULL;
+    }
+    if (!shared) {
+        return subs;
+    }
+    if (subs != scratch) {
+        scratch->count = 0;
+        append_all(scratch, subs);
+    }
+    /* A member also subscribed on its own gets both copies, as they are
+     * different subscriptions */
+    pick_members(index, scratch);
+    return scratch;
+}
+
+/* Helper function. Not in `topics.h`
+ * Puts the match of `topic` in `scratch` in its cache slot. A slot that
+ * holds a match of another topic is only given to a topic that missed in it
+ * twice in a row, so topics published once don't push out the ones
+ * published all the time. The match may be used by other threads right
+ * away. */
+static const CachedMatch *cache_match(TopicIndex *index, const Topic *topic, unsigned long generation,
+                                      const SubscriberList *scratch, int shared) {
+    size_t i = topic->hash & (MATCH_CACHE_SLOTS - 1);
+    _Atomic(CachedMatch*) *slot = &index->cache[i];
+    CachedMatch *old = atomic_load_explicit(slot, memory_order_acquire);
+    if (old && old->generation == generation
+            && atomic_exchange_explicit(&index->candidates[i], topic->hash, memory_order_relaxed) != topic->hash) {
+        return NULL;
+    }
+
+    size_t items_size = scratch->count * sizeof(Subscriber);
+    CachedMatch *match = (CachedMatch*)malloc(sizeof(CachedMatch) + items_size + topic->name_len);
+    if (!match) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+    match->hash = topic->hash;
+    match->name_len = topic->name_len;
+    char *name = (char*)match->items + items_size;
+    memcpy(name, topic->name, topic->name_len);
+    match->name = name;
+    match->generation = generation;
+    match->shared = shared;
+    memcpy(match->items, scratch->items, scratch->count * sizeof(Subscriber));
+    match->subs.items = match->items;
+    match->subs.count = scratch->count;
+    match->subs.cap = scratch->count;
+    match->subs.slots = NULL;
+    match->subs.slot_mask = 0;
+
+    if (!atomic_compare_exchange_strong_explicit(slot, &old, match, memory_order_acq_rel,
+                                                 memory_order_acquire)) {
+        /* another thread cached something first */
+        free(match);
+        return NULL;
+    }
+    if (old) {
+        /* other threads may still be reading it */
+        CachedMatch *head = atomic_load_explicit(&index->retired, memory_order_relaxed);
+        do {
+            old->next = head;
+        } while (!atomic_compare_exchange_weak_explicit(
+            &index->retired, &head, old, memory_order_release, memory_order_relaxed
+        ));
+        atomic_fetch_add_explicit(&index->retired_count, 1, memory_order_relaxed);
+    }
+    return match;
+}
+
+const SubscriberList *topic_index_match(TopicIndex *index, const Topic *topic,
+                                        SubscriberList *scratch) {
+    TopicEntry *entry = topics_find_topic(&index->exact, topic);
+    if (!may_match(index, topic->name, topic->name_len, entry)) {
+        atomic_fetch_add_explicit(&index->unmatched, 1, memory_order_relaxed);
+        return NULL;
+    }
+    if (index->wildcard_count == 0 && index->group_count == 0) {
+        return entry ? &entry->subs : NULL;
+    }
+
+    /* Subscribers found in the filters, only matched again after a change */
+    int shared = index->group_count > 0;
+    unsigned long generation = atomic_load_explicit(&index->generation, memory_order_relaxed);
+    int cached = topic->name_len <= MATCH_CACHE_NAME_MAX;
+    if (cached) {
+        CachedMatch *match = atomic_load_explicit(
+            &index->cache[topic->hash & (MATCH_CACHE_SLOTS - 1)], memory_order_acquire
+        );
+        if (match && match->generation == generation && match->hash == topic->hash
+                && match->name_len == topic->name_len
+                && memcmp(match->name, topic->name, topic->name_len) == 0) {
+            atomic_fetch_add_explicit(&index->cache_hits, 1, memory_order_relaxed);
+            return use_match(index, &match->subs, match->shared, scratch);
+        }
+    }
+    atomic_fetch_add_explicit(&index->cache_misses, 1, memory_order_relaxed);
+
+    scratch->count = 0;
+    if (index->wildcard_count > 0) {
+        filters_match(&index->wildcards, topic, scratch);
+    }
+    if (entry) {
+        append_all(scratch, &entry->subs);
+    }
+    remove_repeated(scratch);
+
+    if (cached) {
+        const CachedMatch *match = cache_match(index, topic, generation, scratch, shared);
+        if (match) {
+            return use_match(index, &match->subs, shared, scratch);
+        }
+    }
+    return use_match(index, scratch, shared, scratch);
+}
+
+MatchStats topic_index_stats(TopicIndex *index) {
+    MatchStats stats = {
+        .unmatched = atomic_load_explicit(&index->unmatched, memory_order_relaxed),
+        .cache_hits = atomic_load_explicit(&index->cache_hits, memory_order_relaxed),
+        .cache_misses = atomic_load_explicit(&index->cache_misses, memory_order_relaxed),
+    };
+    return stats;
+}
+
+/* === Shared index === */
+
+/* Slot of this thread in the `readers` of any SharedIndex */
+static _Atomic size_t reader_slots = 0;
+static __thread size_t reader_slot = SHARED_INDEX_READERS;
+
+void shared_index_init(SharedIndex *shared) {
+    topic_index_init(&shared->copies[0]);
+    topic_index_init(&shared->copies[1]);
+    atomic_init(&shared->active, 0);
+    pthread_mutex_init(&shared->write_lock, NULL);
+    for (size_t i = 0; i < SHARED_INDEX_READERS; i++) {
+        atomic_init(&shared->readers[i].reading, 0);
+    }
+}
+
+TopicIndex *shared_index_read(SharedIndex *shared) {
+    if (reader_slot == SHARED_INDEX_READERS) {
+        reader_slot = atomic_fetch_add(&reader_slots, 1);
+        if (reader_slot >= SHARED_INDEX_READERS) {
+            fprintf(stderr, "[ERROR: More than %d threads reading subscriptions]\n", SHARED_INDEX_READERS);
+            exit(ERROR_SERVER);
+        }
+    }
+
+    /* Tell which copy this thread reads, then check that it's still the
+     * active one. A writer switching copies in between sees this thread in
+     * the old one and waits for it; one switching after it is seen here. */
+    unsigned copy = atomic_load(&shared->active);
+    for (;;) {
+        atomic_store(&shared->readers[reader_slot].reading, copy + 1);
+        unsigned now = atomic_load(&shared->active);
+        if (now == copy) {
+            return &shared->copies[copy];
+        }
+        copy = now;
+    }
+}
+
+void shared_index_done(SharedIndex *shared) {
+    atomic_store_explicit(&shared->readers[reader_slot].reading, 0, memory_order_release);
+}
+
+void shared_index_write(SharedIndex *shared, IndexChange change, void *arg) {
+    pthread_mutex_lock(&shared->write_lock);
+    unsigned old = atomic_load(&shared->active);
+
+    /* Nobody reads the other copy since the last change */
+    change(&shared->copies[1 - old], arg);
+    atomic_store(&shared->active, 1 - old);
+
+    size_t readers = atomic_load(&reader_slots);
+    readers = readers < SHARED_INDEX_READERS ? readers : SHARED_INDEX_READERS;
+    for (size_t i = 0; i < readers; i++) {
+        while (atomic_load(&shared->readers[i].reading) == old + 1) {
+            sched_yield();
+        }
+    }
+    change(&shared->copies[old], arg);
+    pthread_mutex_unlock(&shared->write_lock);
+}
+
+MatchStats shared_index_stats(SharedIndex *shared) {
+    MatchStats total = { 0 };
+    for (int i = 0; i < 2; i++) {
+        MatchStats stats = topic_index_stats(&shared->copies[i]);
+        total.unmatched += stats.unmatched;
+        total.cache_hits += stats.cache_hits;
+        total.cache_misses += stats.cache_misses;
+    }
+    return total;
+}
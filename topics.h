@@ -0,0 +1,279 @@
+#ifndef TOPICS_H
+#define TOPICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/* A subscribed connection. `shard` is the reactor the connection lives in,
+ * `id` tells it apart from a later connection reusing the same fd. `conn`
+ * is only set in threads mode, where any thread queues output for it. */
+typedef struct Subscriber {
+    size_t shard;
+    int fd;
+    long long int id;
+    struct Connection *conn;
+} Subscriber;
+
+/* Once a list reaches SUBSCRIBERS_INDEXED subscribers, `slots` finds their
+ * position by id (plus one, 0 is empty), so adding and removing don't scan
+ * the list. Shorter lists, and the ones built by a match, have no slots. */
+#define SUBSCRIBERS_INDEXED 32
+
+typedef struct SubscriberList {
+    Subscriber *items;
+    size_t count;
+    size_t cap;
+    uint32_t *slots;
+    size_t slot_mask;
+} SubscriberList;
+
+/* Topics get a stable id when they are subscribed, up to TOPIC_INTERN_MAX
+ * of them taking TOPIC_INTERN_BYTES in total. A PUBLISH only looks its
+ * topic up: one that isn't interned is split for that PUBLISH alone. */
+#define TOPIC_INTERN_MAX (1 << 18)
+#define TOPIC_INTERN_BYTES (64 * 1024 * 1024)
+/* Id of a topic that isn't interned */
+#define TOPIC_TRANSIENT UINT32_MAX
+
+/* A topic name, split into levels once, when it's interned. Interned topics
+ * are shared by every thread and never freed. */
+typedef struct Topic {
+    uint32_t id;
+    uint32_t hash;
+    size_t level_count;
+    /* hash of each level, and where it ends in `name` */
+    uint32_t *level_hashes;
+    size_t *level_ends;
+    size_t name_len;
+    char name[];
+} Topic;
+
+typedef struct TopicEntry {
+    struct TopicEntry *next;
+    uint32_t hash;
+    /* of the topic, or TOPIC_TRANSIENT */
+    uint32_t id;
+    SubscriberList subs;
+    size_t name_len;
+    char name[];
+} TopicEntry;
+
+/* Subscribers of each topic, in a chained hash table.
+ * Not thread safe: a table belongs to the single reactor that owns its topics. */
+typedef struct TopicTable {
+    TopicEntry **buckets;
+    size_t bucket_count;
+    size_t entry_count;
+    /* entries of interned topics, by id, so a PUBLISH finds its topic
+     * without hashing nor comparing names */
+    TopicEntry **by_id;
+    size_t by_id_cap;
+} TopicTable;
+
+/* A level of a topic filter with wildcards. Nodes are found through the
+ * table of their trie, by parent and level name, so they keep no arrays of
+ * children. */
+typedef struct FilterNode {
+    struct FilterNode *next;
+    struct FilterNode *parent;
+    /* the "+" child, looked at for every level of every match */
+    struct FilterNode *plus;
+    uint32_t hash;
+    size_t children;
+    /* subscribers of the filter ending at this level */
+    SubscriberList subs;
+    /* subscribers of the filter ending at this level followed by "/#" */
+    SubscriberList rest;
+    size_t level_len;
+    char level[];
+} FilterNode;
+
+/* Filters with `+` or `#`, split by topic level. Matching a topic only
+ * visits the levels it could match, whatever the amount of filters. */
+typedef struct FilterTrie {
+    FilterNode *root;
+    FilterNode **buckets;
+    size_t bucket_count;
+    size_t node_count;
+} FilterTrie;
+
+/* A shared subscription, `$share/<group>/<filter>`. Each PUBLISH matching
+ * the filter goes to a single member, taking turns. */
+typedef struct SharedGroup {
+    SubscriberList members;
+    /* member the next PUBLISH goes to, modulo the amount of members */
+    _Atomic size_t turn;
+    /* length of the `$share/<group>/` prefix of `name` */
+    size_t prefix_len;
+    size_t name_len;
+    char name[];
+} SharedGroup;
+
+/* Counters of the routing of PUBLISH packets */
+typedef struct MatchStats {
+    /* publishes no subscription could match, dropped after a cheap check */
+    unsigned long unmatched;
+    /* publishes whose subscribers had to be matched against filters, and
+     * were found in the cache or not */
+    unsigned long cache_hits;
+    unsigned long cache_misses;
+} MatchStats;
+
+/* Slots of the cache of matched subscribers, picked by topic hash */
+#define MATCH_CACHE_SLOTS 16384
+/* Longest topic name whose match is cached, the name is kept with it */
+#define MATCH_CACHE_NAME_MAX 256
+
+/* Subscribers of a topic, as worked out by `topic_index_match`. Kept for
+ * the next PUBLISH to the same topic, while the index doesn't change. */
+typedef struct CachedMatch {
+    /* in `retired`, once replaced */
+    struct CachedMatch *next;
+    /* of the topic, whose name is kept after `items` */
+    uint32_t hash;
+    size_t name_len;
+    const char *name;
+    unsigned long generation;
+    /* set if `subs` holds markers of shared groups, replaced by one of
+     * their members on every PUBLISH */
+    int shared;
+    SubscriberList subs;
+    Subscriber items[];
+} CachedMatch;
+
+/* Every subscription: exact topics are a single hash lookup away, filters
+ * with wildcards are matched in the trie. */
+typedef struct TopicIndex {
+    TopicTable exact;
+    FilterTrie wildcards;
+    /* filters in `wildcards`, the trie is skipped while there are none */
+    size_t wildcard_count;
+    /* Shared subscriptions. The group in slot `i` is subscribed to its filter
+     * as a marker with id `-(i + 1)`, which matching replaces by a member. */
+    SharedGroup **groups;
+    size_t group_cap;
+    size_t group_count;
+    /* Cached matches, by topic hash. Every change to the index bumps
+     * `generation`, which leaves all of them stale. A match replaced in its
+     * slot may still be read by other threads, it's kept in `retired` until
+     * nobody is matching, see `topic_index_reclaim`. */
+    _Atomic(CachedMatch*) *cache;
+    /* hash of the last topic that missed in each slot, see `cache_match` */
+    _Atomic uint32_t *candidates;
+    _Atomic unsigned long generation;
+    _Atomic(CachedMatch*) retired;
+    _Atomic size_t retired_count;
+    /* see `MatchStats`, counted by threads matching at the same time */
+    _Atomic unsigned long unmatched;
+    _Atomic unsigned long cache_hits;
+    _Atomic unsigned long cache_misses;
+} TopicIndex;
+
+uint32_t topic_hash(const char *name, size_t len);
+/* Tells if a topic filter has a `+` or `#` level */
+int topic_has_wildcards(const char *name, size_t len);
+/* Wildcards must take a whole level, and `#` must be the last one */
+int topic_filter_valid(const char *filter, size_t len);
+/* Length of the `$share/<group>/` prefix of a shared subscription's
+ * filter, or 0 if it isn't one */
+size_t topic_share_prefix(const char *filter, size_t len);
+/* Tells if `topic` is matched by `filter`, without any index */
+int topic_matches(const char *filter, size_t filter_len, const char *topic, size_t topic_len);
+
+/* The interned topic `name`, or a new transient one past TOPIC_INTERN_MAX
+ * or TOPIC_INTERN_BYTES. For subscriptions. Safe to call from several
+ * threads at once. */
+Topic *topic_intern(const char *name, size_t len);
+/* The interned topic `name`, or a new transient one. For PUBLISH: never
+ * interns anything nor takes a lock. */
+Topic *topic_lookup(const char *name, size_t len);
+/* Frees a transient topic, interned ones are kept */
+void topic_done(Topic *topic);
+size_t topic_interned_count(void);
+
+/* Returns 1 if `sub` wasn't in the list yet */
+int subscribers_add(SubscriberList *list, Subscriber sub);
+/* Returns 1 if `sub` was in the list */
+int subscribers_remove(SubscriberList *list, Subscriber sub);
+void subscribers_free(SubscriberList *list);
+
+void topics_init(TopicTable *table);
+/* Returns 1 if `sub` wasn't subscribed to the topic yet */
+int topics_add(TopicTable *table, const char *name, size_t len, Subscriber sub);
+/* Returns 1 if `sub` was subscribed to the topic */
+int topics_remove(TopicTable *table, const char *name, size_t len, Subscriber sub);
+TopicEntry *topics_find(TopicTable *table, const char *name, size_t len);
+TopicEntry *topics_find_topic(TopicTable *table, const Topic *topic);
+
+void filters_init(FilterTrie *trie);
+/* Same as `topics_add` and `topics_remove`, for filters with wildcards */
+int filters_add(FilterTrie *trie, const char *filter, size_t len, Subscriber sub);
+int filters_remove(FilterTrie *trie, const char *filter, size_t len, Subscriber sub);
+/* Appends the subscribers of every filter matching `topic` to `out` */
+void filters_match(FilterTrie *trie, const Topic *topic, SubscriberList *out);
+
+void topic_index_init(TopicIndex *index);
+int topic_index_add(TopicIndex *index, const char *filter, size_t len, Subscriber sub);
+int topic_index_remove(TopicIndex *index, const char *filter, size_t len, Subscriber sub);
+/* Tells if a subscription may match the topic `name`, only from its exact
+ * entry and the first level of the filters. Counts a topic none can match
+ * in `unmatched`. Allocates nothing, so a PUBLISH to a topic without
+ * subscribers is dropped before its topic is looked up. Safe to call from
+ * several threads at once, like `topic_index_match`. */
+int topic_index_may_match(TopicIndex *index, const char *name, size_t len);
+/* Subscribers a PUBLISH to `topic` goes to, each of them once, or NULL if
+ * there are none. Topics that have no exact subscription and whose first
+ * level starts no filter are found to have none without matching, and the
+ * ones matched before are taken from the cache. Each shared subscription
+ * adds one of its members. The
+ * result is either kept by the index or built in `scratch`, and is only
+ * valid until the index changes. Safe to call from several threads at once,
+ * as long as none of them changes the index. */
+const SubscriberList *topic_index_match(TopicIndex *index, const Topic *topic,
+                                        SubscriberList *scratch);
+MatchStats topic_index_stats(TopicIndex *index);
+/* Cached matches replaced since the last `topic_index_reclaim` */
+size_t topic_index_retired(TopicIndex *index);
+/* Frees them. Not thread safe, like changes to the index: no thread may be
+ * matching nor using a match. Changes do it as well. */
+void topic_index_reclaim(TopicIndex *index);
+
+/* Threads that may read a SharedIndex */
+#define SHARED_INDEX_READERS 1024
+
+/* A TopicIndex matched by many threads without taking any lock, even while
+ * it changes. There are two copies of it (left-right): readers use the
+ * active one, which stays as it is while they do. A change is made to the
+ * other copy, which then becomes the active one. Once every reader that
+ * was still in the old copy is done with it, the change is made to it too,
+ * and it waits for the next change. */
+typedef struct SharedIndex {
+    TopicIndex copies[2];
+    _Atomic unsigned active;
+    /* changes are made one at a time */
+    pthread_mutex_t write_lock;
+    /* For each reader thread, the copy it's reading plus one, or 0. On its
+     * own cache line, only written by its thread. */
+    struct {
+        _Alignas(64) _Atomic unsigned reading;
+    } readers[SHARED_INDEX_READERS];
+} SharedIndex;
+
+/* A change to a copy of a SharedIndex, made twice with the same `arg` */
+typedef void (*IndexChange)(TopicIndex *index, void *arg);
+
+void shared_index_init(SharedIndex *shared);
+/* Starts reading: returns the copy to match in, which doesn't change, nor
+ * do the matches and subscribers found in it, until `shared_index_done` */
+TopicIndex *shared_index_read(SharedIndex *shared);
+void shared_index_done(SharedIndex *shared);
+/* Calls `change` on each copy, while no thread reads it. Waits for the
+ * readers of the active copy, never blocks them. Must not be called while
+ * reading. */
+void shared_index_write(SharedIndex *shared, IndexChange change, void *arg);
+/* Counters of both copies together */
+MatchStats shared_index_stats(SharedIndex *shared);
+
+#endif
@@ -0,0 +1,198 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "errors.h"
+#include "uring.h"
+
+/* Helper function. Not in `uring.h` */
+static void *map_ring(int fd, size_t size, off_t offset) {
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    if (ptr == MAP_FAILED) {
+        perror("[io_uring mmap failed]");
+        exit(ERROR_SERVER);
+    }
+    return ptr;
+}
+
+void uring_init(Uring *ring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_CQ_ENTRIES;
+
+    memset(ring, 0, sizeof(Uring));
+    ring->fd = (int)syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &params);
+    if (ring->fd < 0) {
+        perror("[io_uring_setup failed]");
+        exit(ERROR_SERVER);
+    }
+
+    /* Submission and completion rings */
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size) { ring->sq_size = ring->cq_size; }
+        ring->sq_ptr = map_ring(ring->fd, ring->sq_size, IORING_OFF_SQ_RING);
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->sq_ptr = map_ring(ring->fd, ring->sq_size, IORING_OFF_SQ_RING);
+        ring->cq_ptr = map_ring(ring->fd, ring->cq_size, IORING_OFF_CQ_RING);
+    }
+
+    uint8_t *sq = (uint8_t*)ring->sq_ptr;
+    ring->sq_head  = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail  = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask  = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*)map_ring(ring->fd, ring->sqes_size, IORING_OFF_SQES);
+
+    uint8_t *cq = (uint8_t*)ring->cq_ptr;
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes    = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    /* Provided buffer ring, registered as group URING_BUF_GROUP */
+    ring->buf_ring_size = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    ring->buf_ring = (struct io_uring_buf_ring*)mmap(
+        NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+    );
+    ring->buf_base = (uint8_t*)malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    if (ring->buf_ring == MAP_FAILED || !ring->buf_base) {
+        fprintf(stderr, "[Memory error, stopping]\n");
+        exit(ERROR_SERVER);
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("[io_uring buffer ring registration failed]");
+        exit(ERROR_SERVER);
+    }
+
+    ring->buf_tail = 0;
+    for (unsigned bid = 0; bid < URING_BUF_COUNT; bid++) {
+        uring_recycle_buffer(ring, bid);
+    }
+}
+
+struct io_uring_sqe *uring_get_sqe(Uring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail;
+
+    if (tail - head >= ring->sq_entries) {
+        /* queue is full, hand what we have to the kernel */
+        uring_submit_and_wait(ring, 0);
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= ring->sq_entries) {
+            fprintf(stderr, "[io_uring submission queue stuck]\n");
+            exit(ERROR_SERVER);
+        }
+    }
+
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+
+    return sqe;
+}
+
+void uring_prep_multishot_accept(struct io_uring_sqe *sqe, int fd, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_multishot_recv(struct io_uring_sqe *sqe, int fd, uint64_t user_data) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg, uint64_t user_data) {
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    /* let the kernel retry short sends, so only errors lose bytes */
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_multishot_poll(struct io_uring_sqe *sqe, int fd, uint64_t user_data) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_cancel(struct io_uring_sqe *sqe, uint64_t target, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+}
+
+int uring_submit_and_wait(Uring *ring, unsigned wait_nr) {
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    for (;;) {
+        int ret = (int)syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait_nr, flags, NULL, 0);
+        if (ret >= 0) {
+            ring->to_submit -= (unsigned)ret < ring->to_submit ? (unsigned)ret : ring->to_submit;
+            return ret;
+        }
+        if (errno == EINTR) { continue; }
+        /* completions must be reaped before more work can be queued */
+        if (errno == EBUSY || errno == EAGAIN) { return 0; }
+        perror("[io_uring_enter failed]");
+        exit(ERROR_SERVER);
+    }
+}
+
+struct io_uring_cqe *uring_peek_cqe(Uring *ring) {
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(Uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+uint8_t *uring_buffer(Uring *ring, unsigned bid) {
+    return ring->buf_base + (size_t)bid * URING_BUF_SIZE;
+}
+
+void uring_recycle_buffer(Uring *ring, unsigned bid) {
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUF_COUNT - 1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_buffer(ring, bid);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = (uint16_t)bid;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,75 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+/* Entries in the submission queue, the completion queue is bigger since
+ * multishot requests post many completions for a single submission */
+#define URING_SQ_ENTRIES 512
+#define URING_CQ_ENTRIES 4096
+/* Packets gathered in a single `sendmsg` */
+#define URING_SEND_BATCH 256
+
+/* Provided buffers, filled by the kernel on multishot receives */
+#define URING_BUF_COUNT 512
+#define URING_BUF_SIZE  4096
+#define URING_BUF_GROUP 0
+
+/* Minimal io_uring wrapper over the raw system calls, so the broker does not
+ * depend on liburing. Each reactor thread owns one ring. */
+typedef struct Uring {
+    int fd;
+
+    /* submission queue */
+    void *sq_ptr;
+    size_t sq_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned sq_entries;
+    unsigned to_submit;
+
+    /* completion queue */
+    void *cq_ptr;
+    size_t cq_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* provided buffer ring */
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    uint8_t *buf_base;
+    uint16_t buf_tail;
+} Uring;
+
+void uring_init(Uring *ring);
+
+/* Returns a zeroed submission entry, submitting pending ones if the queue is full */
+struct io_uring_sqe *uring_get_sqe(Uring *ring);
+void uring_prep_multishot_accept(struct io_uring_sqe *sqe, int fd, uint64_t user_data);
+void uring_prep_multishot_recv(struct io_uring_sqe *sqe, int fd, uint64_t user_data);
+/* `msg` must stay valid until the send completes */
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg, uint64_t user_data);
+void uring_prep_multishot_poll(struct io_uring_sqe *sqe, int fd, uint64_t user_data);
+void uring_prep_cancel(struct io_uring_sqe *sqe, uint64_t target, uint64_t user_data);
+
+/* Submits every prepared entry with a single `io_uring_enter`, waiting for
+ * at least `wait_nr` completions */
+int uring_submit_and_wait(Uring *ring, unsigned wait_nr);
+
+/* Returns the next completion, or NULL. Must be followed by `uring_cqe_seen` */
+struct io_uring_cqe *uring_peek_cqe(Uring *ring);
+void uring_cqe_seen(Uring *ring);
+
+uint8_t *uring_buffer(Uring *ring, unsigned bid);
+void uring_recycle_buffer(Uring *ring, unsigned bid);
+
+#endif